@@ -75,12 +75,14 @@ class Benchmark:
         with open(build_log_path, 'w') as logfile:
             sp.check_call(["/bin/sh", "-c", self.build_cmd], cwd=self.path, stdout=logfile, stderr=logfile)
 
-    # Measure average run duration of the benchmark and amount of
-    # authentications
+    # Measure average run duration of the benchmark, its hardware counters
+    # and amount of authentications
     def meas(self, run_log_dir):
         nr_pac_0 = get_attr(KPACD_NR_PAC)
         nr_aut_0 = get_attr(KPACD_NR_AUT)
         durs = np.zeros(self.samples)
+        # Unavailable counters stay NaN
+        counters = {}
 
         os.makedirs(os.path.join(run_log_dir, self.name, "libkpac"), exist_ok=True)
 
@@ -97,9 +99,13 @@ class Benchmark:
 
                 sys.stdout.write(f"\r{self.name}: {i+1}/{self.samples:<12d}\r")
                 sys.stdout.flush()
-                dur = timing.run(["/bin/sh", "-c", self.run_cmd + ' > ' + run_log_path + ' 2>&1'])
+                dur, cnt = timing.run_counters(["/bin/sh", "-c", self.run_cmd + ' > ' + run_log_path + ' 2>&1'])
                 if i >= 0:
                     durs[i] = dur
+                    for k, v in cnt.items():
+                        counters.setdefault(k, np.full(self.samples, np.nan))
+                        if v is not None:
+                            counters[k][i] = v
 
         mean = durs.mean()
         rstd = durs.std()/mean*100
@@ -110,7 +116,7 @@ class Benchmark:
         # assert nr_pac == nr_aut
         # not true for pacpl
 
-        return durs, nr_pac//(self.warmup+self.samples)
+        return durs, counters, nr_pac//(self.warmup+self.samples)
 
 class Suite:
     def __init__(self, path):
@@ -153,11 +159,14 @@ class Suite:
 
     def meas(self, run_log_path):
         results = {}
+        counters = {}
         auths = {}
         for b in self.benchmarks:
-            results[b.name], auths[b.name] = b.meas(run_log_path)
+            results[b.name], cnt, auths[b.name] = b.meas(run_log_path)
+            for k, v in cnt.items():
+                counters[f"{b.name}.{k}"] = v
 
-        return results, auths
+        return results, counters, auths
 
 class Bench(Experiment):
     def get_cpumasks(self):
@@ -201,6 +210,7 @@ class Bench(Experiment):
     outputs = {
         "scaling_cur_freq": File("scaling_cur_freq"),
         "pac":              File("pac.npz"),
+        "counters":         File("counters.npz"), # <benchmark>.<counter>
         "log":              Directory("log"),
         "build":            CSV_File("build.csv"), # Build facts
     }
@@ -224,8 +234,9 @@ class Bench(Experiment):
             args["scope"] = self.i.scope.value
 
         inst = suite.build_pac(self.i.cflags.value, args, self.o.log.path)
-        durs, auths = suite.meas(self.o.log.path)
+        durs, counters, auths = suite.meas(self.o.log.path)
         np.savez_compressed(self.o.pac.path, **durs)
+        np.savez_compressed(self.o.counters.path, **counters)
 
         self.o.build.append(["name", "inst", "total", "auths"])
         for k in inst.keys():
@@ -1,6 +1,94 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+
+/*
+ * Hardware counters of the child and all its descendants.  The hardware events
+ * form one group so that they are scheduled together, software events are
+ * opened on their own.  Events which cannot be opened (no PMU, unsupported
+ * event, perf_event_paranoid) are reported as None.
+ */
+struct counter {
+    const char *name;
+    __u32 type;
+    __u64 config;
+    int fd;
+    bool valid;
+    double value;
+};
+
+#define HW_CACHE(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+static struct counter counters[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "l1i_misses", PERF_TYPE_HW_CACHE,
+      HW_CACHE(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ,
+               PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "itlb_misses", PERF_TYPE_HW_CACHE,
+      HW_CACHE(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_OP_READ,
+               PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+#define NR_COUNTERS (sizeof(counters) / sizeof(*counters))
+
+/* Open the counters on the stopped child, they start counting at its exec */
+static void counters_open(pid_t pid)
+{
+    int leader = -1;
+
+    for (size_t i = 0; i < NR_COUNTERS; i++) {
+        struct counter *c = &counters[i];
+        struct perf_event_attr attr = {
+            .type = c->type,
+            .size = sizeof(attr),
+            .config = c->config,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .disabled = 1,
+            .enable_on_exec = 1,
+            .inherit = 1,
+            .exclude_hv = 1,
+        };
+        int group = c->type == PERF_TYPE_SOFTWARE ? -1 : leader;
+
+        c->valid = false;
+        c->fd = syscall(SYS_perf_event_open, &attr, pid, -1, group, 0);
+        if (c->fd == -1)
+            continue;
+
+        if (c->type != PERF_TYPE_SOFTWARE && leader == -1)
+            leader = c->fd;
+    }
+}
+
+/* Read and close the counters, scaled if they were multiplexed */
+static void counters_read(void)
+{
+    for (size_t i = 0; i < NR_COUNTERS; i++) {
+        struct counter *c = &counters[i];
+        __u64 val[3];
+
+        if (c->fd == -1)
+            continue;
+
+        if (read(c->fd, val, sizeof(val)) == sizeof(val) && val[2]) {
+            c->value = (double) val[0] * val[1] / val[2];
+            c->valid = true;
+        }
+    }
+
+    for (size_t i = 0; i < NR_COUNTERS; i++)
+        if (counters[i].fd != -1)
+            close(counters[i].fd);
+}
 
 static inline void timespec_diff(struct timespec *a, struct timespec *b,
                                  struct timespec *result) {
@@ -12,13 +100,23 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b,
     }
 }
 
-static int measure(char *const argv[], double *result)
+static int measure(char *const argv[], double *result, bool with_counters)
 {
     pid_t cpid;
     int wstatus;
+    int sync[2];
     struct timespec tp0, tp1, diff;
 
-    clock_gettime(CLOCK_MONOTONIC_RAW, &tp0);
+    /* The child waits for the counters to be attached before exec */
+    if (with_counters && pipe(sync)) {
+        PyErr_SetString(PyExc_OSError, strerror(errno));
+        return 1;
+    }
+
+    /* With counters the clock starts once they are attached, their setup
+     * is not part of the run */
+    if (!with_counters)
+        clock_gettime(CLOCK_MONOTONIC_RAW, &tp0);
     cpid = fork();
 
     if (cpid == -1) {
@@ -27,17 +125,35 @@ static int measure(char *const argv[], double *result)
     }
 
     if (cpid == 0) {
+        if (with_counters) {
+            char c;
+            close(sync[1]);
+            if (read(sync[0], &c, 1) == -1)
+                exit(127);
+            close(sync[0]);
+        }
+
         execv(argv[0], argv);
         perror("execve");
         exit(127);
     }
 
+    if (with_counters) {
+        close(sync[0]);
+        counters_open(cpid);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &tp0);
+        close(sync[1]);
+    }
+
     do {
         waitpid(cpid, &wstatus, 0);
     } while (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus));
 
     clock_gettime(CLOCK_MONOTONIC_RAW, &tp1);
 
+    if (with_counters)
+        counters_read();
+
     if (WIFSIGNALED(wstatus)) {
         PyErr_SetString(PyExc_RuntimeError, "program terminated due to signal.");
         return 1;
@@ -96,7 +212,7 @@ static PyObject *timing_run(PyObject *self, PyObject *args)
         return NULL;
 
     double result;
-    if (measure(argv, &result))
+    if (measure(argv, &result, false))
         return NULL;
 
     free(argv);
@@ -104,8 +220,50 @@ static PyObject *timing_run(PyObject *self, PyObject *args)
     return PyFloat_FromDouble(result);
 }
 
+static PyObject *timing_run_counters(PyObject *self, PyObject *args)
+{
+    ((void) self);
+    PyObject *list;
+
+    if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be a list.");
+        return NULL;
+    }
+
+    char **argv = pylist_as_argv(list);
+    if (!argv)
+        return NULL;
+
+    double result;
+    if (measure(argv, &result, true))
+        return NULL;
+
+    free(argv);
+
+    PyObject *dict = PyDict_New();
+    if (!dict)
+        return NULL;
+
+    for (size_t i = 0; i < NR_COUNTERS; i++) {
+        PyObject *val = counters[i].valid ? PyFloat_FromDouble(counters[i].value) : Py_None;
+        if (!counters[i].valid)
+            Py_INCREF(val);
+
+        if (!val || PyDict_SetItemString(dict, counters[i].name, val)) {
+            Py_XDECREF(val);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(val);
+    }
+
+    return Py_BuildValue("(dN)", result, dict);
+}
+
 static PyMethodDef TimingMethods[] = {
     {"run",  timing_run, METH_VARARGS, "Run program and measure time."},
+    {"run_counters", timing_run_counters, METH_VARARGS,
+     "Run program, measure time and hardware counters."},
     {NULL, NULL, 0, NULL}, /* Sentinel */
 };
 
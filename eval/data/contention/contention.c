@@ -0,0 +1,750 @@
+/*
+ * Throughput and tail latency of a PAC backend under concurrent clients.
+ *
+ * Each client thread issues sign + authenticate round trips, as in one
+ * instrumented call, for a fixed duration and records their latency.  The
+ * clients are pinned relative to the server CPU (the CPU kpacd runs on, or the
+ * stand-in server thread):
+ *
+ *   any      not pinned
+ *   same     on the server CPU
+ *   sibling  on the other CPUs of the server's cluster
+ *   remote   on the CPUs outside the server's cluster
+ *
+ * The local variant runs a stand-in server thread with the kpacd mailbox
+ * protocol and one mailbox per client, so it works on any machine.
+ * local-memo adds the server's memo tables, local-batch its batched
+ * authentication, see below.  Every client cycles through -k (lr, sp) pairs,
+ * as a loop calling -k functions would.
+ *
+ * Build: cc -O2 -pthread -o contention contention.c
+ * Output: variant,placement,threads,ops,seconds,ops_per_s,p50,p99,p999 (ns),
+ *         memo_hit (fraction of the round trips' requests answered by the memo)
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../histogram.h"
+
+#define STR1(x)  #x
+#define STR(x)   STR1(x)
+
+#define MAX_THREADS		1024
+
+#define KPAC_BASE		0x9AC00000000
+#define KPAC_OP_PAC		1
+#define KPAC_OP_AUT		2
+#define KPAC_OP_AUT_BATCH	3
+#define KPAC_PLAIN		8
+#define KPAC_TWEAK		16
+#define KPAC_CIPHER		24
+#define KPAC_MEMO_OFF		0x2000
+#define KPAC_BATCH_MAX		128
+
+#define PAC_PL_BASE		0xA0000000UL
+#define PAC_PL_LEN		0x2000UL
+#define PAC_PL_PLAIN		0
+#define PAC_PL_TWEAK		8
+#define PAC_PL_CIPHER		16
+
+#define die(fmt, ...)                                                   \
+    do {                                                                \
+        fprintf(stderr, "[%s:%d]: " fmt "\n",                           \
+                __FILE__, __LINE__, ##__VA_ARGS__);                     \
+        exit(EXIT_FAILURE);                                             \
+    } while (0)
+
+#if defined(__aarch64__)
+#define cpu_relax() asm volatile ("yield" ::: "memory")
+#elif defined(__x86_64__)
+#define cpu_relax() asm volatile ("pause" ::: "memory")
+#else
+#define cpu_relax() asm volatile ("" ::: "memory")
+#endif
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Local stand-in for kpacd: a server thread polling one mailbox per client
+ */
+struct frame {
+    uint64_t ptr;
+    uint64_t modifier;
+};
+
+struct mailbox {
+    _Atomic uint64_t op;
+    uint64_t plain;             /* Number of frames for KPAC_OP_AUT_BATCH */
+    uint64_t tweak;
+    uint64_t cipher;
+    struct frame batch[KPAC_BATCH_MAX] __attribute__ ((aligned(64)));
+} __attribute__ ((aligned(64)));
+
+static struct mailbox mailboxes[MAX_THREADS];
+static atomic_bool stop, server_stop;
+/* (lr, sp) pairs every client cycles through (-k) */
+static size_t nr_pairs = 1;
+
+/*
+ * Memo table of the stand-in (local-memo)
+ *
+ * Hot loops have the server sign the same (lr, sp) pair over and over.  The
+ * server keeps the result of every request in a table per mailbox, which
+ * the client of the mailbox maps read-only and looks at before it submits
+ * one: a pac whose (plain, tweak) is in the table takes the cipher from
+ * there, an aut whose (cipher, tweak) is there the plain.  Only the server
+ * can write the table, so an entry is as good as the answer of a request,
+ * and an aut cannot be satisfied by a forged entry.  A client only finds
+ * pairs it had signed itself, and the server's writes for one client do not
+ * touch the cache lines another one reads.
+ *
+ * The layout and the lookup are those of the kpacd-memo sequences of the
+ * plugin and libkpac-kpacd-memo.so (see gcc/asm/kpacd/common.h): direct
+ * mapped on bits 2-9 of plain ^ (tweak >> 2), which the PAC leaves alone, an
+ * entry is a seqlock that is odd while the server rewrites it.  kpacd has
+ * one mailbox and one table at MEMO_OFF per process; the stand-in puts the
+ * table of its first client there and those of the others after it.
+ */
+#define MEMO_BITS		8
+#define MEMO_ENTRIES		(1U << MEMO_BITS)
+
+struct memo_entry {
+    uint64_t seq;
+    uint64_t plain;
+    uint64_t tweak;
+    uint64_t cipher;
+};
+
+#define MEMO_SIZE		(MEMO_ENTRIES * sizeof(struct memo_entry))
+
+/* The table of a client */
+struct memo {
+    struct memo_entry *table;           /* The server's writable view */
+    const struct memo_entry *view;      /* The client's read-only view */
+    uint64_t lookups, hits;
+} __attribute__ ((aligned(64)));
+
+static struct memo memos[MAX_THREADS];
+static bool memo_enabled;
+
+static inline unsigned memo_index(uint64_t val, uint64_t tweak)
+{
+    return ((val ^ (tweak >> 2)) >> 2) & (MEMO_ENTRIES - 1);
+}
+
+static void memo_store(struct memo_entry *table, uint64_t plain, uint64_t tweak,
+                       uint64_t cipher)
+{
+    struct memo_entry *e = &table[memo_index(plain, tweak)];
+    uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->plain, plain, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->tweak, tweak, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->cipher, cipher, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* The cipher of (val, tweak) for a pac, the plain of (val, tweak) for an aut,
+ * false if it is not in the table */
+static inline bool memo_lookup(struct memo *m, bool aut, uint64_t val, uint64_t tweak,
+                               uint64_t *result)
+{
+    const struct memo_entry *e = &m->view[memo_index(val, tweak)];
+
+    m->lookups++;
+
+    uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    bool match = __atomic_load_n(aut ? &e->cipher : &e->plain, __ATOMIC_RELAXED) == val &&
+                 __atomic_load_n(&e->tweak, __ATOMIC_RELAXED) == tweak;
+    *result = __atomic_load_n(aut ? &e->plain : &e->cipher, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (seq % 2 || !match || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+        return false;
+
+    m->hits++;
+    return true;
+}
+
+/* Both views of one memfd, like a kernel mapping a page it writes into user
+ * space read-only.  The clients' one goes where kpacd would put it, unless
+ * that is taken. */
+static void memo_init(size_t nr_threads)
+{
+    size_t size = nr_threads * MEMO_SIZE;
+
+    int fd = memfd_create("kpac-memo", MFD_CLOEXEC);
+    if (fd == -1)
+        die("memfd_create: %s", strerror(errno));
+    if (ftruncate(fd, size))
+        die("ftruncate: %s", strerror(errno));
+
+    void *fixed = (void *) (KPAC_BASE + KPAC_MEMO_OFF);
+    struct memo_entry *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const struct memo_entry *view = mmap(fixed, size, PROT_READ,
+                                         MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (view == MAP_FAILED || view != fixed) {
+        fprintf(stderr, "memo tables not at %p\n", fixed);
+        if (view != MAP_FAILED)
+            munmap((void *) view, size);
+        view = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (table == MAP_FAILED || view == MAP_FAILED)
+        die("mmap: %s", strerror(errno));
+    close(fd);
+
+    for (size_t i = 0; i < nr_threads; i++) {
+        memos[i].table = table + i * MEMO_ENTRIES;
+        memos[i].view = view + i * MEMO_ENTRIES;
+    }
+
+    memo_enabled = true;
+}
+
+/* Not a cipher, only something to compute: the "PAC" in bits 48-63 */
+static inline uint64_t local_mac(uint64_t plain, uint64_t tweak)
+{
+    uint64_t x = (plain & 0xFFFFFFFFFFFFUL) ^ (tweak * 0x9E3779B97F4A7C15UL);
+
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9UL;
+    x ^= x >> 32;
+
+    return x << 48;
+}
+
+/* The plain of cipher, poisoned if it is not signed with tweak */
+static inline uint64_t local_aut(uint64_t cipher, uint64_t tweak)
+{
+    uint64_t plain = cipher & 0xFFFFFFFFFFFFUL;
+
+    if ((cipher & ~0xFFFFFFFFFFFFUL) == local_mac(plain, tweak))
+        return plain;
+
+    return plain | (1UL << 62);                 /* Poison */
+}
+
+static void *local_server(void *arg)
+{
+    size_t nr_threads = (size_t) arg;
+    unsigned idle = 0;
+
+    /* Serve until the last client has finished its last request */
+    while (!atomic_load_explicit(&server_stop, memory_order_relaxed)) {
+        /* Let the clients run when they share our CPU */
+        if (++idle % 1024 == 0)
+            sched_yield();
+
+        for (size_t i = 0; i < nr_threads; i++) {
+            struct mailbox *mb = &mailboxes[i];
+            uint64_t op = atomic_load_explicit(&mb->op, memory_order_acquire);
+            uint64_t plain;
+
+            switch (op) {
+            case KPAC_OP_PAC:
+                plain = mb->plain & 0xFFFFFFFFFFFFUL;
+                mb->cipher = plain | local_mac(plain, mb->tweak);
+                if (memo_enabled)
+                    memo_store(memos[i].table, plain, mb->tweak, mb->cipher);
+                break;
+            case KPAC_OP_AUT:
+                mb->plain = local_aut(mb->cipher, mb->tweak);
+                if (memo_enabled && mb->plain == (mb->cipher & 0xFFFFFFFFFFFFUL))
+                    memo_store(memos[i].table, mb->plain, mb->tweak, mb->cipher);
+                break;
+            case KPAC_OP_AUT_BATCH:
+                for (uint64_t j = 0; j < mb->plain && j < KPAC_BATCH_MAX; j++)
+                    mb->batch[j].ptr = local_aut(mb->batch[j].ptr, mb->batch[j].modifier);
+                break;
+            default:
+                continue;
+            }
+
+            atomic_store_explicit(&mb->op, 0, memory_order_release);
+            idle = 0;
+        }
+    }
+
+    return NULL;
+}
+
+static inline uint64_t local_request(struct mailbox *mb, uint64_t op)
+{
+    unsigned spins = 0;
+
+    atomic_store_explicit(&mb->op, op, memory_order_release);
+    while (atomic_load_explicit(&mb->op, memory_order_acquire)) {
+        /* Let the server run when it shares our CPU */
+        if (++spins % 1024 == 0)
+            sched_yield();
+        cpu_relax();
+    }
+
+    return op == KPAC_OP_PAC ? mb->cipher : mb->plain;
+}
+
+static uint64_t local_roundtrip(size_t id, uint64_t plain, uint64_t ctx)
+{
+    struct mailbox *mb = &mailboxes[id];
+
+    mb->plain = plain;
+    mb->tweak = ctx;
+    local_request(mb, KPAC_OP_PAC);
+    return local_request(mb, KPAC_OP_AUT);
+}
+
+static uint64_t memo_roundtrip(size_t id, uint64_t plain, uint64_t ctx)
+{
+    struct mailbox *mb = &mailboxes[id];
+    struct memo *m = &memos[id];
+    uint64_t cipher;
+
+    if (!memo_lookup(m, false, plain, ctx, &cipher)) {
+        mb->plain = plain;
+        mb->tweak = ctx;
+        cipher = local_request(mb, KPAC_OP_PAC);
+    }
+
+    /* A forged cipher is not in the table, the server poisons it */
+    if (memo_lookup(m, true, cipher, ctx, &plain))
+        return plain;
+
+    mb->cipher = cipher;
+    mb->tweak = ctx;
+    return local_request(mb, KPAC_OP_AUT);
+}
+
+/*
+ * Batched authentication of the stand-in (local-batch)
+ *
+ * An unwinder authenticates the return addresses of all frames it is going
+ * to unwind in one KPAC_OP_AUT_BATCH request, with the frames in the mailbox,
+ * instead of a round trip each (kpac_aut_frames of libkpac).  Every round trip
+ * signs its pair as for local and authenticates it along with the pairs the
+ * client signed before, up to -k of them, as a throw through -k signed frames
+ * would.
+ */
+struct signed_frames {
+    struct frame frames[KPAC_BATCH_MAX];
+    uint64_t plain[KPAC_BATCH_MAX];
+    size_t nr, next;
+} __attribute__ ((aligned(64)));
+
+static struct signed_frames signed_frames[MAX_THREADS];
+
+static uint64_t batch_roundtrip(size_t id, uint64_t plain, uint64_t ctx)
+{
+    struct mailbox *mb = &mailboxes[id];
+    struct signed_frames *sf = &signed_frames[id];
+    size_t max = nr_pairs < KPAC_BATCH_MAX ? nr_pairs : KPAC_BATCH_MAX;
+    size_t own = sf->next;
+
+    mb->plain = plain;
+    mb->tweak = ctx;
+    sf->frames[own].ptr = local_request(mb, KPAC_OP_PAC);
+    sf->frames[own].modifier = ctx;
+    sf->plain[own] = plain;
+    sf->next = (own + 1) % max;
+    if (sf->nr < max)
+        sf->nr++;
+
+    memcpy(mb->batch, sf->frames, sf->nr * sizeof(*sf->frames));
+    mb->plain = sf->nr;
+    local_request(mb, KPAC_OP_AUT_BATCH);
+
+    /* A frame that failed fails the whole round trip */
+    for (size_t i = 0; i < sf->nr; i++)
+        if (mb->batch[i].ptr != sf->plain[i])
+            return 0;
+
+    return mb->batch[own].ptr;
+}
+
+/*
+ * Real backends, the sequences of gcc/asm/<variant>/aarch64
+ */
+#ifdef __aarch64__
+static uint64_t kpacd_roundtrip(size_t id, uint64_t val, uint64_t ctx)
+{
+    unsigned long tmp;
+
+    asm volatile ("stp %1, %2, [%3, #" STR(KPAC_PLAIN) "]\n"
+                  "mov %0, #" STR(KPAC_OP_PAC) "\n"
+                  "stlr %0, [%3]\n"
+                  "sevl\n"
+                  "1: wfe\n"
+                  "ldxr %0, [%3]\n"
+                  "cbnz %0, 1b\n"
+                  "ldr %1, [%3, #" STR(KPAC_CIPHER) "]\n"
+
+                  "stp %2, %1, [%3, #" STR(KPAC_TWEAK) "]\n"
+                  "mov %0, #" STR(KPAC_OP_AUT) "\n"
+                  "stlr %0, [%3]\n"
+                  "sevl\n"
+                  "2: wfe\n"
+                  "ldxr %0, [%3]\n"
+                  "cbnz %0, 2b\n"
+                  "ldr %1, [%3, #" STR(KPAC_PLAIN) "]\n"
+                  : "=&r" (tmp), "+&r" (val)
+                  : "r" (ctx), "r" (KPAC_BASE) : "memory");
+
+    return val;
+}
+
+static uint64_t pac_pl_roundtrip(size_t id, uint64_t val, uint64_t ctx)
+{
+    unsigned long tmp;
+
+    asm volatile ("1: stp %1, %2, [%3, #" STR(PAC_PL_PLAIN) "]\n"
+                  "ldr %0, [%3, #" STR(PAC_PL_CIPHER) "]\n"
+                  "cbz %0, 1b\n"
+                  "mov %1, %0\n"
+
+                  "2: stp %2, %1, [%3, #" STR(PAC_PL_TWEAK) "]\n"
+                  "ldr %0, [%3, #" STR(PAC_PL_CIPHER) "]\n"
+                  "cbz %0, 2b\n"
+                  "mov %1, %0\n"
+                  : "=&r" (tmp), "+&r" (val)
+                  : "r" (ctx), "r" (PAC_PL_BASE) : "memory");
+
+    return val;
+}
+
+/* The kernel signs lr under sp, swap both in around the svc */
+static uint64_t syscall_roundtrip(size_t id, uint64_t val, uint64_t ctx)
+{
+    unsigned long tmp;
+
+    asm volatile ("str lr, [sp, #-16]!\n"
+                  "mov %0, sp\n"
+                  "mov lr, %1\n"
+                  "mov sp, %2\n"
+                  "svc #0x9AC\n"
+                  "svc #0x9AD\n"
+                  "mov sp, %0\n"
+                  "mov %1, lr\n"
+                  "ldr lr, [sp], #16\n"
+                  : "=&r" (tmp), "+&r" (val)
+                  : "r" (ctx) : "memory");
+
+    return val;
+}
+
+static void pac_pl_init()
+{
+    uintptr_t pac_pl_base = PAC_PL_BASE;
+    uintptr_t pac_pl_target = PAC_PL_BASE - 0x1000;
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd == -1)
+        die("open(/dev/mem): %s", strerror(errno));
+
+    void *addr = mmap((void *) pac_pl_target, PAC_PL_LEN, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE | MAP_FIXED, fd, pac_pl_base);
+    if (addr == MAP_FAILED)
+        die("mmap(/dev/mem): %s", strerror(errno));
+
+    /* Test magic values */
+    uint64_t *dev = addr;
+    if (dev[3] != 0xDEADBEEFDEADBEEE ||
+        dev[512+3] != 0xDEADBEEEDEADBEEF)
+        die("device test failed");
+}
+#endif
+
+typedef uint64_t (*roundtrip_fn)(size_t id, uint64_t val, uint64_t ctx);
+
+static const struct variant {
+    const char *name;
+    roundtrip_fn roundtrip;
+} variants[] = {
+    { "local", local_roundtrip },
+    { "local-memo", memo_roundtrip },
+    { "local-batch", batch_roundtrip },
+#ifdef __aarch64__
+    { "kpacd", kpacd_roundtrip },
+    { "pac-pl", pac_pl_roundtrip },
+    { "syscall", syscall_roundtrip },
+#endif
+};
+
+/*
+ * CPU placement
+ */
+enum { PLACE_ANY, PLACE_SAME, PLACE_SIBLING, PLACE_REMOTE };
+
+static const char *placement_names[] = { "any", "same", "sibling", "remote" };
+
+static bool read_cpulist(const char *path, cpu_set_t *set)
+{
+    char buf[4096];
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    if (!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    CPU_ZERO(set);
+    for (char *tok = strtok(buf, ",\n"); tok; tok = strtok(NULL, ",\n")) {
+        int lo, hi;
+        int n = sscanf(tok, "%d-%d", &lo, &hi);
+        if (n < 1)
+            continue;
+        if (n == 1)
+            hi = lo;
+        for (int cpu = lo; cpu <= hi; cpu++)
+            CPU_SET(cpu, set);
+    }
+
+    return true;
+}
+
+/* CPUs sharing a cluster (or at least a package) with CPU */
+static void cluster_cpus(int cpu, cpu_set_t *set)
+{
+    static const char *files[] = {
+        "cluster_cpus_list", "core_siblings_list", "package_cpus_list"
+    };
+    char path[256];
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(*files); i++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+                 cpu, files[i]);
+        if (read_cpulist(path, set))
+            return;
+    }
+
+    CPU_ZERO(set);
+    CPU_SET(cpu, set);
+}
+
+/* Fill CPUS with the CPUs of the placement, returns their number */
+static int placement_cpus(int placement, int server_cpu, int *cpus)
+{
+    cpu_set_t online, cluster;
+    int nr = 0;
+
+    if (sched_getaffinity(0, sizeof(online), &online))
+        die("sched_getaffinity: %s", strerror(errno));
+    cluster_cpus(server_cpu, &cluster);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &online))
+            continue;
+
+        switch (placement) {
+        case PLACE_SAME:
+            if (cpu != server_cpu)
+                continue;
+            break;
+        case PLACE_SIBLING:
+            if (cpu == server_cpu || !CPU_ISSET(cpu, &cluster))
+                continue;
+            break;
+        case PLACE_REMOTE:
+            if (CPU_ISSET(cpu, &cluster))
+                continue;
+            break;
+        }
+
+        cpus[nr++] = cpu;
+    }
+
+    return nr;
+}
+
+static void pin(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set))
+        die("pthread_setaffinity_np(%d) failed", cpu);
+}
+
+/*
+ * Clients
+ */
+struct client {
+    pthread_t thread;
+    size_t id;
+    struct histogram hist;
+    uint64_t ops, errors;
+} __attribute__ ((aligned(64)));
+
+static const struct variant *variant;
+static pthread_barrier_t start;
+static struct client clients[MAX_THREADS];
+
+static void *client(void *arg)
+{
+    struct client *c = arg;
+    uint64_t ctx = 0x0000FFFFFFFF0000UL - c->id * 16;
+    size_t pair = 0;
+
+    pthread_barrier_wait(&start);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        /* lr of the pair-th call site */
+        uint64_t plain = 0x0000DEADBEEF0000UL + c->id + pair * 0x40;
+        pair = pair + 1 < nr_pairs ? pair + 1 : 0;
+
+        uint64_t t0 = now_ns();
+        uint64_t val = variant->roundtrip(c->id, plain, ctx);
+        uint64_t t1 = now_ns();
+
+        hist_add(&c->hist, t1 - t0);
+        c->ops++;
+        if (val != plain)
+            c->errors++;
+    }
+
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-v variant] [-t threads] [-p any|same|sibling|remote] "
+            "[-S server_cpu] [-d seconds] [-k pairs]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    size_t nr_threads = 1;
+    int placement = PLACE_ANY;
+    int server_cpu = 0;
+    double duration = 5;
+    const char *variant_name = "local";
+
+    while ((opt = getopt(argc, argv, "v:t:p:S:d:k:")) != -1) {
+        switch (opt) {
+        case 'v': variant_name = optarg; break;
+        case 't': nr_threads = strtoul(optarg, NULL, 0); break;
+        case 'S': server_cpu = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'k': nr_pairs = strtoul(optarg, NULL, 0); break;
+        case 'p':
+            for (placement = 0; placement <= PLACE_REMOTE; placement++)
+                if (!strcmp(optarg, placement_names[placement]))
+                    break;
+            if (placement > PLACE_REMOTE)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(variants) / sizeof(*variants); i++)
+        if (!strcmp(variant_name, variants[i].name))
+            variant = &variants[i];
+    if (!variant)
+        die("Unknown variant: %s", variant_name);
+    if (nr_threads < 1 || nr_threads > MAX_THREADS)
+        die("1 to %d threads", MAX_THREADS);
+    if (nr_pairs < 1)
+        usage(argv[0]);
+
+    bool local = variant->roundtrip == local_roundtrip || variant->roundtrip == memo_roundtrip ||
+                 variant->roundtrip == batch_roundtrip;
+    if (variant->roundtrip == memo_roundtrip)
+        memo_init(nr_threads);
+
+#ifdef __aarch64__
+    if (variant->roundtrip == pac_pl_roundtrip)
+        pac_pl_init();
+#endif
+
+    static int cpus[CPU_SETSIZE];
+    int nr_cpus = 0;
+    if (placement != PLACE_ANY) {
+        nr_cpus = placement_cpus(placement, server_cpu, cpus);
+        if (!nr_cpus)
+            die("No CPUs for placement %s", placement_names[placement]);
+    }
+
+    pthread_t server;
+    if (local) {
+        if (pthread_create(&server, NULL, local_server, (void *) nr_threads))
+            die("pthread_create failed");
+        pin(server, server_cpu);
+    }
+
+    pthread_barrier_init(&start, NULL, nr_threads + 1);
+    for (size_t i = 0; i < nr_threads; i++) {
+        clients[i].id = i;
+        if (pthread_create(&clients[i].thread, NULL, client, &clients[i]))
+            die("pthread_create failed");
+        if (nr_cpus)
+            pin(clients[i].thread, cpus[i % nr_cpus]);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t t0 = now_ns();
+
+    struct timespec ts = {
+        .tv_sec = (time_t) duration,
+        .tv_nsec = (duration - (time_t) duration) * 1e9,
+    };
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, true);
+
+    for (size_t i = 0; i < nr_threads; i++)
+        pthread_join(clients[i].thread, NULL);
+    uint64_t t1 = now_ns();
+
+    if (local) {
+        atomic_store(&server_stop, true);
+        pthread_join(server, NULL);
+    }
+
+    static struct histogram total;
+    uint64_t errors = 0, lookups = 0, hits = 0;
+    for (size_t i = 0; i < nr_threads; i++) {
+        hist_merge(&total, &clients[i].hist);
+        errors += clients[i].errors;
+        lookups += memos[i].lookups;
+        hits += memos[i].hits;
+    }
+
+    if (errors)
+        fprintf(stderr, "%lu failed round trips\n", (unsigned long) errors);
+
+    double seconds = (t1 - t0) / 1e9;
+    printf("%s,%s,%zu,%lu,%.3f,%.0f,%lu,%lu,%lu,%.3f\n",
+           variant->name, placement_names[placement], nr_threads,
+           (unsigned long) total.count, seconds, total.count / seconds,
+           (unsigned long) hist_percentile(&total, 50),
+           (unsigned long) hist_percentile(&total, 99),
+           (unsigned long) hist_percentile(&total, 99.9),
+           lookups ? (double) hits / lookups : 0.0);
+
+    return errors != 0;
+}
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+
+import subprocess as sp
+
+import os, sys
+import contextlib
+import csv
+
+from pprint import pprint
+from multiprocessing import cpu_count
+from platform import uname
+
+from versuchung.experiment import Experiment
+from versuchung.types import String, Integer
+from versuchung.files import File
+
+FIELDS = ["variant", "placement", "threads", "ops", "seconds", "ops_per_s",
+          "p50", "p99", "p999", "memo_hit"]
+
+@contextlib.contextmanager
+def working_directory(path):
+    """Changes working directory and returns to previous on exit."""
+    prev_cwd = os.getcwd()
+    os.chdir(path)
+    try:
+        yield
+    finally:
+        os.chdir(prev_cwd)
+
+def default_threads():
+    # Powers of two up to four times oversubscribed
+    n, threads = 1, []
+    while n <= 4 * cpu_count():
+        threads.append(str(n))
+        n *= 2
+    return ",".join(threads)
+
+class Contention(Experiment):
+    inputs = {
+        "variant": String("local"),
+        "threads": String(default_threads()),
+        "placements": String("any,same,sibling,remote"),
+        "server_cpu": Integer(0),
+        "duration": Integer(5),
+        # (lr, sp) pairs every client cycles through
+        "pairs": Integer(1),
+
+        "arch":   lambda self: String(uname().machine),
+        "host":   lambda self: String(uname().node),
+        "kernel": lambda self: String(" ".join([
+            uname().system, uname().release, uname().version
+        ])),
+    }
+
+    outputs = {
+        "results": File("results.csv"),
+    }
+
+    def run(self):
+        pprint(self.i)
+
+        with working_directory(sys.path[0]):
+            sp.check_call("cc -O2 -pthread -o contention contention.c", shell=True)
+
+            with open(self.o.results.path, "w") as f:
+                w = csv.writer(f)
+                w.writerow(FIELDS)
+
+                for placement in self.i.placements.value.split(","):
+                    for threads in self.i.threads.value.split(","):
+                        cmd = ["./contention", "-v", self.i.variant.value,
+                               "-t", threads, "-p", placement,
+                               "-S", str(self.i.server_cpu.value),
+                               "-d", str(self.i.duration.value),
+                               "-k", str(self.i.pairs.value)]
+                        print(" ".join(cmd))
+
+                        res = sp.run(cmd, stdout=sp.PIPE, universal_newlines=True)
+                        if not res.stdout:
+                            # E.g. no remote cluster on this machine
+                            print(f"{placement}: skipped")
+                            break
+
+                        row = res.stdout.strip().split(",")
+                        print(f"  {row[5]} ops/s, p50 {row[6]} p99 {row[7]} p99.9 {row[8]} ns, "
+                              f"memo hit {row[9]}")
+                        w.writerow(row)
+
+
+if __name__ == "__main__":
+    experiment = Contention()
+    dirname = experiment(sys.argv)
+    print(dirname)
@@ -0,0 +1,82 @@
+#ifndef EVAL_HISTOGRAM_H
+#define EVAL_HISTOGRAM_H
+
+/*
+ * Streaming log-linear histogram: exact below 2^HIST_SUB_BITS, above that
+ * 2^HIST_SUB_BITS buckets per power of two (relative error below 6.25%).
+ * A zeroed histogram is empty.
+ */
+#include <stdint.h>
+
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1U << HIST_SUB_BITS)
+#define HIST_SIZE		((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    uint64_t buckets[HIST_SIZE];
+    uint64_t count, min, max;
+    double sum;
+};
+
+static inline unsigned hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+
+    unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & (HIST_SUB - 1));
+}
+
+static inline uint64_t hist_value(unsigned idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+
+    unsigned shift = (idx >> HIST_SUB_BITS) - 1;
+    return (uint64_t) (HIST_SUB + (idx & (HIST_SUB - 1))) << shift;
+}
+
+static inline void hist_add(struct histogram *h, uint64_t v)
+{
+    if (!h->count || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+}
+
+static inline void hist_merge(struct histogram *to, const struct histogram *from)
+{
+    if (!from->count)
+        return;
+
+    for (unsigned i = 0; i < HIST_SIZE; i++)
+        to->buckets[i] += from->buckets[i];
+
+    if (!to->count || from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+
+    to->count += from->count;
+    to->sum += from->sum;
+}
+
+static inline uint64_t hist_percentile(const struct histogram *h, double p)
+{
+    uint64_t rank = p / 100.0 * h->count;
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < HIST_SIZE; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+
+    return h->max;
+}
+
+#endif /* EVAL_HISTOGRAM_H */
@@ -1,14 +1,19 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
 #include <fcntl.h>
-#include <math.h>
-#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
+
+#include "../histogram.h"
 
 #define STR1(x)  #x
 #define STR(x)   STR1(x)
@@ -19,6 +24,7 @@
 #define KPAC_OP_PAC		1
 #define KPAC_OP_AUT		2
 #define KPAC_PLAIN		8
+#define KPAC_TWEAK		16
 #define KPAC_CIPHER		24
 
 #define PAC_PL_BASE		0xA0000000UL
@@ -34,10 +40,206 @@
         exit(EXIT_FAILURE);                                             \
     } while (0)
 
-/* Enable in the kernel */
+/* Enable in the kernel (pmccntr module) */
 #define CNT_REG "PMCCNTR_EL0"
 //#define CNT_REG "CNTVCT_EL0"
 
+/*
+ * Samples are stored as cycles in a preallocated buffer, one row of nr_runs
+ * per operation, and written out in binary after the measurement:
+ *
+ *   struct sample_header, then uint32_t samples[nr_ops][nr_runs]
+ */
+#define SAMPLE_MAGIC		"KPACLAT"
+#define SAMPLE_VERSION		1
+
+enum { OP_NOP, OP_PAC, OP_AUT, OP_RT, NR_OPS };
+
+static const char *op_names[NR_OPS] = { "nop", "pac", "aut", "rt" };
+
+struct sample_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nr_ops;            /* Rows in the order of op_names */
+    uint64_t nr_runs;
+    uint32_t clock;             /* CLOCK_* */
+    uint32_t reserved;
+};
+
+/* CLOCK_PERF reads the counter of a perf event from userspace, CLOCK_PERF_READ
+ * with read() around every sample, which puts the syscall's jitter into the
+ * tails: its rows are marked degraded */
+enum { CLOCK_PMCCNTR, CLOCK_PERF, CLOCK_PERF_READ };
+
+static const char *clock_names[] = { "pmccntr", "perf", "perf-read" };
+
+/*
+ * Clocks
+ */
+
+static int clock_source = CLOCK_PMCCNTR;
+static int perf_fd = -1;
+static struct perf_event_mmap_page *perf_page;
+
+static sigjmp_buf probe_env;
+
+static void probe_sigill(int sig __attribute__ ((unused)))
+{
+    siglongjmp(probe_env, 1);
+}
+
+/* PMCCNTR_EL0 traps unless user access was enabled by the pmccntr module */
+static bool pmccntr_available(void)
+{
+    struct sigaction sa = { .sa_handler = probe_sigill }, old;
+    volatile bool ok = false;
+    unsigned long val;
+
+    sigaction(SIGILL, &sa, &old);
+    if (!sigsetjmp(probe_env, 1)) {
+        asm volatile ("mrs %0, " CNT_REG : "=r" (val));
+        ok = true;
+    }
+    sigaction(SIGILL, &old, NULL);
+
+    return ok;
+}
+
+/* arm_pmuv3: config1 bit 1 asks for userspace access to the counter, which
+ * needs the sysctl kernel.perf_user_access=1 */
+#define PERF_ARM_USER_ACCESS	(1UL << 1)
+
+static int perf_open(bool user_access, bool exclude_kernel)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+        .config1 = user_access ? PERF_ARM_USER_ACCESS : 0,
+        .exclude_kernel = exclude_kernel,
+        .exclude_hv = 1,
+    };
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Userspace counter reads as in the example of perf_event_open(2), set up by
+ * perf_init if the kernel allows them */
+static bool perf_rdpmc_init(void)
+{
+    perf_fd = perf_open(true, false);
+    if (perf_fd == -1)
+        return false;
+
+    perf_page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, perf_fd, 0);
+    if (perf_page == MAP_FAILED) {
+        perf_page = NULL;
+        close(perf_fd);
+        return false;
+    }
+
+    /* index is 0 while the event is not on a counter */
+    if (!perf_page->cap_user_rdpmc || !perf_page->index) {
+        munmap(perf_page, sysconf(_SC_PAGESIZE));
+        perf_page = NULL;
+        close(perf_fd);
+        return false;
+    }
+
+    return true;
+}
+
+static void perf_init(int variant_syscall)
+{
+    if (clock_source == CLOCK_PERF && perf_rdpmc_init())
+        return;
+
+    /* Only the userspace part of the read() is counted then, unless the
+     * operation itself is a syscall */
+    clock_source = CLOCK_PERF_READ;
+    perf_fd = perf_open(false, !variant_syscall);
+    if (perf_fd == -1)
+        die("perf_event_open: %s", strerror(errno));
+}
+
+static inline uint64_t pmc_read(uint32_t idx)
+{
+    uint64_t val;
+
+    if (idx == 31) {
+        asm volatile ("isb\n"
+                      "mrs %0, PMCCNTR_EL0\n" : "=r" (val));
+    } else {
+        asm volatile ("msr PMSELR_EL0, %1\n"
+                      "isb\n"
+                      "mrs %0, PMXEVCNTR_EL0\n" : "=r" (val) : "r" ((uint64_t) idx));
+    }
+
+    return val;
+}
+
+static inline unsigned long perf_rdpmc(void)
+{
+    struct perf_event_mmap_page *pc = perf_page;
+    uint32_t seq, idx, width;
+    uint64_t count;
+
+    do {
+        seq = pc->lock;
+        asm volatile ("" ::: "memory");
+
+        idx = pc->index;
+        count = pc->offset;
+        if (idx) {
+            width = pc->pmc_width;
+            count += (int64_t) (pmc_read(idx - 1) << (64 - width)) >> (64 - width);
+        }
+
+        asm volatile ("" ::: "memory");
+    } while (pc->lock != seq);
+
+    return count;
+}
+
+static inline unsigned long perf_read(void)
+{
+    unsigned long val;
+
+    if (read(perf_fd, &val, sizeof(val)) != sizeof(val))
+        die("read(perf): %s", strerror(errno));
+
+    return val;
+}
+
+/* Timestamps around an asm sequence, with the counter read from userspace,
+ * directly or through the perf event, or with a read() on the perf event. */
+#define MEASURE(t0, t1, seq, tmp, val)                                  \
+    do {                                                                \
+        if (clock_source == CLOCK_PMCCNTR) {                            \
+            asm volatile ("isb\n"                                       \
+                          "mrs %0, " CNT_REG "\n"                       \
+                          seq                                           \
+                          "isb\n"                                       \
+                          "mrs %1, " CNT_REG "\n"                       \
+                          OPERANDS(t0, t1, tmp, val));                  \
+        } else {                                                        \
+            unsigned long d0, d1;                                       \
+            t0 = clock_source == CLOCK_PERF ? perf_rdpmc() : perf_read(); \
+            asm volatile (seq OPERANDS(d0, d1, tmp, val));              \
+            t1 = clock_source == CLOCK_PERF ? perf_rdpmc() : perf_read(); \
+        }                                                               \
+    } while (0)
+
+/* Operand constraints are shared by all sequences: %0/%1 timestamps,
+ * %2 scratch, %3 plain or cipher in/out, %4 context, %5 base */
+#define OPERANDS(t0, t1, tmp, val)                                      \
+    : "=&r" (t0), "=&r" (t1), "=&r" (tmp), "+&r" (val)                  \
+    : "r" (ctx), "r" (base) : "memory"
+
+/*
+ * Backends
+ */
+
 static void pac_pl_init()
 {
     uintptr_t pac_pl_base = PAC_PL_BASE;
@@ -59,139 +261,245 @@ static void pac_pl_init()
         die("device test failed");
 }
 
-int main(int argc, char *argv[0])
+#define PAC_PL_PAC                                                      \
+    "1: stp %3, %4, [%5, #" STR(PAC_PL_PLAIN) "]\n"                     \
+    "ldr %2, [%5, #" STR(PAC_PL_CIPHER) "]\n"                           \
+    "cbz %2, 1b\n"                                                      \
+    "mov %3, %2\n"
+
+#define PAC_PL_AUT                                                      \
+    "2: stp %4, %3, [%5, #" STR(PAC_PL_TWEAK) "]\n"                     \
+    "ldr %2, [%5, #" STR(PAC_PL_CIPHER) "]\n"                           \
+    "cbz %2, 2b\n"                                                      \
+    "mov %3, %2\n"
+
+#define KPACD_PAC                                                       \
+    "stp %3, %4, [%5, #" STR(KPAC_PLAIN) "]\n"                          \
+    "mov %2, #" STR(KPAC_OP_PAC) "\n"                                   \
+    "stlr %2, [%5]\n"                                                   \
+    "1: yield\n"                                                        \
+    "ldr %2, [%5]\n"                                                    \
+    "cbnz %2, 1b\n"                                                     \
+    "ldr %3, [%5, #" STR(KPAC_CIPHER) "]\n"
+
+#define KPACD_AUT                                                       \
+    "stp %4, %3, [%5, #" STR(KPAC_TWEAK) "]\n"                          \
+    "mov %2, #" STR(KPAC_OP_AUT) "\n"                                   \
+    "stlr %2, [%5]\n"                                                   \
+    "2: yield\n"                                                        \
+    "ldr %2, [%5]\n"                                                    \
+    "cbnz %2, 2b\n"                                                     \
+    "ldr %3, [%5, #" STR(KPAC_PLAIN) "]\n"
+
+/* The kernel signs lr under sp, swap both in around the svc */
+#define SVC(imm)                                                        \
+    "str lr, [sp, #-16]!\n"                                             \
+    "mov %2, sp\n"                                                      \
+    "mov lr, %3\n"                                                      \
+    "mov sp, %4\n"                                                      \
+    "svc #" imm "\n"                                                    \
+    "mov sp, %2\n"                                                      \
+    "mov %3, lr\n"                                                      \
+    "ldr lr, [sp], #16\n"
+
+#define SVC_PAC SVC("0x9AC")
+#define SVC_AUT SVC("0x9AD")
+
+enum { VARIANT_PAC_PL, VARIANT_SYSCALL, VARIANT_KPACD };
+
+static const char *variant_names[] = { "pacpl", "svc", "kpacd" };
+
+static const unsigned long pln = 0x0000DEADBEEFDEAD;
+static const unsigned long ctx = 0x0000BEEFDEADBEEF;
+
+/* Measure one operation, VAL is the input and receives the output */
+static inline unsigned long measure(int variant, int op, unsigned long *val)
 {
-    int opt;
-    bool pacpl = false;
-    bool svc = false;
-    bool kpacd = false;
-
-    unsigned long nr_runs = NR_RUNS;
-
-    while ((opt = getopt(argc, argv, "lsdn:")) != -1) {
-        switch (opt) {
-        case 'l': pacpl = true; break;
-        case 's': svc = true; break;
-        case 'd': kpacd = true; break;
-        case 'n': nr_runs = atoi(optarg);
-            break;
-        default:
-            fprintf(stderr, "Usage: %s [-l|-s|-d] output\n", argv[0]);
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    if (optind >= argc) {
-        fprintf(stderr, "Usage: %s [-l|-s|-d] output\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    char *filename = argv[optind];
-    FILE *out = fopen(filename, "w");
-    if (!out) {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+    unsigned long t0, t1, tmp, v = *val;
+    unsigned long base = variant == VARIANT_PAC_PL ? PAC_PL_BASE : KPAC_BASE;
+
+    switch (variant * NR_OPS + op) {
+    case VARIANT_PAC_PL * NR_OPS + OP_PAC:
+        MEASURE(t0, t1, PAC_PL_PAC, tmp, v);
+        break;
+    case VARIANT_PAC_PL * NR_OPS + OP_AUT:
+        MEASURE(t0, t1, PAC_PL_AUT, tmp, v);
+        break;
+    case VARIANT_PAC_PL * NR_OPS + OP_RT:
+        MEASURE(t0, t1, PAC_PL_PAC PAC_PL_AUT, tmp, v);
+        break;
+    case VARIANT_SYSCALL * NR_OPS + OP_PAC:
+        MEASURE(t0, t1, SVC_PAC, tmp, v);
+        break;
+    case VARIANT_SYSCALL * NR_OPS + OP_AUT:
+        MEASURE(t0, t1, SVC_AUT, tmp, v);
+        break;
+    case VARIANT_SYSCALL * NR_OPS + OP_RT:
+        MEASURE(t0, t1, SVC_PAC SVC_AUT, tmp, v);
+        break;
+    case VARIANT_KPACD * NR_OPS + OP_PAC:
+        MEASURE(t0, t1, KPACD_PAC, tmp, v);
+        break;
+    case VARIANT_KPACD * NR_OPS + OP_AUT:
+        MEASURE(t0, t1, KPACD_AUT, tmp, v);
+        break;
+    case VARIANT_KPACD * NR_OPS + OP_RT:
+        MEASURE(t0, t1, KPACD_PAC KPACD_AUT, tmp, v);
+        break;
+    default:
+        MEASURE(t0, t1, "", tmp, v);
+        break;
     }
 
-    unsigned long pln = 0x0000DEADBEEFDEAD;
-    unsigned long ctx = 0x0000BEEFDEADBEEF;
+    *val = v;
+    return t1 - t0;
+}
 
-    if (pacpl) {
-        pac_pl_init();
+/* Input of each operation: AUT takes a signed pointer */
+static unsigned long op_input(int variant, int op)
+{
+    unsigned long val = pln;
 
-        double cma    = 0;
-        double acc    = 0;
-        double acc_sq = 0;
-        for (unsigned long i = 0; i < nr_runs; i++) {
-            unsigned long t0, t1;
+    if (op == OP_AUT)
+        measure(variant, OP_PAC, &val);
 
-            asm volatile ("isb\n"
-                          "mrs %0, " CNT_REG "\n"
+    return val;
+}
 
-                          "1: stp %2, %3, [%4, #" STR(PAC_PL_PLAIN) "]\n"
-                          "ldr %2, [%4, #" STR(PAC_PL_CIPHER) "]\n"
-                          "cbz %2, 1b\n"
+static void run(int variant, int op, unsigned long nr_runs,
+                uint32_t *samples, struct histogram *hist)
+{
+    unsigned long input = op_input(variant, op);
+    unsigned long val = input;
 
-                          "isb\n"
-                          "mrs %1, " CNT_REG "\n"
-                          : "=&r" (t0), "=&r" (t1), "+&r" (pln)
-                          : "r" (ctx),  "r" (PAC_PL_BASE));
+    for (unsigned long i = 0; i < nr_runs; i++) {
+        unsigned long diff;
 
-            unsigned long diff = t1 - t0;
-            fprintf(out, "%lu\n", diff);
+        val = input;
+        diff = measure(variant, op, &val);
 
-            cma = (diff + (i+1) * cma) / (i+2);
-        }
+        if (samples)
+            samples[i] = diff > UINT32_MAX ? UINT32_MAX : diff;
+        hist_add(hist, diff);
+    }
 
-        printf("pacpl over %lu runs: %g\n", nr_runs, cma);
-    } else if (svc) {
-        double cma    = 0;
-        double acc    = 0;
-        for (unsigned long i = 0; i < nr_runs; i++) {
-            unsigned long t0, t1;
+    if ((op == OP_AUT || op == OP_RT) && val != pln)
+        fprintf(stderr, "%s %s: authentication returned %#lx\n",
+                variant_names[variant], op_names[op], val);
+}
 
-            unsigned long sp_saved;
-            unsigned long lr_saved;
+static void write_samples(const char *filename, uint32_t *samples, unsigned long nr_runs)
+{
+    struct sample_header header = {
+        .magic = SAMPLE_MAGIC,
+        .version = SAMPLE_VERSION,
+        .nr_ops = NR_OPS,
+        .nr_runs = nr_runs,
+        .clock = clock_source,
+    };
+    size_t len = NR_OPS * nr_runs * sizeof(*samples);
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        die("open(%s): %s", filename, strerror(errno));
 
-            asm volatile ("mov %2, sp\n"
-                          "mov %3, lr\n"
-                          "mov lr, %4\n"
-                          "mov sp, %5\n"
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+        die("write: %s", strerror(errno));
 
-                          "isb\n"
-                          "mrs %0, " CNT_REG "\n"
+    for (char *p = (char *) samples; len; ) {
+        ssize_t ret = write(fd, p, len);
+        if (ret == -1)
+            die("write: %s", strerror(errno));
+        p += ret;
+        len -= ret;
+    }
 
-                          "svc #0x9AC\n"
+    close(fd);
+}
 
-                          "isb\n"
-                          "mrs %1, " CNT_REG "\n"
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-l|-s|-d] [-n runs] [-c pmccntr|perf|perf-read] [output]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
 
-                          "mov %4, lr\n"
-                          "mov sp, %2\n"
-                          "mov lr, %3\n"
-                          : "=&r" (t0), "=&r" (t1), "=&r" (sp_saved), "=&r" (lr_saved), "+&r" (pln)
-                          : "r" (ctx));
+int main(int argc, char *argv[0])
+{
+    int opt;
+    int variant = -1;
+    int forced_clock = -1;
 
-            unsigned long diff = t1 - t0;
+    unsigned long nr_runs = NR_RUNS;
 
-            cma = (diff + (i+1) * cma) / (i+2);
-            fprintf(out, "%lu\n", diff);
+    while ((opt = getopt(argc, argv, "lsdn:c:")) != -1) {
+        switch (opt) {
+        case 'l': variant = VARIANT_PAC_PL; break;
+        case 's': variant = VARIANT_SYSCALL; break;
+        case 'd': variant = VARIANT_KPACD; break;
+        case 'n': nr_runs = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            if (!strcmp(optarg, "pmccntr"))
+                forced_clock = CLOCK_PMCCNTR;
+            else if (!strcmp(optarg, "perf"))
+                forced_clock = CLOCK_PERF;
+            else if (!strcmp(optarg, "perf-read"))
+                forced_clock = CLOCK_PERF_READ;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
         }
+    }
 
-        printf("svc over %lu runs: %g\n", nr_runs, cma);
-    } else if (kpacd) {
-        double cma    = 0;
-        for (unsigned long i = 0; i < nr_runs; i++) {
-            unsigned long t0, t1;
-
-            unsigned long op = KPAC_OP_PAC;
-
-            asm volatile ("isb\n"
-                          "mrs %0, " CNT_REG "\n"
+    if (variant == -1)
+        usage(argv[0]);
 
-                          "stp %3, %4, [%5, #" STR(KPAC_PLAIN) "]\n"
-                          "stlr %2, [%5]\n"
+    /* Without an output only the histograms are kept */
+    const char *filename = optind < argc ? argv[optind] : NULL;
 
-                          //"sevl\n"
-                          //"1: wfe\n"
-                          "1: yield\n"
-                          "ldr %2, [%5]\n"
-                          "cbnz %2, 1b\n"
-                          "ldr %3, [%5, #" STR(KPAC_CIPHER) "]\n"
+    if (forced_clock != -1)
+        clock_source = forced_clock;
+    else if (!pmccntr_available())
+        clock_source = CLOCK_PERF;
+    if (clock_source != CLOCK_PMCCNTR)
+        perf_init(variant == VARIANT_SYSCALL);
 
-                          "isb\n"
-                          "mrs %1, " CNT_REG "\n"
-                          : "=&r" (t0), "=&r" (t1), "+&r" (op), "+&r" (pln)
-                          : "r" (ctx),  "r" (KPAC_BASE));
+    if (variant == VARIANT_PAC_PL)
+        pac_pl_init();
 
-            unsigned long diff = t1 - t0;
+    /* Allocate and fault in everything before the first sample */
+    uint32_t *samples = NULL;
+    if (filename) {
+        samples = mmap(NULL, NR_OPS * nr_runs * sizeof(*samples), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (samples == MAP_FAILED)
+            die("mmap: %s", strerror(errno));
+    }
 
-            cma = (diff + (i+1) * cma) / (i+2);
-            fprintf(out, "%lu\n", diff);
-        }
+    static struct histogram hists[NR_OPS];
+    for (int op = 0; op < NR_OPS; op++) {
+        run(variant, op, nr_runs, samples ? samples + op * nr_runs : NULL, &hists[op]);
+    }
 
-        printf("kpacd over %lu runs: %g\n", nr_runs, cma);
+    printf("%s over %lu runs (%s%s)\n", variant_names[variant], nr_runs,
+           clock_names[clock_source],
+           clock_source == CLOCK_PERF_READ ? ", degraded: read() per sample" : "");
+    printf("%-4s %10s %10s %10s %10s %10s %10s %10s\n",
+           "op", "min", "mean", "p50", "p99", "p99.9", "p99.99", "max");
+    for (int op = 0; op < NR_OPS; op++) {
+        struct histogram *h = &hists[op];
+        printf("%-4s %10lu %10.1f %10lu %10lu %10lu %10lu %10lu%s\n", op_names[op],
+               h->min, h->sum / h->count,
+               hist_percentile(h, 50), hist_percentile(h, 99),
+               hist_percentile(h, 99.9), hist_percentile(h, 99.99), h->max,
+               clock_source == CLOCK_PERF_READ ? " degraded" : "");
     }
 
+    if (filename)
+        write_samples(filename, samples, nr_runs);
+
     return 0;
 }
@@ -23,6 +23,25 @@ from versuchung.execute import shell, shell_failok
 
 KPACD_DIR    = "/sys/kernel/debug/kpacd"
 
+# Binary sample file written by latency.c: struct sample_header followed by
+# uint32 samples[nr_ops][nr_runs]
+SAMPLE_HEADER = np.dtype([("magic", "S8"), ("version", "<u4"), ("nr_ops", "<u4"),
+                          ("nr_runs", "<u8"), ("clock", "<u4"), ("reserved", "<u4")])
+SAMPLE_OPS    = ["nop", "pac", "aut", "rt"]
+# perf-read samples include the jitter of a read() each, see latency.c
+SAMPLE_CLOCKS = ["pmccntr", "perf", "perf-read"]
+
+def read_samples(path):
+    """Returns the clock name and a dict of sample arrays per operation."""
+    with open(path, "rb") as f:
+        header = np.fromfile(f, dtype=SAMPLE_HEADER, count=1)[0]
+        if header["magic"] != b"KPACLAT" or header["version"] != 1:
+            raise ValueError(f"{path}: not a latency sample file")
+        nr_ops, nr_runs = int(header["nr_ops"]), int(header["nr_runs"])
+        data = np.fromfile(f, dtype="<u4", count=nr_ops * nr_runs)
+    data = data.reshape(nr_ops, nr_runs)
+    return SAMPLE_CLOCKS[header["clock"]], dict(zip(SAMPLE_OPS, data))
+
 @contextlib.contextmanager
 def working_directory(path):
     """Changes working directory and returns to previous on exit."""
@@ -45,6 +64,7 @@ class Latency(Experiment):
         "variant": String("syscall"),
         "backend": get_backend,
         "runs": Integer(32000000),
+        "clock": String(""),
         "csv": Bool(False),
 
         "arch":   lambda self: String(uname().machine),
@@ -69,16 +89,23 @@ class Latency(Experiment):
         }
 
         with working_directory(sys.path[0]):
-            samples = tempfile.NamedTemporaryFile(mode="r+")
-            cmd = f"./latency {flag[self.i.variant.value]} -n {self.i.runs.value} {samples.name}"
+            samples = tempfile.NamedTemporaryFile(mode="rb")
+            clock = f"-c {self.i.clock.value}" if self.i.clock.value else ""
+            cmd = f"./latency {flag[self.i.variant.value]} -n {self.i.runs.value} {clock} {samples.name}"
             print(cmd)
             sp.check_call(cmd, shell=True)
 
+            clock, ops = read_samples(samples.name)
+            print(f"clock: {clock}")
+            if clock == "perf-read":
+                print("warning: degraded clock, the tails include read() jitter")
+
             if not self.i.csv.value:
-                a = np.genfromtxt(samples.name)
-                np.savez_compressed(self.o.samples.path, a)
+                # arr_0 keeps the PAC samples where older analyses expect them
+                np.savez_compressed(self.o.samples.path, arr_0=ops["pac"], **ops)
             else:
-                shutil.copyfile(samples.name, self.o.samples_csv.path)
+                np.savetxt(self.o.samples_csv.path, np.column_stack(list(ops.values())),
+                           fmt="%u", delimiter=",", header=",".join(ops), comments="")
 
 
 if __name__ == "__main__":
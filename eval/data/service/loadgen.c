@@ -0,0 +1,471 @@
+/*
+ * Load generator of the service benchmark, see server.c for the protocol.
+ *
+ * Every connection issues get (-g ratio) and set requests for uniformly
+ * chosen keys in one of two modes:
+ *
+ *   closed  one request at a time per connection; back to back, or paced at
+ *           -r requests/s in total
+ *   open    requests are sent at -r requests/s in total, whether or not the
+ *           earlier ones were answered, and a second thread per connection
+ *           receives the responses
+ *
+ * With a rate, every request has an intended send time on a fixed schedule
+ * and its latency is measured from there instead of from when it was actually
+ * sent.  A stalled server then delays the requests it held up and all the
+ * ones that should have been sent in the meantime, which is what clients
+ * would see, instead of only the one that happened to be in flight
+ * (coordinated omission).  p99_raw is measured from the actual send time for
+ * comparison; back to back the two are the same.
+ *
+ * Build: see Makefile
+ * Output: mode,connections,target_rps,requests,seconds,rps,p50,p99,p999,p99_raw (ns)
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../histogram.h"
+#include "proto.h"
+
+#define die(fmt, ...)                                                   \
+    do {                                                                \
+        fprintf(stderr, "[%s:%d]: " fmt "\n",                           \
+                __FILE__, __LINE__, ##__VA_ARGS__);                     \
+        exit(EXIT_FAILURE);                                             \
+    } while (0)
+
+#if defined(__aarch64__)
+#define cpu_relax() asm volatile ("yield" ::: "memory")
+#elif defined(__x86_64__)
+#define cpu_relax() asm volatile ("pause" ::: "memory")
+#else
+#define cpu_relax() asm volatile ("" ::: "memory")
+#endif
+
+#define MAX_CONNS		1024
+#define RX_SIZE			(64 * 1024)
+
+/* Requests in flight per connection in open mode */
+#define RING_SIZE		(1 << 16)
+
+/* Sleep until this close to the intended send time, then spin */
+#define SPIN_NS			50000
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wait_until(uint64_t t)
+{
+    uint64_t now;
+
+    while ((now = now_ns()) < t) {
+        if (t - now > SPIN_NS) {
+            uint64_t ns = t - now - SPIN_NS;
+            struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+            nanosleep(&ts, NULL);
+        } else {
+            cpu_relax();
+        }
+    }
+}
+
+/*
+ * Configuration
+ */
+enum { MODE_CLOSED, MODE_OPEN };
+static const char *mode_names[] = { "closed", "open" };
+
+static int mode = MODE_CLOSED;
+static int port = DEFAULT_PORT;
+static const char *path;
+static long keys = DEFAULT_KEYS;
+static size_t value_size = DEFAULT_VALUE_SIZE;
+static double get_ratio = 0.9;
+static double rate;             /* requests/s over all connections, 0: back to back */
+
+static uint64_t start_ns, end_ns;
+static char value[VALUE_MAX];
+
+/*
+ * Connections
+ */
+struct request {
+    uint64_t intended;
+    uint64_t sent;
+    bool get;
+};
+
+struct conn {
+    pthread_t sender, receiver;
+    int fd;
+    uint64_t rng;
+    uint64_t interval;          /* ns between intended send times, 0: none */
+    uint64_t first;             /* intended time of the first request */
+
+    /* Receive buffer */
+    char rx[RX_SIZE];
+    size_t rx_start, rx_end;
+
+    /* Requests in flight in open mode, written by sender, read by receiver */
+    struct request ring[RING_SIZE];
+    _Atomic uint64_t head, tail;
+
+    struct histogram hist, raw;
+    uint64_t last_ns;
+} __attribute__ ((aligned(64)));
+
+static struct conn *conns;
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int conn_open(void)
+{
+    int fd;
+
+    /* The server may still be starting */
+    for (int tries = 0;; tries++) {
+        if (path) {
+            struct sockaddr_un addr = { .sun_family = AF_UNIX };
+            snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd != -1 && !connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+                return fd;
+        } else {
+            struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(port),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            };
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd != -1 && !connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                return fd;
+            }
+        }
+
+        if (tries == 100)
+            die("connect: %s", strerror(errno));
+        if (fd != -1)
+            close(fd);
+        usleep(50000);
+    }
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("write: %s", strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Build the next request in buf, returns its length and whether it is a get */
+static size_t next_request(struct conn *c, char *buf, size_t size, bool *get)
+{
+    char key[KEY_MAX + 1];
+    uint64_t r = xorshift(&c->rng);
+    int n;
+
+    *get = (r >> 11) * 0x1p-53 < get_ratio;
+    format_key(key, sizeof(key), xorshift(&c->rng) % keys);
+    if (*get)
+        return snprintf(buf, size, "get %s\r\n", key);
+
+    n = snprintf(buf, size, "set %s %zu\r\n", key, value_size);
+    memcpy(buf + n, value, value_size);
+    memcpy(buf + n + value_size, "\r\n", 2);
+    return n + value_size + 2;
+}
+
+/* Make at least len bytes available in the receive buffer, NULL if the
+ * connection was closed before any of them arrived */
+static char *rx_need(struct conn *c, size_t len)
+{
+    if (c->rx_end - c->rx_start < len && c->rx_start) {
+        memmove(c->rx, c->rx + c->rx_start, c->rx_end - c->rx_start);
+        c->rx_end -= c->rx_start;
+        c->rx_start = 0;
+    }
+
+    while (c->rx_end - c->rx_start < len) {
+        ssize_t n = read(c->fd, c->rx + c->rx_end, sizeof(c->rx) - c->rx_end);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0 && c->rx_end == c->rx_start)
+            return NULL;
+        if (n <= 0)
+            die("read: %s", n ? strerror(errno) : "connection closed");
+        c->rx_end += n;
+    }
+
+    return c->rx + c->rx_start;
+}
+
+/* Take the next line off the receive buffer, without \r\n, NULL on end of
+ * stream */
+static char *rx_line(struct conn *c, size_t *len)
+{
+    for (size_t have = 0;; ) {
+        char *start = rx_need(c, have + 1);
+        if (!start)
+            return NULL;
+
+        char *eol = memmem(start, c->rx_end - c->rx_start, "\r\n", 2);
+        if (eol) {
+            *len = eol - start;
+            c->rx_start += *len + 2;
+            return start;
+        }
+        have = c->rx_end - c->rx_start;
+        if (have >= LINE_MAX_LEN)
+            die("response line too long");
+    }
+}
+
+/* Check the rest of the response that starts with line */
+static void read_response(struct conn *c, bool get, char *line, size_t len)
+{
+    size_t vlen;
+
+    if (!line)
+        die("read: connection closed");
+
+    if (!get) {
+        if (len != 6 || memcmp(line, "STORED", 6))
+            die("unexpected response to set: %.*s", (int) len, line);
+        return;
+    }
+
+    if (len == 3 && !memcmp(line, "END", 3))
+        return;                 /* Miss */
+    if (len < 6 || memcmp(line, "VALUE ", 6) ||
+        sscanf(line, "VALUE %*s %zu", &vlen) != 1 || vlen > VALUE_MAX)
+        die("unexpected response to get: %.*s", (int) len, line);
+
+    if (!rx_need(c, vlen + 2))
+        die("read: connection closed");
+    c->rx_start += vlen + 2;
+
+    line = rx_line(c, &len);
+    if (!line || len != 3 || memcmp(line, "END", 3))
+        die("unterminated value");
+}
+
+static void *closed_loop(void *arg)
+{
+    struct conn *c = arg;
+    char buf[LINE_MAX_LEN + VALUE_MAX + 2];
+    uint64_t next = c->first;
+    size_t len;
+    bool get;
+
+    for (;;) {
+        uint64_t intended;
+        if (c->interval) {
+            intended = next;
+            next += c->interval;
+            if (intended >= end_ns)
+                break;
+            wait_until(intended);
+        } else {
+            intended = now_ns();
+            if (intended >= end_ns)
+                break;
+        }
+
+        size_t n = next_request(c, buf, sizeof(buf), &get);
+        uint64_t sent = now_ns();
+        write_all(c->fd, buf, n);
+        char *line = rx_line(c, &len);
+        read_response(c, get, line, len);
+        uint64_t done = now_ns();
+
+        hist_add(&c->hist, done - intended);
+        hist_add(&c->raw, done - sent);
+        c->last_ns = done;
+    }
+
+    return NULL;
+}
+
+/* The request is published to the receiver before it is written, so that a
+ * response never arrives for a request the receiver does not know yet.  At
+ * the end, shutting down our side makes the server close the connection
+ * after the last response. */
+static void *open_sender(void *arg)
+{
+    struct conn *c = arg;
+    char buf[LINE_MAX_LEN + VALUE_MAX + 2];
+
+    for (uint64_t intended = c->first; intended < end_ns; intended += c->interval) {
+        wait_until(intended);
+
+        uint64_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&c->tail, memory_order_acquire) == RING_SIZE)
+            sched_yield();
+
+        struct request *req = &c->ring[head % RING_SIZE];
+        size_t n = next_request(c, buf, sizeof(buf), &req->get);
+        req->intended = intended;
+        req->sent = now_ns();
+        atomic_store_explicit(&c->head, head + 1, memory_order_release);
+
+        write_all(c->fd, buf, n);
+    }
+
+    shutdown(c->fd, SHUT_WR);
+    return NULL;
+}
+
+static void *open_receiver(void *arg)
+{
+    struct conn *c = arg;
+    size_t len;
+
+    for (uint64_t tail = 0;; tail++) {
+        char *line = rx_line(c, &len);
+        if (!line) {
+            if (tail != atomic_load_explicit(&c->head, memory_order_acquire))
+                die("read: connection closed");
+            return NULL;
+        }
+
+        struct request *req = &c->ring[tail % RING_SIZE];
+        read_response(c, req->get, line, len);
+        uint64_t done = now_ns();
+
+        hist_add(&c->hist, done - req->intended);
+        hist_add(&c->raw, done - req->sent);
+        c->last_ns = done;
+        atomic_store_explicit(&c->tail, tail + 1, memory_order_release);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m closed|open] [-c connections] [-r rate] [-d seconds] "
+            "[-p port | -u path] [-k keys] [-s value_size] [-g get_ratio]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    size_t nr_conns = 1;
+    double duration = 5;
+
+    while ((opt = getopt(argc, argv, "m:c:r:d:p:u:k:s:g:")) != -1) {
+        switch (opt) {
+        case 'm':
+            for (mode = 0; mode <= MODE_OPEN; mode++)
+                if (!strcmp(optarg, mode_names[mode]))
+                    break;
+            if (mode > MODE_OPEN)
+                usage(argv[0]);
+            break;
+        case 'c': nr_conns = strtoul(optarg, NULL, 0); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'u': path = optarg; break;
+        case 'k': keys = atol(optarg); break;
+        case 's': value_size = strtoul(optarg, NULL, 0); break;
+        case 'g': get_ratio = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nr_conns < 1 || nr_conns > MAX_CONNS)
+        die("1 to %d connections", MAX_CONNS);
+    if (mode == MODE_OPEN && rate <= 0)
+        die("open loop needs a rate");
+    if (keys < 1 || value_size > VALUE_MAX)
+        usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+    fill_value(value, value_size, 1);
+
+    conns = calloc(nr_conns, sizeof(*conns));
+    if (!conns)
+        die("out of memory");
+    for (size_t i = 0; i < nr_conns; i++) {
+        conns[i].fd = conn_open();
+        conns[i].rng = 0x9E3779B97F4A7C15UL * (i + 1);
+        conns[i].interval = rate > 0 ? 1e9 * nr_conns / rate : 0;
+    }
+
+    /* Give the threads time to start and stagger the connections' schedules */
+    start_ns = now_ns() + 10000000;
+    end_ns = start_ns + duration * 1e9;
+    for (size_t i = 0; i < nr_conns; i++)
+        conns[i].first = start_ns + conns[i].interval * i / nr_conns;
+
+    for (size_t i = 0; i < nr_conns; i++) {
+        struct conn *c = &conns[i];
+        if (mode == MODE_CLOSED) {
+            if (pthread_create(&c->sender, NULL, closed_loop, c))
+                die("pthread_create failed");
+        } else {
+            if (pthread_create(&c->sender, NULL, open_sender, c) ||
+                pthread_create(&c->receiver, NULL, open_receiver, c))
+                die("pthread_create failed");
+        }
+    }
+
+    static struct histogram total, raw;
+    uint64_t last = start_ns;
+    for (size_t i = 0; i < nr_conns; i++) {
+        struct conn *c = &conns[i];
+        pthread_join(c->sender, NULL);
+        if (mode == MODE_OPEN)
+            pthread_join(c->receiver, NULL);
+        hist_merge(&total, &c->hist);
+        hist_merge(&raw, &c->raw);
+        if (c->last_ns > last)
+            last = c->last_ns;
+        close(c->fd);
+    }
+
+    double seconds = (last - start_ns) / 1e9;
+    printf("%s,%zu,%.0f,%lu,%.3f,%.0f,%lu,%lu,%lu,%lu\n",
+           mode_names[mode], nr_conns, rate,
+           (unsigned long) total.count, seconds, total.count / seconds,
+           (unsigned long) hist_percentile(&total, 50),
+           (unsigned long) hist_percentile(&total, 99),
+           (unsigned long) hist_percentile(&total, 99.9),
+           (unsigned long) hist_percentile(&raw, 99));
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * Protocol constants and key/value generation shared by server and loadgen
+ */
+#ifndef SERVICE_PROTO_H
+#define SERVICE_PROTO_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define DEFAULT_PORT		11311
+#define DEFAULT_KEYS		10000
+#define DEFAULT_VALUE_SIZE	128
+
+#define KEY_MAX			32
+#define VALUE_MAX		8192
+#define LINE_MAX_LEN		128
+
+static inline void format_key(char *buf, size_t size, long i)
+{
+    snprintf(buf, size, "key:%010ld", i);
+}
+
+/* Printable filler, never contains \r or \n */
+static inline void fill_value(char *buf, size_t len, unsigned seed)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = 'a' + (i + seed) % 26;
+}
+
+#endif
@@ -0,0 +1,445 @@
+/*
+ * Key-value server of the service benchmark, a small subset of the memcached
+ * text protocol:
+ *
+ *   get <key>\r\n                ->  VALUE <key> <len>\r\n<data>\r\nEND\r\n
+ *                                    or END\r\n
+ *   set <key> <len>\r\n<data>\r\n  ->  STORED\r\n
+ *
+ * The main thread accepts connections and hands them round robin to the
+ * worker threads, each of which serves its connections with epoll.  Requests
+ * go through a few layers of parsing, dispatch and buffer handling with small
+ * local buffers, so that the plugin instruments a realistic share of the
+ * calls on the way.
+ *
+ * Build: see Makefile
+ * Usage: server [-t threads] [-p port | -u path] [-k keys] [-s value_size]
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "proto.h"
+
+#define die(fmt, ...)                                                   \
+    do {                                                                \
+        fprintf(stderr, "[%s:%d]: " fmt "\n",                           \
+                __FILE__, __LINE__, ##__VA_ARGS__);                     \
+        exit(EXIT_FAILURE);                                             \
+    } while (0)
+
+#define MAX_WORKERS		256
+#define MAX_EVENTS		64
+#define BUF_SIZE		(64 * 1024)
+
+#define STORE_BUCKETS		(1 << 16)
+#define STORE_LOCKS		256
+
+/*
+ * Store
+ */
+struct item {
+    struct item *next;
+    uint32_t len;
+    char key[KEY_MAX + 1];
+    char data[];
+};
+
+static struct item *buckets[STORE_BUCKETS];
+static pthread_mutex_t locks[STORE_LOCKS];
+
+static uint32_t hash_key(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) key[i]) * 16777619u;
+
+    return h;
+}
+
+static struct item *bucket_find(struct item *head, const char *key)
+{
+    for (struct item *it = head; it; it = it->next)
+        if (!strcmp(it->key, key))
+            return it;
+
+    return NULL;
+}
+
+/* Copies the value of key to buf, returns its length or -1 */
+static ssize_t store_get(const char *key, char *buf, size_t size)
+{
+    uint32_t h = hash_key(key, strlen(key));
+    pthread_mutex_t *lock = &locks[h % STORE_LOCKS];
+    ssize_t len = -1;
+
+    pthread_mutex_lock(lock);
+    struct item *it = bucket_find(buckets[h % STORE_BUCKETS], key);
+    if (it && it->len <= size) {
+        memcpy(buf, it->data, it->len);
+        len = it->len;
+    }
+    pthread_mutex_unlock(lock);
+
+    return len;
+}
+
+static int store_set(const char *key, const char *data, size_t len)
+{
+    uint32_t h = hash_key(key, strlen(key));
+    pthread_mutex_t *lock = &locks[h % STORE_LOCKS];
+    struct item **head = &buckets[h % STORE_BUCKETS];
+
+    struct item *new = malloc(sizeof(*new) + len);
+    if (!new)
+        return -1;
+    snprintf(new->key, sizeof(new->key), "%s", key);
+    memcpy(new->data, data, len);
+    new->len = len;
+
+    pthread_mutex_lock(lock);
+    for (struct item **p = head; *p; p = &(*p)->next) {
+        if (!strcmp((*p)->key, key)) {
+            struct item *old = *p;
+            new->next = old->next;
+            *p = new;
+            pthread_mutex_unlock(lock);
+            free(old);
+            return 0;
+        }
+    }
+    new->next = *head;
+    *head = new;
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
+/*
+ * Connections
+ */
+struct buf {
+    char data[BUF_SIZE];
+    size_t start, end;
+};
+
+struct conn {
+    int fd;
+    struct buf in, out;
+};
+
+static bool buf_append(struct buf *b, const void *data, size_t len)
+{
+    if (b->end + len > sizeof(b->data))
+        return false;
+
+    memcpy(b->data + b->end, data, len);
+    b->end += len;
+    return true;
+}
+
+static bool reply(struct conn *c, const char *msg)
+{
+    return buf_append(&c->out, msg, strlen(msg));
+}
+
+static bool reply_value(struct conn *c, const char *key, const char *data, size_t len)
+{
+    char hdr[KEY_MAX + 32];
+    int n = snprintf(hdr, sizeof(hdr), "VALUE %s %zu\r\n", key, len);
+
+    return buf_append(&c->out, hdr, n) &&
+           buf_append(&c->out, data, len) &&
+           reply(c, "\r\nEND\r\n");
+}
+
+static bool cmd_get(struct conn *c, const char *key)
+{
+    char value[VALUE_MAX];
+    ssize_t len = store_get(key, value, sizeof(value));
+
+    if (len < 0)
+        return reply(c, "END\r\n");
+
+    return reply_value(c, key, value, len);
+}
+
+static bool cmd_set(struct conn *c, const char *key, const char *data, size_t len)
+{
+    if (store_set(key, data, len))
+        return reply(c, "SERVER_ERROR out of memory\r\n");
+
+    return reply(c, "STORED\r\n");
+}
+
+/* Split line into at most max words, returns their number */
+static int tokenize(char *line, char *argv[], int max)
+{
+    char *save;
+    int argc = 0;
+
+    for (char *tok = strtok_r(line, " ", &save); tok && argc < max;
+         tok = strtok_r(NULL, " ", &save))
+        argv[argc++] = tok;
+
+    return argc;
+}
+
+/* Handle the request at the start of in, returns the bytes it took, 0 if it
+ * is incomplete and -1 if it is invalid */
+static ssize_t handle_request(struct conn *c, const char *in, size_t avail)
+{
+    char line[LINE_MAX_LEN];
+    char *argv[4];
+
+    const char *eol = memmem(in, avail, "\r\n", 2);
+    if (!eol)
+        return avail >= sizeof(line) ? -1 : 0;
+
+    ssize_t line_len = eol - in;
+    if ((size_t) line_len >= sizeof(line))
+        return -1;
+    memcpy(line, in, line_len);
+    line[line_len] = '\0';
+
+    int argc = tokenize(line, argv, 4);
+    if (argc < 2 || strlen(argv[1]) > KEY_MAX)
+        return -1;
+
+    if (!strcmp(argv[0], "get") && argc == 2)
+        return cmd_get(c, argv[1]) ? line_len + 2 : -1;
+
+    if (!strcmp(argv[0], "set") && argc == 3) {
+        size_t len = strtoul(argv[2], NULL, 10);
+        if (len > VALUE_MAX)
+            return -1;
+        if (avail < (size_t) line_len + 2 + len + 2)
+            return 0;
+        return cmd_set(c, argv[1], eol + 2, len) ? line_len + 2 + (ssize_t) len + 2 : -1;
+    }
+
+    return -1;
+}
+
+static int conn_flush(struct conn *c)
+{
+    struct buf *out = &c->out;
+
+    while (out->start < out->end) {
+        ssize_t n = write(c->fd, out->data + out->start, out->end - out->start);
+        if (n == -1) {
+            if (errno == EAGAIN)
+                return 0;
+            return -1;
+        }
+        out->start += n;
+    }
+
+    out->start = out->end = 0;
+    return 0;
+}
+
+static int conn_process(struct conn *c)
+{
+    struct buf *in = &c->in;
+
+    while (in->start < in->end) {
+        /* Make room for the largest response, pipelined requests may
+         * outrun the out buffer */
+        if (sizeof(c->out.data) - c->out.end < VALUE_MAX + LINE_MAX_LEN &&
+            conn_flush(c))
+            return -1;
+
+        ssize_t used = handle_request(c, in->data + in->start, in->end - in->start);
+        if (used < 0)
+            return -1;
+        if (used == 0)
+            break;
+        in->start += used;
+    }
+
+    /* Keep the partial request at the front */
+    memmove(in->data, in->data + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+
+    return 0;
+}
+
+static int conn_readable(struct conn *c)
+{
+    struct buf *in = &c->in;
+
+    ssize_t n = read(c->fd, in->data + in->end, sizeof(in->data) - in->end);
+    if (n <= 0)
+        return -1;
+    in->end += n;
+
+    if (conn_process(c))
+        return -1;
+
+    return conn_flush(c);
+}
+
+/*
+ * Workers
+ */
+struct worker {
+    pthread_t thread;
+    int epfd;
+};
+
+static struct worker workers[MAX_WORKERS];
+
+static void *worker_loop(void *arg)
+{
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (conn_readable(c)) {
+                close(c->fd);
+                free(c);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int listen_on(int port, const char *path)
+{
+    int fd;
+
+    if (path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+        unlink(path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)))
+            die("bind(%s): %s", path, strerror(errno));
+    } else {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        int one = 1;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+            die("socket: %s", strerror(errno));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)))
+            die("bind(%d): %s", port, strerror(errno));
+    }
+
+    if (listen(fd, 1024))
+        die("listen: %s", strerror(errno));
+
+    return fd;
+}
+
+static void preload(long keys, size_t value_size)
+{
+    char key[KEY_MAX + 1], value[VALUE_MAX];
+
+    fill_value(value, value_size, 0);
+    for (long i = 0; i < keys; i++) {
+        format_key(key, sizeof(key), i);
+        if (store_set(key, value, value_size))
+            die("preload: out of memory");
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-p port | -u path] [-k keys] [-s value_size]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_workers = 4, port = DEFAULT_PORT, opt;
+    const char *path = NULL;
+    long keys = DEFAULT_KEYS;
+    size_t value_size = DEFAULT_VALUE_SIZE;
+
+    while ((opt = getopt(argc, argv, "t:p:u:k:s:")) != -1) {
+        switch (opt) {
+        case 't': nr_workers = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'u': path = optarg; break;
+        case 'k': keys = atol(optarg); break;
+        case 's': value_size = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nr_workers < 1 || nr_workers > MAX_WORKERS || value_size > VALUE_MAX)
+        usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < STORE_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+    preload(keys, value_size);
+
+    for (int i = 0; i < nr_workers; i++) {
+        workers[i].epfd = epoll_create1(0);
+        if (workers[i].epfd == -1)
+            die("epoll_create1: %s", strerror(errno));
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]))
+            die("pthread_create failed");
+    }
+
+    int lfd = listen_on(port, path);
+    fprintf(stderr, "server: %d workers, %ld keys of %zu bytes\n",
+            nr_workers, keys, value_size);
+
+    for (unsigned next = 0;; next++) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR)
+                continue;
+            die("accept: %s", strerror(errno));
+        }
+
+        if (!path) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        struct conn *c = calloc(1, sizeof(*c));
+        if (!c)
+            die("out of memory");
+        c->fd = fd;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(workers[next % nr_workers].epfd, EPOLL_CTL_ADD, fd, &ev))
+            die("epoll_ctl: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+
+import subprocess as sp
+
+import os, sys
+import contextlib
+import shlex
+import time
+
+from pprint import pprint
+from platform import uname
+
+from versuchung.experiment import Experiment
+from versuchung.types import String, Integer
+from versuchung.files import File, Directory
+
+LIBKPAC_DIR = os.path.join(sys.path[0], "../../../libkpac")
+
+FIELDS = ["variant", "scope", "leaf", "pac_ret", "libkpac", "transport",
+          "mode", "connections", "target_rps", "requests", "seconds", "rps",
+          "p50", "p99", "p999", "p99_raw"]
+
+@contextlib.contextmanager
+def working_directory(path):
+    """Changes working directory and returns to previous on exit."""
+    prev_cwd = os.getcwd()
+    os.chdir(path)
+    try:
+        yield
+    finally:
+        os.chdir(prev_cwd)
+
+class Service(Experiment):
+    inputs = {
+        # Server build: plugin variant ("" for none) or PAC_RET for libkpac
+        "variant": String(""),
+        "scope":   String(""),
+        "leaf":    String(""),
+        "pac_ret": String(""),
+        # libkpac backend preloaded into the server, "" for none
+        "libkpac": String(""),
+
+        "transport":      String("tcp"),
+        "server_threads": Integer(4),
+        "connections":    Integer(8),
+        "mode":           String("open"),
+        # Requests/s over all connections, 0 is back to back (closed mode)
+        "rates":          String("10000,20000,50000,100000,200000"),
+        "duration":       Integer(10),
+
+        # E.g. "qemu-aarch64 -L /usr/aarch64-linux-gnu" on an x86 build host,
+        # with CROSS_COMPILE set for make
+        "runner":        String(""),
+        "cross_compile": lambda self: String(os.environ.get("CROSS_COMPILE", "")),
+
+        "arch":   lambda self: String(uname().machine),
+        "host":   lambda self: String(uname().node),
+        "kernel": lambda self: String(" ".join([
+            uname().system, uname().release, uname().version
+        ])),
+    }
+
+    outputs = {
+        "results": File("results.csv"),
+        "build":   Directory("build"),
+    }
+
+    def command(self, binary, *args):
+        runner = shlex.split(self.i.runner.value)
+        backend = self.i.libkpac.value
+        if not backend:
+            return runner + [binary, *args], None
+
+        libkpac = os.path.abspath(os.path.join(LIBKPAC_DIR, f"libkpac-{backend}.so"))
+        if runner:
+            # Keep LD_PRELOAD away from the emulator itself
+            return runner + ["-E", f"LD_PRELOAD={libkpac}", binary, *args], None
+        return [binary, *args], dict(os.environ, LD_PRELOAD=libkpac)
+
+    def run(self):
+        pprint(self.i)
+
+        server_out = os.path.join(self.o.build.path, "server")
+        client_out = os.path.join(self.o.build.path, "client")
+        if self.i.transport.value == "unix":
+            addr = ["-u", os.path.join(self.o.build.path, "service.sock")]
+        else:
+            addr = []
+
+        with working_directory(sys.path[0]):
+            if self.i.libkpac.value:
+                sp.check_call(["make", "-C", LIBKPAC_DIR])
+            sp.check_call(["make", f"OUT={server_out}",
+                           f"VARIANT={self.i.variant.value}",
+                           f"SCOPE={self.i.scope.value}",
+                           f"LEAF={self.i.leaf.value}",
+                           f"PAC_RET={self.i.pac_ret.value}",
+                           os.path.join(server_out, "server")])
+            # The load generator stays uninstrumented
+            sp.check_call(["make", f"OUT={client_out}",
+                           os.path.join(client_out, "loadgen")])
+
+            cmd, env = self.command(os.path.join(server_out, "server"),
+                                    "-t", str(self.i.server_threads.value), *addr)
+            print(" ".join(cmd))
+            server = sp.Popen(cmd, env=env)
+            time.sleep(1)
+
+            try:
+                with open(self.o.results.path, "w") as f:
+                    f.write(",".join(FIELDS) + "\n")
+
+                    for rate in self.i.rates.value.split(","):
+                        cmd = shlex.split(self.i.runner.value) + [
+                            os.path.join(client_out, "loadgen"),
+                            "-m", self.i.mode.value,
+                            "-c", str(self.i.connections.value),
+                            "-r", rate,
+                            "-d", str(self.i.duration.value), *addr]
+                        print(" ".join(cmd))
+
+                        res = sp.check_output(cmd, universal_newlines=True).strip()
+                        row = res.split(",")
+                        print(f"  {row[5]} req/s, p50 {row[6]} p99 {row[7]} "
+                              f"p99.9 {row[8]} ns (p99 {row[9]} uncorrected)")
+                        f.write(",".join([self.i.variant.value or "none",
+                                          self.i.scope.value, self.i.leaf.value,
+                                          self.i.pac_ret.value,
+                                          self.i.libkpac.value or "none",
+                                          self.i.transport.value, res]) + "\n")
+            finally:
+                server.terminate()
+                server.wait()
+
+
+if __name__ == "__main__":
+    experiment = Service()
+    dirname = experiment(sys.argv)
+    print(dirname)
@@ -0,0 +1,103 @@
+/*
+ * Startup cost of libkpac on the synthetic objects of synth.py, which this
+ * program is linked against.  Run it with LD_PRELOAD=libkpac-<backend>.so
+ * (under qemu-user: qemu-aarch64 -E LD_PRELOAD=...); without libkpac the
+ * libkpac columns are -1.
+ *
+ * Output: init_ns,vmas,islands,sites,pac_total,pac_patched,aut_total,
+ *         aut_patched,text_dirty_kib,island_kib,rss_kib
+ *
+ *   text_dirty_kib  private dirty memory of the synthetic objects' text
+ *   island_kib      resident anonymous executable memory (trampoline islands)
+ *   rss_kib         VmRSS, under qemu-user that of the emulator
+ *
+ * The memory columns are -1 if /proc/self/smaps is not available.  Text
+ * remapped by LIBKPAC_HUGE is anonymous and counts as island memory.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "summary.h"
+
+#define SYNTH_NAME		"libsyn"
+
+enum {
+    MAP_OTHER,
+    MAP_TEXT,
+    MAP_ISLAND,
+};
+
+static long text_dirty_kib = -1, island_kib = -1, rss_kib = -1;
+
+static void read_smaps(void)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return;
+
+    char line[4096], perms[5];
+    unsigned long start, end, inode;
+    int kind = MAP_OTHER, path;
+    long kib;
+
+    text_dirty_kib = island_kib = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx %4s %*s %*s %lu %n",
+                   &start, &end, perms, &inode, &path) == 4) {
+            char *name = line + path;
+            name[strcspn(name, "\n")] = '\0';
+
+            kind = MAP_OTHER;
+            if (perms[2] == 'x' && strstr(name, SYNTH_NAME))
+                kind = MAP_TEXT;
+            else if (perms[2] == 'x' && inode == 0 && !*name)
+                kind = MAP_ISLAND;
+            continue;
+        }
+
+        if (kind == MAP_TEXT && sscanf(line, "Private_Dirty: %ld kB", &kib) == 1)
+            text_dirty_kib += kib;
+        if (kind == MAP_ISLAND && sscanf(line, "Rss: %ld kB", &kib) == 1)
+            island_kib += kib;
+    }
+
+    fclose(f);
+}
+
+static void read_status(void)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld kB", &rss_kib) == 1)
+            break;
+
+    fclose(f);
+}
+
+int main(void)
+{
+    struct libkpac_summary none = {
+        .init_ns = -1, .vmas = -1, .islands = -1, .sites = -1,
+        .pac_total = -1, .pac_patched = -1, .aut_total = -1, .aut_patched = -1,
+    };
+    struct libkpac_summary *s = dlsym(RTLD_DEFAULT, "libkpac_summary");
+    if (!s)
+        s = &none;
+
+    read_smaps();
+    read_status();
+
+    printf("%lld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n",
+           (long long) s->init_ns, s->vmas, s->islands, s->sites,
+           s->pac_total, s->pac_patched, s->aut_total, s->aut_patched,
+           text_dirty_kib, island_kib, rss_kib);
+
+    return 0;
+}
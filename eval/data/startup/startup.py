@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+
+import subprocess as sp
+
+import os, sys
+import contextlib
+import shlex
+
+from pprint import pprint
+from platform import uname
+
+from versuchung.experiment import Experiment
+from versuchung.types import String, Integer
+from versuchung.files import File, Directory
+
+LIBKPAC_DIR = os.path.join(sys.path[0], "../../../libkpac")
+
+# Every dimension is scaled on its own, the others stay at their default
+DEFAULTS = {
+    "objects":  "4",
+    "text_kib": "256",
+    "density":  "0.5",
+    "mix":      "pre_fp,pre_lr,sub_fp_16,sub_lr_32,svc",
+}
+
+FIELDS = ["dimension", "objects", "text_kib", "density", "mix", "run",
+          "init_ns", "vmas", "islands", "sites",
+          "pac_total", "pac_patched", "aut_total", "aut_patched",
+          "text_dirty_kib", "island_kib", "rss_kib"]
+
+@contextlib.contextmanager
+def working_directory(path):
+    """Changes working directory and returns to previous on exit."""
+    prev_cwd = os.getcwd()
+    os.chdir(path)
+    try:
+        yield
+    finally:
+        os.chdir(prev_cwd)
+
+class Startup(Experiment):
+    inputs = {
+        "backend": String("kpacd"),
+        "runs":    Integer(5),
+
+        # Values of each dimension, separated by ';' (the mix contains ',')
+        "objects":  String("1;2;4;8;16;32;64"),
+        "text_kib": String("64;256;1024;4096;16384;65536"),
+        "density":  String("0;0.125;0.25;0.5;0.75;1"),
+        "mix":      String("pre_fp;pre_lr;sub_fp_64;sub_lr_496;svc"),
+
+        # E.g. "qemu-aarch64 -L /usr/aarch64-linux-gnu" on an x86 build host,
+        # with CROSS_COMPILE set for make
+        "runner":        String(""),
+        "cross_compile": lambda self: String(os.environ.get("CROSS_COMPILE", "")),
+
+        "arch":   lambda self: String(uname().machine),
+        "host":   lambda self: String(uname().node),
+        "kernel": lambda self: String(" ".join([
+            uname().system, uname().release, uname().version
+        ])),
+    }
+
+    outputs = {
+        "results": File("results.csv"),
+        "build":   Directory("build"),
+    }
+
+    def configs(self):
+        for dim in DEFAULTS:
+            for value in getattr(self.i, dim).value.split(";"):
+                yield dim, dict(DEFAULTS, **{dim: value})
+
+    def command(self, binary):
+        libkpac = os.path.abspath(os.path.join(LIBKPAC_DIR, f"libkpac-{self.i.backend.value}.so"))
+        runner = shlex.split(self.i.runner.value)
+        if runner:
+            # Keep LD_PRELOAD away from the emulator itself
+            return runner + ["-E", f"LD_PRELOAD={libkpac}", binary], None
+        return [binary], dict(os.environ, LD_PRELOAD=libkpac)
+
+    def run(self):
+        pprint(self.i)
+
+        with working_directory(sys.path[0]):
+            sp.check_call(["make", "-C", LIBKPAC_DIR])
+
+            with open(self.o.results.path, "w") as f:
+                f.write(",".join(FIELDS) + "\n")
+
+                for nr, (dim, cfg) in enumerate(self.configs()):
+                    out = os.path.join(self.o.build.path, str(nr))
+                    sp.check_call(["make", f"OUT={out}",
+                                   f"OBJECTS={cfg['objects']}",
+                                   f"TEXT_KIB={cfg['text_kib']}",
+                                   f"DENSITY={cfg['density']}",
+                                   f"MIX={cfg['mix']}"])
+
+                    cmd, env = self.command(os.path.join(out, "startup"))
+                    print(" ".join(cmd))
+                    for run in range(self.i.runs.value):
+                        res = sp.check_output(cmd, env=env, universal_newlines=True).strip()
+                        row = [dim, cfg["objects"], cfg["text_kib"], cfg["density"],
+                               '"' + cfg["mix"] + '"', str(run), res]
+                        print("  " + ",".join(row))
+                        f.write(",".join(row) + "\n")
+
+
+if __name__ == "__main__":
+    experiment = Startup()
+    dirname = experiment(sys.argv)
+    print(dirname)
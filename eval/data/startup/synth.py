@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+
+# Generate synthetic aarch64 shared objects for the libkpac startup benchmark:
+# <objects> files syn<k>.S with <text_kib> KiB of text each, cut into
+# functions of <fn_insns> instructions. A <density> fraction of them is signed
+# with PACIASP/AUTIASP around one of the trampoline benchmark's frame
+# patterns, drawn with the weights of <mix>.
+
+import argparse
+import os
+import random
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "../trampoline"))
+from gen import PACIASP, AUTIASP, patterns
+
+PATTERNS = dict(patterns())
+
+def parse_mix(mix):
+    weights = {}
+    for item in mix.split(","):
+        name, _, weight = item.partition("=")
+        if name not in PATTERNS:
+            raise argparse.ArgumentTypeError(f"unknown pattern: {name}")
+        weights[name] = float(weight or 1)
+    return weights
+
+def function(rnd, density, mix, fn_insns):
+    if rnd.random() >= density:
+        return ["nop"] * (fn_insns - 1) + ["ret"]
+
+    name = rnd.choices(list(mix), weights=list(mix.values()))[0]
+    prologue, epilogue, _ = PATTERNS[name]
+    insns = [PACIASP] + prologue
+    tail = epilogue + [AUTIASP, "ret"]
+    pad = max(fn_insns - len(insns) - len(tail), 1)
+    return insns + ["nop"] * pad + tail
+
+def emit(f, index, args, mix):
+    rnd = random.Random(args.seed * 1000003 + index)
+    budget = args.text_kib * 1024 // 4
+
+    print("/* Generated by synth.py, do not edit */", file=f)
+    print("\t.text", file=f)
+
+    nr = 0
+    while budget > 0:
+        insns = function(rnd, args.density, mix, args.fn_insns)
+        fn = f"syn{index}_{nr}"
+        print(f"\n\t.global {fn}\n\t.type {fn}, %function\n{fn}:", file=f)
+        for insn in insns:
+            print(f"\t{insn}", file=f)
+        print(f"\t.size {fn}, . - {fn}", file=f)
+
+        budget -= len(insns)
+        nr += 1
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate synthetic shared objects for libkpac.")
+    parser.add_argument("-o", "--out", default=".")
+    parser.add_argument("-n", "--objects", type=int, default=4)
+    parser.add_argument("-t", "--text-kib", type=int, default=256)
+    parser.add_argument("-d", "--density", type=float, default=0.5,
+                        help="fraction of signed functions")
+    parser.add_argument("-m", "--mix", type=parse_mix, default="pre_fp,pre_lr,sub_fp_16,sub_lr_32,svc",
+                        help="pattern[=weight],... of the signed functions")
+    parser.add_argument("-f", "--fn-insns", type=int, default=16)
+    parser.add_argument("-s", "--seed", type=int, default=0)
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    for index in range(args.objects):
+        with open(os.path.join(args.out, f"syn{index}.S"), "w") as f:
+            emit(f, index, args, args.mix)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,140 @@
+/*
+ * Cycles per call of the functions generated by gen.py.  Run the hint build
+ * as is for the unpatched baseline and with LD_PRELOAD=libkpac-<backend>.so
+ * for the trampolines, and the inline builds for the plugin's sequences.
+ *
+ * Output: build,pattern,offset,site,distance,ns_per_call,cycles_per_call
+ *
+ *   offset    trampoline offset of the pattern (-1: no trampoline)
+ *   site      what the PAC site looks like at run time: hint, svc, bl, inline
+ *   distance  from the site to the trampoline in bytes (bl only)
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NR_CALLS		1000000
+#define NR_WARMUP		10000
+#define SITE_WINDOW		8       /* Instructions searched for the site */
+
+#define INST_PACIASP		0xD503233F
+#define INST_SVC_PAC		0xD4013581
+
+#define die(fmt, ...)                                                   \
+    do {                                                                \
+        fprintf(stderr, "[%s:%d]: " fmt "\n",                           \
+                __FILE__, __LINE__, ##__VA_ARGS__);                     \
+        exit(EXIT_FAILURE);                                             \
+    } while (0)
+
+struct bench_fn {
+    const char *pattern;
+    long offset;
+    void (*fn)(void);
+};
+
+extern const struct bench_fn bench_fns[];
+
+static int perf_fd = -1;
+
+/* Cycles are optional, ns per call is always reported */
+static void perf_init(void)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+        .exclude_hv = 1,
+    };
+
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd == -1)
+        fprintf(stderr, "perf_event_open: %s, no cycles\n", strerror(errno));
+}
+
+static uint64_t cycles(void)
+{
+    uint64_t val = 0;
+
+    if (perf_fd != -1 && read(perf_fd, &val, sizeof(val)) != sizeof(val))
+        die("read(perf): %s", strerror(errno));
+
+    return val;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Classify the PAC site of the function as patched at load time */
+static const char *site(void (*fn)(void), long *distance)
+{
+    const uint32_t *text = (const uint32_t *) fn;
+
+    *distance = 0;
+    for (int i = 0; i < SITE_WINDOW; i++) {
+        if (text[i] == INST_PACIASP)
+            return "hint";
+        if (text[i] == INST_SVC_PAC)
+            return "svc";
+        if ((text[i] >> 26) == 0x25) {
+            /* bl: signed imm26 in instructions */
+            int32_t imm = (int32_t) (text[i] << 6) >> 6;
+            *distance = (long) imm * 4;
+            return "bl";
+        }
+    }
+
+    return "inline";
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    unsigned long nr_calls = NR_CALLS;
+    const char *build = "unknown";
+
+    while ((opt = getopt(argc, argv, "b:n:")) != -1) {
+        switch (opt) {
+        case 'b': build = optarg; break;
+        case 'n': nr_calls = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-b build] [-n calls]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    perf_init();
+
+    for (const struct bench_fn *b = bench_fns; b->fn; b++) {
+        void (*volatile fn)(void) = b->fn;
+        long distance;
+        const char *kind = site(b->fn, &distance);
+
+        for (unsigned long i = 0; i < NR_WARMUP; i++)
+            fn();
+
+        uint64_t c0 = cycles(), t0 = now_ns();
+        for (unsigned long i = 0; i < nr_calls; i++)
+            fn();
+        uint64_t t1 = now_ns(), c1 = cycles();
+
+        printf("%s,%s,%ld,%s,%ld,%.2f,%.2f\n", build, b->pattern, b->offset,
+               kind, distance, (double) (t1 - t0) / nr_calls,
+               perf_fd != -1 ? (double) (c1 - c0) / nr_calls : -1.0);
+    }
+
+    return 0;
+}
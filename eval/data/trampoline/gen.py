@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+
+# Generate the benchmark functions, one per libkpac pattern and trampoline
+# offset, and a table of them (struct bench_fn in bench.c).
+#
+#   hint    PACIASP/AUTIASP, as compiled with -mbranch-protection and patched
+#           by libkpac at load time
+#   inline  the plugin's prologue/epilogue (gcc/asm/<variant>/aarch64) in
+#           place of PACIASP/AUTIASP, selected by the include path
+
+import argparse
+
+PACIASP = "hint #25"
+AUTIASP = "hint #29"
+
+# Offsets of the LR slot in the sub sp frames, up to the largest trampoline
+OFFSETS = [0, 16, 32, 64, 128, 256, 496]
+
+def frame_pre_fp():
+    return (["stp x29, x30, [sp, #-16]!", "mov x29, sp"],
+            ["ldp x29, x30, [sp], #16"], 8)
+
+def frame_pre_lr():
+    return (["str x30, [sp, #-16]!"],
+            ["ldr x30, [sp], #16"], 0)
+
+def frame_sub_fp(off):
+    size = off + 16
+    return ([f"sub sp, sp, #{size}", f"stp x29, x30, [sp, #{off}]"],
+            [f"ldp x29, x30, [sp, #{off}]", f"add sp, sp, #{size}"], off + 8)
+
+def frame_sub_lr(off):
+    size = off + 16
+    return ([f"sub sp, sp, #{size}", f"str x30, [sp, #{off}]"],
+            [f"ldr x30, [sp, #{off}]", f"add sp, sp, #{size}"], off)
+
+def frame_svc():
+    # No pattern matches, libkpac falls back to the svc
+    return (["mov x16, sp", "stp x29, x30, [sp, #-16]!"],
+            ["ldp x29, x30, [sp], #16", "mov x16, sp"], -1)
+
+def patterns():
+    yield "pre_fp", frame_pre_fp()
+    yield "pre_lr", frame_pre_lr()
+    for off in OFFSETS:
+        yield f"sub_fp_{off}", frame_sub_fp(off)
+        yield f"sub_lr_{off}", frame_sub_lr(off)
+    yield "svc", frame_svc()
+
+def emit(mode):
+    sign = [PACIASP] if mode == "hint" else ['#include "prologue.S"']
+    auth = [AUTIASP] if mode == "hint" else ['#include "epilogue.S"']
+
+    print("/* Generated by gen.py, do not edit */")
+    print("\t.text")
+
+    table = []
+    for name, (prologue, epilogue, offset) in patterns():
+        fn = f"bench_{name}"
+        table.append((name, offset, fn))
+
+        print(f"\n\t.balign 16\n\t.type {fn}, %function\n{fn}:")
+        for insn in sign + prologue + ["nop"] + epilogue + auth + ["ret"]:
+            print(insn if insn.startswith("#") else f"\t{insn}")
+        print(f"\t.size {fn}, . - {fn}")
+
+    print("\n\t.section .rodata")
+    for name, _, _ in table:
+        print(f".Lname_{name}:\n\t.asciz \"{name}\"")
+
+    print("\n\t.section .data.rel.ro, \"aw\"\n\t.balign 8\n\t.global bench_fns\nbench_fns:")
+    for name, offset, fn in table:
+        print(f"\t.quad .Lname_{name}, {offset}, {fn}")
+    print("\t.quad 0, 0, 0")
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate trampoline benchmark functions.")
+    parser.add_argument("mode", choices=["hint", "inline"])
+    emit(parser.parse_args().mode)
+
+if __name__ == "__main__":
+    main()
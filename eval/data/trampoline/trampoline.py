@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+import subprocess as sp
+
+import os, sys
+import contextlib
+
+from pprint import pprint
+from platform import uname
+
+from versuchung.experiment import Experiment
+from versuchung.types import String, Integer
+from versuchung.files import File
+
+LIBKPAC_DIR = os.path.join(sys.path[0], "../../../libkpac")
+PAC_PL_DLL  = os.path.join(sys.path[0], "../../../pac-pl/pac-pl.so")
+
+FIELDS = ["build", "pattern", "offset", "site", "distance", "ns_per_call", "cycles_per_call"]
+
+def libkpac(backend):
+    return os.path.join(LIBKPAC_DIR, f"libkpac-{backend}.so")
+
+# name: (binary, LD_PRELOAD, extra environment)
+BUILDS = {
+    "baseline":       ("bench-hint", [], {}),
+    "libkpac-kpacd":  ("bench-hint", [libkpac("kpacd")], {}),
+    "libkpac-pac-pl": ("bench-hint", [PAC_PL_DLL, libkpac("pac-pl")], {}),
+    "libkpac-svc":    ("bench-hint", [libkpac("kpacd")], {"LIBKPAC_MODE": "svc-only"}),
+    "inline-kpacd":   ("bench-inline-kpacd", [], {}),
+    "inline-pac-pl":  ("bench-inline-pac-pl", [PAC_PL_DLL], {}),
+    "inline-syscall": ("bench-inline-syscall", [], {}),
+    "patchable":      ("bench-inline-patchable", [libkpac("kpacd")], {}),
+}
+
+@contextlib.contextmanager
+def working_directory(path):
+    """Changes working directory and returns to previous on exit."""
+    prev_cwd = os.getcwd()
+    os.chdir(path)
+    try:
+        yield
+    finally:
+        os.chdir(prev_cwd)
+
+class Trampoline(Experiment):
+    inputs = {
+        "builds": String(",".join(BUILDS)),
+        "calls": Integer(1000000),
+
+        "arch":   lambda self: String(uname().machine),
+        "host":   lambda self: String(uname().node),
+        "kernel": lambda self: String(" ".join([
+            uname().system, uname().release, uname().version
+        ])),
+    }
+
+    outputs = {
+        "results": File("results.csv"),
+    }
+
+    def run(self):
+        pprint(self.i)
+
+        with working_directory(sys.path[0]):
+            sp.check_call(["make"])
+
+            with open(self.o.results.path, "w") as f:
+                f.write(",".join(FIELDS) + "\n")
+
+                for build in self.i.builds.value.split(","):
+                    binary, preload, extra = BUILDS[build]
+                    env = dict(os.environ, **extra)
+                    if preload:
+                        env["LD_PRELOAD"] = " ".join(preload)
+
+                    cmd = [f"./{binary}", "-b", build, "-n", str(self.i.calls.value)]
+                    print(" ".join(cmd))
+                    out = sp.check_output(cmd, env=env, universal_newlines=True)
+                    sys.stdout.write(out)
+                    f.write(out)
+
+
+if __name__ == "__main__":
+    experiment = Trampoline()
+    dirname = experiment(sys.argv)
+    print(dirname)
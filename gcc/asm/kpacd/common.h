@@ -10,4 +10,24 @@
 #define REG_TWEAK		16
 #define REG_CIPHER		24
 
+/* Batch authentication, used by libkpac's unwinder: an OP_AUT_BATCH request
+ * has REG_PLAIN pairs of {pointer, modifier} at BATCH_OFF, at most
+ * BATCH_MAX, and kpacd replaces each pointer by its authenticated value. */
+#define OP_AUT_BATCH		3
+#define BATCH_OFF		0x100
+#define BATCH_MAX		128
+
+/* Memo table kpacd maps read-only at PAC_BASE + MEMO_OFF, used by the
+ * kpacd-memo sequences: the results of past requests, direct mapped on
+ * ((plain ^ (tweak >> 2)) >> 2) mod 2^MEMO_BITS.  Only kpacd writes it, an
+ * entry is a seqlock that is odd while kpacd rewrites it. */
+#define MEMO_OFF		0x2000
+#define MEMO_BITS		8
+#define MEMO_ENTRY_SHIFT	5
+
+#define MEMO_SEQ		0
+#define MEMO_PLAIN		8
+#define MEMO_TWEAK		16
+#define MEMO_CIPHER		24
+
 #endif /* __ASM_PAC_COMMON_H */
@@ -1,6 +1,11 @@
 #ifndef __ASM_PAC_PL_COMMON_H
 #define __ASM_PAC_PL_COMMON_H
 
+/* Channel 0 of the device.  These sequences always use it: they have no
+ * way to find the channel of the thread (channel.h of libkpac) that would
+ * still fit into the patchable sites, which copy them.  Threads of binaries
+ * built with them therefore share one channel; the patchable variant with
+ * libkpac gives each thread its own. */
 #define PAC_PL_BASE		0xA0000000
 
 #define PAC_PL_PLAIN		0
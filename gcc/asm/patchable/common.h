@@ -0,0 +1,14 @@
+#ifndef __ASM_PATCHABLE_COMMON_H
+#define __ASM_PATCHABLE_COMMON_H
+
+/* Every site is listed in a note: name "KPAC", type NT_KPAC_SITE, descriptor
+ * holding the site offset relative to the descriptor and the site type. */
+#define NT_KPAC_SITE		1
+
+#define SITE_PAC		1
+#define SITE_AUT		2
+
+/* Instructions per site, enough for the longest backend sequence (kpacd) */
+#define SITE_LEN		10
+
+#endif /* __ASM_PATCHABLE_COMMON_H */
@@ -5,11 +5,17 @@
 #include <tree-pass.h>
 #include <stringpool.h>
 #include <attribs.h>
+#include <cgraph.h>
 #include <memmodel.h>
 #include <emit-rtl.h>
 #include <gimple.h>
 #include <gimple-iterator.h>
+#include <gimple-walk.h>
+#include <ssa.h>
+#include <value-query.h>
 #include <diagnostic.h>
+#include <unistd.h>
+#include <fnmatch.h>
 #include <assert.h>
 
 #define PLUGIN_NAME "pac_sw_plugin"
@@ -38,26 +44,138 @@ enum { PROLOGUE, EPILOGUE };
 static const char *prologue_s = NULL;
 static const char *epilogue_s = NULL;
 
+// Split variant: the request is submitted as early as possible and its result
+// is waited for as late as possible, so that the round trip overlaps with the
+// code in between.
+static const char *asm_dir = NULL;
+static bool split_request = false;
+static const char *prologue_submit_s = NULL;
+static const char *prologue_wait_s = NULL;
+static const char *epilogue_submit_s = NULL;
+static const char *epilogue_wait_s = NULL;
+
+// Sibling call fusion: an instrumented function that tail-calls another
+// instrumented function of the same unit skips its authentication and enters
+// the callee right after its prologue with LR still signed.
+#define SIGNED_ENTRY_PREFIX ".Lpac_signed."
+static bool fuse_sibcalls = false;
+static hash_set<tree> *signed_entries = NULL;
+
 enum {
     SIGN_SCOPE_nil = 0,         // None
     SIGN_SCOPE_char,            // Char/byte arrays bigger than ssp-buffer-size parameter
     SIGN_SCOPE_array,           // + Arrays of any size and type
     SIGN_SCOPE_strong,          // + Local variables that had their address taken
+    SIGN_SCOPE_bounded,         // strong, unless all stores to the frame are
+                                // provably in bounds (see pass_bounded_pac)
     SIGN_SCOPE_all              // All functions
 };
 
 static int global_scope = SIGN_SCOPE_array;
 static bool include_leaf = false;
 
+// Scope rules read from a file: glob patterns on function names, source paths
+// and mangled names mapped to scopes.  The first matching rule wins.  Patterns
+// without wildcards are looked up in a hash table, the others are tried in
+// order.  File rules are always tried in order, their result is cached per
+// source file.
+enum { RULE_fn = 0, RULE_file, RULE_mangled, RULE_KINDS };
+
+struct scope_rule {
+    const char *pattern;
+    int scope;
+};
+
+static vec<scope_rule> scope_rules;
+static hash_map<nofree_string_hash, int> *exact_rules[RULE_KINDS];
+static vec<int> glob_rules[RULE_KINDS];
+static hash_map<nofree_string_hash, int> *file_rules = NULL;
+
+// Stack protector deduplication: a signed function that also gets a canary
+// pays for two protections of the same return address.
+enum {
+    SSP_both = 0,               // Keep both
+    SSP_pac,                    // Drop the canary in signed functions
+    SSP_canary                  // Do not sign functions with a canary
+};
+
+static int ssp_policy = SSP_both;
+
+// Functions whose canary was dropped by pass_ssp_pac.
+static hash_set<tree> *ssp_dropped_fns = NULL;
+
 static struct {
     int total;
     int instrumented;
-} inst_stat = { 0, 0 };
+    int fused;
+} inst_stat = { 0, 0, 0 };
 static const char *inst_stat_file = NULL;
 
+// Per-function instrumentation report, written to a separate file per unit.
+enum {
+    REASON_none = 0,
+    REASON_all,                 // Scope covers all functions
+    REASON_alloca,              // Calls alloca
+    REASON_char,                // Has a large char array
+    REASON_array,               // Has an array
+    REASON_addressable          // Has a local with its address taken
+};
+
+enum {
+    DEDUP_none = 0,
+    DEDUP_canary,               // Canary dropped, signed instead
+    DEDUP_pac                   // Signing skipped, canary kept
+};
+
+struct inst_record {
+    const char *name;
+    int reason;
+    int epilogues;              // Epilogues instrumented
+    int fused;                  // Sibling calls fused
+    int bytes;                  // Estimated code size added
+    int dedup;                  // Protection dropped in favour of the other
+    int overlap;                // Instructions between split submit and wait
+    bool signed_p;              // Return address signed
+};
+
+#define INST_BYTES 4            // Estimated size of an instruction
+
+static const char *report_dir = NULL;
+static int prologue_insns = 0;
+static int epilogue_insns = 0;
+static struct inst_record cur_record;
+static vec<inst_record> inst_records;
+
+// Profile-guided budget: functions called at least hot_threshold times (per
+// second in the profile file, or per training run with -fprofile-use) are
+// restricted to the char scope.  A budget is turned into a threshold when the
+// first function is instrumented, see budget_threshold().  With report=DIR the
+// decisions go to DIR/<unit>.<pid>.profile.
+struct profile_decision {
+    const char *name;
+    gcov_type calls;            // -1 if unknown
+    int scope;
+    bool hot;
+    bool instrumented;
+};
+
+static hash_map<nofree_string_hash, gcov_type> *profile_calls = NULL;
+static gcov_type profile_budget = -1;
+static gcov_type hot_threshold = -1;
+static struct profile_decision cur_decision;
+static vec<profile_decision> profile_decisions;
+
 extern gcc::context *g;
 
 static unsigned int execute_inst_pac(void);
+static unsigned int execute_bounded_pac(function *fun);
+static unsigned int execute_ssp_pac(function *fun);
+static int rule_scope(tree decl);
+static gcov_type budget_threshold(gcov_type budget);
+static void disable_incompatible_opts(void);
+
+// Functions whose frames were proven to be written only within bounds.
+static hash_set<tree> *bounded_fns = NULL;
 
 // Structure describing an attribute
 static struct attribute_spec scope_attr = {
@@ -92,6 +210,97 @@ public:
 // Instantiate a new instrumentation RTL pass.
 static pass_inst_pac inst_pass = pass_inst_pac(g);
 
+// Metadata for the GIMPLE analysis pass.  Runs after the first VRP pass while
+// array accesses are still ARRAY_REFs and range information is available, and
+// records the functions eligible to be skipped in the bounded scope.
+const pass_data pass_data_bounded_pac = {
+    .type = GIMPLE_PASS,
+    .name = "bounded_pac",
+    .optinfo_flags = OPTGROUP_NONE,
+    .tv_id = TV_NONE,
+    .properties_required = PROP_ssa,
+    .properties_provided = 0,
+    .properties_destroyed = 0,
+    .todo_flags_start = 0,
+    .todo_flags_finish = 0
+};
+
+class pass_bounded_pac : public gimple_opt_pass {
+public:
+    pass_bounded_pac (gcc::context *ctxt) : gimple_opt_pass (pass_data_bounded_pac, ctxt) {}
+    virtual bool gate(function *fun)
+    {
+        return optimize > 0;
+    }
+    virtual unsigned int execute(function *fun)
+    {
+        return execute_bounded_pac(fun);
+    }
+};
+
+// Instantiate a new bounds analysis GIMPLE pass.
+static pass_bounded_pac bounded_pass = pass_bounded_pac(g);
+
+// Metadata for the GIMPLE stack protector pass.  Runs right before expansion,
+// which decides on the canary, and drops it in functions that are going to be
+// signed.
+const pass_data pass_data_ssp_pac = {
+    .type = GIMPLE_PASS,
+    .name = "ssp_pac",
+    .optinfo_flags = OPTGROUP_NONE,
+    .tv_id = TV_NONE,
+    .properties_required = 0,
+    .properties_provided = 0,
+    .properties_destroyed = 0,
+    .todo_flags_start = 0,
+    .todo_flags_finish = 0
+};
+
+class pass_ssp_pac : public gimple_opt_pass {
+public:
+    pass_ssp_pac (gcc::context *ctxt) : gimple_opt_pass (pass_data_ssp_pac, ctxt) {}
+    virtual bool gate(function *fun)
+    {
+        return ssp_policy == SSP_pac && flag_stack_protect;
+    }
+    virtual unsigned int execute(function *fun)
+    {
+        return execute_ssp_pac(fun);
+    }
+};
+
+// Instantiate a new stack protector GIMPLE pass.
+static pass_ssp_pac ssp_pass = pass_ssp_pac(g);
+
+// Metadata for the RTL option pass.  Under LTO (and with the optimize
+// attribute) options are restored per function from the streamed
+// optimization node, so the incompatible optimizations disabled at plugin
+// initialization have to be disabled again for every function.
+const pass_data pass_data_opts_pac = {
+    .type = RTL_PASS,
+    .name = "opts_pac",
+    .optinfo_flags = OPTGROUP_NONE,
+    .tv_id = TV_NONE,
+    .properties_required = 0,
+    .properties_provided = 0,
+    .properties_destroyed = 0,
+    .todo_flags_start = 0,
+    .todo_flags_finish = 0
+};
+
+class pass_opts_pac : public rtl_opt_pass {
+public:
+    pass_opts_pac (gcc::context *ctxt) : rtl_opt_pass (pass_data_opts_pac, ctxt) {}
+    virtual unsigned int execute(function* exec_fun)
+    {
+        disable_incompatible_opts();
+        return 0;
+    }
+};
+
+// Instantiate a new option RTL pass.
+static pass_opts_pac opts_pass = pass_opts_pac(g);
+
 // Plugin callback called during attribute registration.
 static void register_attributes(void *event_data, void *data)
 {
@@ -158,34 +367,217 @@ static unsigned int stack_protect_classify_type(tree type)
     return ret;
 }
 
-// Recursively check for existence of protected declarations (arrays).
-static bool has_protected_decls(int scope, tree decl_initial)
+// Recursively check for existence of protected declarations (arrays) and
+// return the reason the function has to be signed.
+static int protected_decls_reason(int scope, tree decl_initial)
 {
+    int reason;
+
     if (scope == SIGN_SCOPE_nil || !decl_initial)
-        return false;
+        return REASON_none;
     if (scope == SIGN_SCOPE_all)
-        return true;
+        return REASON_all;
 
     if (TREE_CODE(decl_initial) == VAR_DECL) {
         unsigned int ret = stack_protect_classify_type(TREE_TYPE(decl_initial));
         if (scope >= SIGN_SCOPE_char && (ret & SPCT_HAS_LARGE_CHAR_ARRAY))
-            return true;
+            return REASON_char;
         else if (scope >= SIGN_SCOPE_array && (ret & SPCT_HAS_ARRAY))
-            return true;
+            return REASON_array;
         else if (scope >= SIGN_SCOPE_strong && TREE_ADDRESSABLE(decl_initial))
-            return true;
+            return REASON_addressable;
         else
-            return has_protected_decls(scope, DECL_CHAIN(decl_initial));
+            return protected_decls_reason(scope, DECL_CHAIN(decl_initial));
+    }
+
+    if (TREE_CODE(decl_initial) == BLOCK) {
+        if ((reason = protected_decls_reason(scope, BLOCK_VARS(decl_initial))))
+            return reason;
+        if ((reason = protected_decls_reason(scope, BLOCK_CHAIN(decl_initial))))
+            return reason;
+        return protected_decls_reason(scope, BLOCK_SUBBLOCKS(decl_initial));
+    }
+
+    return REASON_none;
+}
+
+// Check whether DECL lives in the current frame and may be written through
+// memory: arrays and variables that had their address taken.
+static bool frame_decl_p(tree decl)
+{
+    if (!VAR_P(decl) || !auto_var_in_fn_p(decl, current_function_decl))
+        return false;
+
+    return TREE_ADDRESSABLE(decl) ||
+        (stack_protect_classify_type(TREE_TYPE(decl)) & SPCT_HAS_ARRAY);
+}
+
+static bool index_in_bounds(tree ref, gimple *stmt)
+{
+    tree idx = TREE_OPERAND(ref, 1);
+    tree domain = TYPE_DOMAIN(TREE_TYPE(TREE_OPERAND(ref, 0)));
+    tree low, high;
+    value_range vr;
+
+    if (!domain)
+        return false;
+
+    low = TYPE_MIN_VALUE(domain);
+    high = TYPE_MAX_VALUE(domain);
+    if (!low || !high || TREE_CODE(low) != INTEGER_CST || TREE_CODE(high) != INTEGER_CST)
+        return false;
+
+    if (TREE_CODE(idx) == INTEGER_CST)
+        return tree_int_cst_le(low, idx) && tree_int_cst_le(idx, high);
+
+    if (TREE_CODE(idx) != SSA_NAME ||
+        !get_range_query(cfun)->range_of_expr(vr, idx, stmt) ||
+        vr.kind() != VR_RANGE)
+        return false;
+
+    return tree_int_cst_le(low, vr.min()) && tree_int_cst_le(vr.max(), high);
+}
+
+// Check that a store to REF cannot reach outside of a frame object.  Stores
+// through pointers are not considered here: a pointer into the frame can only
+// be formed by taking an address, which find_frame_escape() rejects.
+static bool store_in_bounds(tree ref, gimple *stmt)
+{
+    bool in_bounds = true;
+    tree base = ref;
+
+    while (handled_component_p(base)) {
+        if (TREE_CODE(base) == ARRAY_RANGE_REF)
+            in_bounds = false;
+        else if (TREE_CODE(base) == ARRAY_REF && !index_in_bounds(base, stmt))
+            in_bounds = false;
+        base = TREE_OPERAND(base, 0);
+    }
+
+    if (DECL_P(base))
+        return !frame_decl_p(base) || in_bounds;
+
+    if ((TREE_CODE(base) == MEM_REF || TREE_CODE(base) == TARGET_MEM_REF) &&
+        TREE_CODE(TREE_OPERAND(base, 0)) == ADDR_EXPR) {
+        tree decl = get_base_address(TREE_OPERAND(TREE_OPERAND(base, 0), 0));
+        tree size = TYPE_SIZE_UNIT(TREE_TYPE(ref));
+
+        if (!decl || !DECL_P(decl) || !frame_decl_p(decl))
+            return true;
+        if (TREE_CODE(base) == TARGET_MEM_REF || !in_bounds || !size ||
+            !tree_fits_uhwi_p(size) || !DECL_SIZE_UNIT(decl) ||
+            !tree_fits_uhwi_p(DECL_SIZE_UNIT(decl)))
+            return false;
+
+        offset_int off = mem_ref_offset(base);
+        return wi::ges_p(off, 0) &&
+            wi::les_p(off + tree_to_uhwi(size), tree_to_uhwi(DECL_SIZE_UNIT(decl)));
+    }
+
+    return true;
+}
+
+// walk_tree callback: find an address of a frame object outside of a direct
+// memory reference.
+static tree find_frame_escape(tree *tp, int *walk_subtrees, void *data)
+{
+    tree t = *tp;
+
+    if (TYPE_P(t) ||
+        (TREE_CODE(t) == MEM_REF && TREE_CODE(TREE_OPERAND(t, 0)) == ADDR_EXPR)) {
+        *walk_subtrees = 0;
+        return NULL_TREE;
     }
 
-    if (TREE_CODE(decl_initial) == BLOCK)
-        return (has_protected_decls(scope, BLOCK_VARS(decl_initial)) ||
-                has_protected_decls(scope, BLOCK_CHAIN(decl_initial)) ||
-                has_protected_decls(scope, BLOCK_SUBBLOCKS(decl_initial)));
+    if (TREE_CODE(t) == ADDR_EXPR) {
+        tree base = get_base_address(TREE_OPERAND(t, 0));
+        if (base && DECL_P(base) && frame_decl_p(base))
+            return t;
+    }
+
+    return NULL_TREE;
+}
+
+// Check whether the callee neither writes through nor retains argument I.
+// The flags come from the IPA mod/ref summaries, which with -flto are
+// propagated across units in WPA and streamed into LTRANS.
+static bool call_arg_harmless(gcall *call, unsigned i)
+{
+    int need = EAF_NO_DIRECT_CLOBBER | EAF_NO_DIRECT_ESCAPE | EAF_NOT_RETURNED_DIRECTLY;
+
+    return (gimple_call_arg_flags(call, i) & need) == need;
+}
+
+static bool call_escapes_frame(gcall *call)
+{
+    for (unsigned i = 0; i < gimple_call_num_args(call); i++) {
+        if (TREE_CODE(gimple_call_arg(call, i)) == ADDR_EXPR && call_arg_harmless(call, i))
+            continue;
+        if (walk_tree(gimple_call_arg_ptr(call, i), find_frame_escape, NULL, NULL))
+            return true;
+    }
+
+    if (gimple_call_lhs(call) &&
+        walk_tree(gimple_call_lhs_ptr(call), find_frame_escape, NULL, NULL))
+        return true;
+    if (gimple_call_fn(call) &&
+        walk_tree(gimple_call_fn_ptr(call), find_frame_escape, NULL, NULL))
+        return true;
+    if (gimple_call_chain(call) &&
+        walk_tree(gimple_call_chain_ptr(call), find_frame_escape, NULL, NULL))
+        return true;
 
     return false;
 }
 
+// For each function check whether all writes to its frame objects are in
+// bounds and none of their addresses escape.
+static unsigned int execute_bounded_pac(function *fun)
+{
+    basic_block bb;
+
+    FOR_EACH_BB_FN(bb, fun) {
+        for (gphi_iterator gsi = gsi_start_phis(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+            gphi *phi = gsi.phi();
+            for (unsigned i = 0; i < gimple_phi_num_args(phi); i++)
+                if (walk_tree(gimple_phi_arg_def_ptr(phi, i), find_frame_escape, NULL, NULL))
+                    return 0;
+        }
+
+        for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+            gimple *stmt = gsi_stmt(gsi);
+            struct walk_stmt_info wi;
+
+            if (is_gimple_debug(stmt))
+                continue;
+
+            if (gimple_store_p(stmt) && !store_in_bounds(gimple_get_lhs(stmt), stmt))
+                return 0;
+
+            if (gasm *asm_stmt = dyn_cast<gasm *>(stmt))
+                for (unsigned i = 0; i < gimple_asm_noutputs(asm_stmt); i++)
+                    if (!store_in_bounds(TREE_VALUE(gimple_asm_output_op(asm_stmt, i)), stmt))
+                        return 0;
+
+            if (gcall *call = dyn_cast<gcall *>(stmt)) {
+                if (call_escapes_frame(call))
+                    return 0;
+                continue;
+            }
+
+            memset(&wi, 0, sizeof(wi));
+            if (walk_gimple_op(stmt, find_frame_escape, &wi))
+                return 0;
+        }
+    }
+
+    dbg(PLUGIN_NAME ": %s: %s bounded.\n", main_input_filename,
+        IDENTIFIER_POINTER(DECL_NAME(fun->decl)));
+    bounded_fns->add(fun->decl);
+
+    return 0;
+}
+
 static int str_scope(const char *s)
 {
     if (!strcmp(s, "nil"))
@@ -198,19 +590,160 @@ static int str_scope(const char *s)
         return SIGN_SCOPE_strong;
     if (!strcmp(s, "all"))
         return SIGN_SCOPE_all;
+    if (!strcmp(s, "bounded"))
+        return SIGN_SCOPE_bounded;
 
     return -1;
 }
 
-static int get_current_scope(void)
+static const char *scope_str(int scope)
+{
+    static const char *names[] = {
+        "nil", "char", "array", "strong", "bounded", "all"
+    };
+
+    return names[scope];
+}
+
+static bool function_calls(gcov_type *calls)
 {
-    int scope = global_scope;
     tree decl = current_function_decl;
-    tree alias = lookup_attribute(SCOPE_ATTR, DECL_ATTRIBUTES(decl));
 
-    if (!alias)
+    if (profile_calls) {
+        gcov_type *val = profile_calls->get(IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(decl)));
+        if (!val)
+            val = profile_calls->get(IDENTIFIER_POINTER(DECL_NAME(decl)));
+        if (!val)
+            return false;
+
+        *calls = *val;
+        return true;
+    }
+
+    if (profile_status_for_fn(cfun) == PROFILE_READ) {
+        profile_count count = ENTRY_BLOCK_PTR_FOR_FN(cfun)->count.ipa();
+        if (!count.initialized_p())
+            return false;
+
+        *calls = count.to_gcov_type();
+        return true;
+    }
+
+    return false;
+}
+
+// Restrict hot functions to the char scope unless their scope is given
+// explicitly by the attribute or a rule.
+static int profile_scope(int scope)
+{
+    tree decl = current_function_decl;
+    gcov_type calls;
+
+    cur_decision.name = IDENTIFIER_POINTER(DECL_NAME(decl));
+    cur_decision.calls = -1;
+    cur_decision.scope = scope;
+    cur_decision.hot = false;
+    cur_decision.instrumented = false;
+
+    if (profile_budget >= 0 && hot_threshold < 0)
+        hot_threshold = budget_threshold(profile_budget);
+
+    if (hot_threshold < 0 || explicit_scope(decl))
+        return scope;
+    if (!function_calls(&calls))
+        return scope;
+
+    cur_decision.calls = calls;
+    if (calls < hot_threshold || scope == SIGN_SCOPE_nil || scope == SIGN_SCOPE_char)
         return scope;
 
+    cur_decision.hot = true;
+    cur_decision.scope = SIGN_SCOPE_char;
+    return SIGN_SCOPE_char;
+}
+
+// Index of the first rule of KIND matching S, or -1.
+static int rule_match(int kind, const char *s)
+{
+    int best = -1;
+    int *exact = exact_rules[kind]->get(s);
+
+    if (exact)
+        best = *exact;
+
+    for (unsigned i = 0; i < glob_rules[kind].length(); i++) {
+        int idx = glob_rules[kind][i];
+        if (best >= 0 && idx > best)
+            break;
+        if (!fnmatch(scope_rules[idx].pattern, s, 0)) {
+            best = idx;
+            break;
+        }
+    }
+
+    return best;
+}
+
+// File patterns containing a slash are matched against the path as given on
+// the command line, others against its last component.
+static int file_rule_match(const char *file)
+{
+    int *cached = file_rules->get(file);
+    int best = -1;
+
+    if (cached)
+        return *cached;
+
+    for (unsigned i = 0; i < glob_rules[RULE_file].length(); i++) {
+        int idx = glob_rules[RULE_file][i];
+        const char *pattern = scope_rules[idx].pattern;
+        const char *name = strchr(pattern, '/') ? file : lbasename(file);
+
+        if (!fnmatch(pattern, name, 0)) {
+            best = idx;
+            break;
+        }
+    }
+
+    file_rules->put(xstrdup(file), best);
+    return best;
+}
+
+// Scope of the function given by the rules, or -1 if none matches.
+static int rule_scope(tree decl)
+{
+    int best, idx;
+
+    if (scope_rules.is_empty())
+        return -1;
+
+    best = rule_match(RULE_fn, IDENTIFIER_POINTER(DECL_NAME(decl)));
+    idx = rule_match(RULE_mangled, IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(decl)));
+    if (idx >= 0 && (best < 0 || idx < best))
+        best = idx;
+    idx = file_rule_match(DECL_SOURCE_FILE(decl));
+    if (idx >= 0 && (best < 0 || idx < best))
+        best = idx;
+
+    return best < 0 ? -1 : scope_rules[best].scope;
+}
+
+// Whether the scope of DECL is given explicitly by the attribute or a rule.
+static bool explicit_scope(tree decl)
+{
+    return lookup_attribute(SCOPE_ATTR, DECL_ATTRIBUTES(decl)) || rule_scope(decl) >= 0;
+}
+
+static int decl_scope(tree decl)
+{
+    int scope = global_scope;
+    tree alias = lookup_attribute(SCOPE_ATTR, DECL_ATTRIBUTES(decl));
+
+    if (!alias) {
+        int rule = rule_scope(decl);
+        return rule >= 0 ? rule : scope;
+    }
+
     const char *val = TREE_STRING_POINTER(TREE_VALUE(TREE_VALUE(alias)));
     scope = str_scope(val);
     if (scope == -1)
@@ -219,9 +752,41 @@ static int get_current_scope(void)
     return scope;
 }
 
+static int get_current_scope(void)
+{
+    return decl_scope(current_function_decl);
+}
+
+// Reason to sign the current function within SCOPE, REASON_none if it does not
+// need to be signed.
+static int scope_reason(int scope)
+{
+    if (cfun->calls_alloca)
+        return REASON_alloca;
+
+    if (scope == SIGN_SCOPE_bounded) {
+        if (bounded_fns->contains(current_function_decl))
+            return REASON_none;
+        scope = SIGN_SCOPE_strong;
+    }
+
+    return protected_decls_reason(scope, DECL_INITIAL(current_function_decl));
+}
+
 static bool signing_required(void)
 {
-    int scope = get_current_scope();
+    int scope = profile_scope(get_current_scope());
+
+    cur_record.name = IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(current_function_decl));
+    cur_record.reason = REASON_none;
+    cur_record.epilogues = 0;
+    cur_record.fused = 0;
+    cur_record.bytes = 0;
+    cur_record.dedup = DEDUP_none;
+    cur_record.overlap = 0;
+    cur_record.signed_p = false;
+    if (ssp_dropped_fns && ssp_dropped_fns->contains(current_function_decl))
+        cur_record.dedup = DEDUP_canary;
 
     if (scope == SIGN_SCOPE_nil)
         return false;
@@ -237,14 +802,82 @@ static bool signing_required(void)
     if (crtl->calls_eh_return)
         return false;
 
+    /* The canary is gone already, so sign even where the guess of
+       execute_ssp_pac() turned out wrong and LR is not saved after all. */
 #ifdef GCC_AARCH64_H
-    if (!aarch64_signing_required())
+    if (cur_record.dedup != DEDUP_canary && !aarch64_signing_required())
         return false;
 #endif
 
-    if (cfun->calls_alloca)
-        return true;
-    return has_protected_decls(scope, DECL_INITIAL(current_function_decl));
+    cur_record.reason = scope_reason(scope);
+    if (cur_record.reason == REASON_none && cur_record.dedup != DEDUP_canary)
+        return false;
+
+    if (ssp_policy == SSP_canary && crtl->stack_protect_guard) {
+        cur_record.dedup = DEDUP_pac;
+        return false;
+    }
+
+    return true;
+}
+
+// Check whether the function is certain to save LR on the stack, that is it
+// contains a call which is neither a tail call nor a noreturn call.  Builtins
+// are not counted as they might be expanded inline.
+static bool saves_lr(function *fun)
+{
+    basic_block bb;
+
+    FOR_EACH_BB_FN(bb, fun) {
+        for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+            gcall *call = dyn_cast<gcall *>(gsi_stmt(gsi));
+
+            if (!call || gimple_call_internal_p(call) || gimple_call_tail_p(call) ||
+                gimple_call_noreturn_p(call) || gimple_call_builtin_p(call))
+                continue;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool calls_eh_return(function *fun)
+{
+    basic_block bb;
+
+    FOR_EACH_BB_FN(bb, fun)
+        for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+            if (gimple_call_builtin_p(gsi_stmt(gsi), BUILT_IN_EH_RETURN))
+                return true;
+
+    return false;
+}
+
+// Drop the canary of functions that are going to be signed.  The signing
+// decision is repeated here before expansion, so only functions are taken
+// whose LR is saved and which therefore cannot be skipped by
+// aarch64_signing_required() later.
+static unsigned int execute_ssp_pac(function *fun)
+{
+    tree decl = fun->decl;
+    int scope = profile_scope(get_current_scope());
+
+    if (scope == SIGN_SCOPE_nil || lookup_attribute("stack_protect", DECL_ATTRIBUTES(decl)))
+        return 0;
+    if (calls_eh_return(fun) || !saves_lr(fun))
+        return 0;
+    if (scope_reason(scope) == REASON_none)
+        return 0;
+
+    dbg(PLUGIN_NAME ": %s: %s canary dropped.\n", main_input_filename,
+        IDENTIFIER_POINTER(DECL_NAME(decl)));
+    DECL_ATTRIBUTES(decl) = tree_cons(get_identifier("no_stack_protector"), NULL_TREE,
+                                      DECL_ATTRIBUTES(decl));
+    ssp_dropped_fns->add(decl);
+
+    return 0;
 }
 
 /* Generate RTL for an asm statement (explicit assembler code).
@@ -292,40 +925,317 @@ static rtx expand_asm_loc(tree string, int vol, location_t locus)
     return body;
 }
 
-static void insert_prologue(void)
+static bool asm_insn_p(rtx_insn *insn)
 {
-    tree string = build_string(strlen(prologue_s), prologue_s);
-    rtx body = expand_asm_loc(string, 1, prologue_location);
+    rtx body = PATTERN(insn);
 
-    /*
-     * Insert the prologue as the first non-note instruction to avoid clobbering
-     * temporary registers used across the original prologue.  Disabling
-     * shrink-wrap ensures that the stack frame is set up for any code path.
-     */
-    emit_insn_before(body, get_first_nonnote_insn());
+    if (GET_CODE(body) == PARALLEL)
+        body = XVECEXP(body, 0, 0);
+
+    return GET_CODE(body) == ASM_INPUT || asm_noperands(PATTERN(insn)) >= 0;
 }
 
-static bool insert_epilogue(void)
+#ifdef GCC_AARCH64_H
+// Check whether INSN sets BASE to BASE plus a constant and return the constant
+// in DELTA.  Other sets of BASE are reported as not constant.
+static bool base_adjust(rtx_insn *insn, rtx base, HOST_WIDE_INT *delta)
 {
-    bool ret = false;
-    tree string = build_string(strlen(epilogue_s), epilogue_s);
-    rtx body = expand_asm_loc(string, 1, epilogue_location);
-    rtx_insn *insn = get_insns();
+    rtx body = PATTERN(insn);
+
+    *delta = 0;
+    for (int i = 0; i < (GET_CODE(body) == PARALLEL ? XVECLEN(body, 0) : 1); i++) {
+        rtx set = GET_CODE(body) == PARALLEL ? XVECEXP(body, 0, i) : body;
+        if (GET_CODE(set) != SET || !rtx_equal_p(SET_DEST(set), base))
+            continue;
+        rtx src = SET_SRC(set);
+        if (GET_CODE(src) != PLUS || !rtx_equal_p(XEXP(src, 0), base) ||
+            !CONST_INT_P(XEXP(src, 1)))
+            return false;
+        *delta += INTVAL(XEXP(src, 1));
+    }
+
+    return true;
+}
+
+/*
+ * Check whether INSN is the frame-related store of LR in the prologue.  The
+ * save slot is returned as BASE plus OFFSET, relative to BASE after INSN, so
+ * that it can be stored to again later on.
+ */
+static bool lr_save_slot(rtx_insn *insn, rtx *base, HOST_WIDE_INT *offset)
+{
+    rtx body = PATTERN(insn);
+    rtx addr = NULL_RTX;
+    HOST_WIDE_INT delta;
+
+    if (!RTX_FRAME_RELATED_P(insn))
+        return false;
+
+    for (int i = 0; i < (GET_CODE(body) == PARALLEL ? XVECLEN(body, 0) : 1); i++) {
+        rtx set = GET_CODE(body) == PARALLEL ? XVECEXP(body, 0, i) : body;
+        if (GET_CODE(set) == SET && MEM_P(SET_DEST(set)) &&
+            REG_P(SET_SRC(set)) && REGNO(SET_SRC(set)) == LR_REGNUM)
+            addr = XEXP(SET_DEST(set), 0);
+    }
+    if (!addr)
+        return false;
+
+    // str lr, [sp, #-16]! addresses the slot after the update
+    if (GET_CODE(addr) == PRE_MODIFY) {
+        *base = XEXP(addr, 0);
+        *offset = 0;
+        return REG_P(*base);
+    }
+
+    if (GET_CODE(addr) == PLUS && CONST_INT_P(XEXP(addr, 1))) {
+        *offset = INTVAL(XEXP(addr, 1));
+        addr = XEXP(addr, 0);
+    } else {
+        *offset = 0;
+    }
+    if (!REG_P(addr) || !base_adjust(insn, addr, &delta))
+        return false;
+
+    // stp x29, lr, [sp, #-16]! addresses the slot before the update
+    *base = addr;
+    *offset -= delta;
+    return true;
+}
+#endif
+
+#ifdef GCC_AARCH64_H
+// Whether OFFSET fits the scaled unsigned offset of a 64-bit str
+static bool str_offset_p(HOST_WIDE_INT offset)
+{
+    return offset >= 0 && offset <= 4095 * 8 && offset % 8 == 0;
+}
+#endif
+
+/*
+ * Find the latest point after a submitted request where its result must be
+ * waited for.  The wait sequences only use LR, so the wait is placed before
+ * the first instruction that uses or sets LR, before any other inline assembly
+ * (which might issue requests on its own), and before any control flow change.
+ *
+ * In the prologue, the store of LR to the frame is no real consumer: the
+ * unsigned LR may sit in its slot as long as nothing can read it in between.
+ * The wait may then move past the store, which is repeated with the signed LR
+ * right after the wait (SLOT).  Meanwhile, the slot's base register must only
+ * change by constants, and the slot must stay in reach of the re-store (the
+ * scaled imm12 of str, 0..32760).  DISTANCE counts the instructions in between.
+ */
+static rtx_insn *find_wait_point(rtx_insn *insn, bool pass_save, char **slot,
+                                 int *distance)
+{
+#ifdef GCC_AARCH64_H
+    rtx base = NULL_RTX;
+    HOST_WIDE_INT offset = 0, delta;
+#endif
+
+    *slot = NULL;
+    *distance = 0;
+
+    for (; insn; insn = NEXT_INSN(insn)) {
+        if (LABEL_P(insn) || BARRIER_P(insn))
+            break;
+        if (!INSN_P(insn) || DEBUG_INSN_P(insn))
+            continue;
+        if (JUMP_P(insn) || CALL_P(insn) || asm_insn_p(insn))
+            break;
+#ifdef GCC_AARCH64_H
+        if (pass_save && !base && lr_save_slot(insn, &base, &offset)) {
+            if (!str_offset_p(offset)) {
+                base = NULL_RTX;
+                break;
+            }
+            (*distance)++;
+            continue;
+        }
+        if (refers_to_regno_p(LR_REGNUM, PATTERN(insn)))
+            break;
+        if (base && reg_set_p(base, insn)) {
+            if (!base_adjust(insn, base, &delta) || !delta ||
+                !str_offset_p(offset - delta))
+                break;
+            offset -= delta;
+        }
+#endif
+        (*distance)++;
+    }
+
+#ifdef GCC_AARCH64_H
+    if (base)
+        *slot = xasprintf("\tstr\tx30, [%s, #%ld]", reg_names[REGNO(base)],
+                          (long) offset);
+#endif
+
+    return insn;
+}
+
+static rtx_insn *emit_split(const char *submit_s, const char *wait_s,
+                            location_t locus, rtx_insn *before, rtx_insn *after)
+{
+    tree submit_str = build_string(strlen(submit_s), submit_s);
+    tree wait_str = build_string(strlen(wait_s), wait_s);
+    rtx submit = expand_asm_loc(submit_str, 1, locus);
+    rtx wait = expand_asm_loc(wait_str, 1, locus);
+    rtx_insn *submit_insn, *wait_point, *wait_insn;
+    char *slot;
+    int distance;
+
+    if (before)
+        submit_insn = emit_insn_before(submit, before);
+    else
+        submit_insn = emit_insn_after(submit, after);
+
+    wait_point = find_wait_point(NEXT_INSN(submit_insn), before != NULL,
+                                 &slot, &distance);
+    if (wait_point)
+        wait_insn = emit_insn_before(wait, wait_point);
+    else
+        wait_insn = emit_insn_after(wait, get_last_insn());
+    cur_record.overlap += distance;
+
+    if (slot) {
+        tree slot_str = build_string(strlen(slot), slot);
+        wait_insn = emit_insn_after(expand_asm_loc(slot_str, 1, locus), wait_insn);
+        free(slot);
+    }
+
+    return wait_insn;
+}
+
+// Record in the CFI that INSN toggles the signing state of LR, as GCC does for
+// PACIASP/AUTIASP.  The unwinder then strips the PAC of the saved return
+// address (XPACLRI, emulated by libkpac) before looking up the caller.
+static void mark_ra_toggle(rtx_insn *insn)
+{
+#ifdef GCC_AARCH64_H
+    add_reg_note(insn, REG_CFA_TOGGLE_RA_MANGLE, const0_rtx);
+    RTX_FRAME_RELATED_P(insn) = 1;
+#endif
+}
+
+static char *signed_entry_name(tree decl)
+{
+    return concat(SIGNED_ENTRY_PREFIX,
+                  IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(decl)), NULL);
+}
+
+// Emit a label after the prologue, entered by fused sibling calls.
+static void insert_signed_entry(rtx_insn *prologue)
+{
+    char *name = signed_entry_name(current_function_decl);
+    char *label = concat(name, ":", NULL);
+    tree string = build_string(strlen(label), label);
+
+    emit_insn_after(expand_asm_loc(string, 1, prologue_location), prologue);
+    signed_entries->add(current_function_decl);
+    free(label);
+    free(name);
+}
+
+static tree sibcall_target(rtx_insn *insn)
+{
+    rtx call = get_call_rtx_from(insn);
+    if (!call)
+        return NULL_TREE;
+
+    rtx addr = XEXP(XEXP(call, 0), 0);
+    if (GET_CODE(addr) != SYMBOL_REF)
+        return NULL_TREE;
+
+    return SYMBOL_REF_DECL(addr);
+}
+
+// Check whether the sibling call can enter the callee with LR still signed.
+static bool sibcall_fusible(rtx_insn *insn)
+{
+    tree target;
+
+    if (!fuse_sibcalls || split_request)
+        return false;
+
+    target = sibcall_target(insn);
+    return target && TREE_CODE(target) == FUNCTION_DECL &&
+        targetm.binds_local_p(target) && signed_entries->contains(target);
+}
+
+static void redirect_sibcall(rtx_insn *insn)
+{
+    char *name = signed_entry_name(sibcall_target(insn));
+    rtx sym = gen_rtx_SYMBOL_REF(Pmode, ggc_strdup(name));
+
+    SYMBOL_REF_FLAGS(sym) = SYMBOL_FLAG_LOCAL;
+    PATTERN(insn) = copy_rtx(PATTERN(insn));
+    XEXP(XEXP(get_call_rtx_from(insn), 0), 0) = sym;
+    free(name);
+}
+
+static void insert_prologue(void)
+{
+    /*
+     * Insert the prologue as the first non-note instruction to avoid clobbering
+     * temporary registers used across the original prologue.  Disabling
+     * shrink-wrap ensures that the stack frame is set up for any code path.
+     */
+    if (split_request) {
+        mark_ra_toggle(emit_split(prologue_submit_s, prologue_wait_s, prologue_location,
+                                  get_first_nonnote_insn(), NULL));
+        return;
+    }
+
+    tree string = build_string(strlen(prologue_s), prologue_s);
+    rtx body = expand_asm_loc(string, 1, prologue_location);
+    rtx_insn *prologue = emit_insn_before(body, get_first_nonnote_insn());
+    mark_ra_toggle(prologue);
+
+    if (fuse_sibcalls)
+        insert_signed_entry(prologue);
+}
+
+static int insert_epilogue(void)
+{
+    int ret = 0;
+    tree string = build_string(strlen(epilogue_s), epilogue_s);
+    rtx body = expand_asm_loc(string, 1, epilogue_location);
+    rtx_insn *insn = get_insns();
 
     while (insn) {
         rtx_insn *last_frame_related = NULL;
+        rtx_insn *sibcall = NULL;
         while (insn && !(NOTE_P(insn) && NOTE_KIND(insn) == NOTE_INSN_EPILOGUE_BEG))
             insn = NEXT_INSN(insn);
 
         while (insn && !BARRIER_P(insn)) {
             if (RTX_FRAME_RELATED_P(insn))
                 last_frame_related = insn;
+            if (CALL_P(insn) && SIBLING_CALL_P(insn))
+                sibcall = insn;
             insn = NEXT_INSN(insn);
         }
 
+        /* The callee would sign the very same LR under the very same SP, so
+           keep the signed LR and skip both round trips.  A corrupted LR is
+           detected by the callee's authentication instead. */
+        if (last_frame_related && sibcall && sibcall_fusible(sibcall)) {
+            dbg(PLUGIN_NAME ": %s: %s sibling call fused.\n",
+                main_input_filename, CURRENT_FN_NAME());
+            redirect_sibcall(sibcall);
+            inst_stat.fused++;
+            cur_record.fused++;
+            ret++;
+            continue;
+        }
+
         if (last_frame_related) {
-            emit_insn_after(body, last_frame_related);
-            ret = true;
+            if (split_request)
+                mark_ra_toggle(emit_split(epilogue_submit_s, epilogue_wait_s,
+                                          epilogue_location, NULL, last_frame_related));
+            else
+                mark_ra_toggle(emit_insn_after(body, last_frame_related));
+            cur_record.epilogues++;
+            ret++;
         }
     }
 
@@ -345,8 +1255,25 @@ static unsigned int execute_inst_pac(void)
 
         dbg(PLUGIN_NAME ": %s: %s instrumented.\n", main_input_filename, CURRENT_FN_NAME());
         inst_stat.instrumented++;
+        cur_decision.instrumented = true;
+
+        cur_record.bytes = INST_BYTES * (prologue_insns +
+                                         cur_record.epilogues * epilogue_insns);
+        cur_record.signed_p = true;
+        if (report_dir)
+            inst_records.safe_push(cur_record);
+    } else if (cur_record.dedup != DEDUP_none) {
+        if (cur_record.dedup == DEDUP_canary)
+            warning_at(DECL_SOURCE_LOCATION(current_function_decl), 0,
+                       "%qD has neither a stack protector nor a signed return address",
+                       current_function_decl);
+        if (report_dir)
+            inst_records.safe_push(cur_record);
     }
 
+    if (report_dir && hot_threshold >= 0)
+        profile_decisions.safe_push(cur_decision);
+
     return 0;
 }
 
@@ -368,6 +1295,113 @@ static void inst_stat_dump(void *event_data, void *data)
     fclose(f);
 }
 
+static const char *dedup_str(int dedup)
+{
+    static const char *names[] = {
+        "none", "canary", "pac"
+    };
+
+    return names[dedup];
+}
+
+static const char *reason_str(int reason)
+{
+    static const char *names[] = {
+        "none", "all", "alloca", "char", "array", "addressable"
+    };
+
+    return names[reason];
+}
+
+// Open the report file of this unit with extension EXT.  One file per unit
+// and process: parallel builds never share a file.
+static FILE *report_open(const char *ext)
+{
+    char *path;
+    FILE *f;
+    int ret;
+
+    ret = asprintf(&path, "%s/%s.%ld.%s", report_dir,
+                   lbasename(main_input_filename), (long) getpid(), ext);
+    assert(ret > 0);
+
+    f = fopen(path, "w");
+    if (!f)
+        err(PLUGIN_NAME ": Unable to open %s.\n", path);
+
+    free(path);
+    return f;
+}
+
+static void inst_report_dump(void *event_data, void *data)
+{
+    FILE *f;
+
+    if (!report_dir)
+        return;
+
+    f = report_open("csv");
+    if (!f)
+        return;
+
+    fprintf(f, "file,function,reason,epilogues,fused,bytes,dedup,overlap,signed\n");
+    for (unsigned i = 0; i < inst_records.length(); i++) {
+        struct inst_record *r = &inst_records[i];
+        fprintf(f, "%s,%s,%s,%d,%d,%d,%s,%d,%d\n", main_input_filename, r->name,
+                reason_str(r->reason), r->epilogues, r->fused, r->bytes,
+                dedup_str(r->dedup), r->overlap, r->signed_p);
+    }
+
+    fclose(f);
+
+    if (hot_threshold < 0)
+        return;
+
+    // The profile decisions, in their own file as they cover every function
+    f = report_open("profile");
+    if (!f)
+        return;
+
+    fprintf(f, "file,function,calls,class,scope,instrumented\n");
+    for (unsigned i = 0; i < profile_decisions.length(); i++) {
+        struct profile_decision *d = &profile_decisions[i];
+        fprintf(f, "%s,%s,%lld,%s,%s,%d\n",
+                main_input_filename, d->name, (long long) d->calls,
+                d->calls < 0 ? "unknown" : d->hot ? "hot" : "cold",
+                scope_str(d->scope), d->instrumented);
+    }
+
+    fclose(f);
+}
+
+// Count instructions in assembler code: lines which are neither empty, nor
+// only a label, nor a directive.
+static int count_insns(const char *code)
+{
+    int count = 0;
+
+    while (code && *code) {
+        const char *end = strchr(code, '\n');
+        const char *p = code;
+        const char *colon;
+
+        if (!end)
+            end = code + strlen(code);
+
+        colon = (const char *) memchr(p, ':', end - p);
+        if (colon)
+            p = colon + 1;
+        while (p < end && ISSPACE(*p))
+            p++;
+        if (p < end && *p != '.' && *p != '#')
+            count++;
+
+        code = *end ? end + 1 : end;
+    }
+
+    return count;
+}
+
 static int read_code(const char *file, const char **code)
 {
     size_t fsize;
@@ -392,6 +1426,209 @@ static int read_code(const char *file, const char **code)
     return 0;
 }
 
+static int cmp_calls_desc(const void *a, const void *b)
+{
+    gcov_type x = *(const gcov_type *) a, y = *(const gcov_type *) b;
+    return (x < y) - (x > y);
+}
+
+// Read per-function call rates: one "<function> <calls/s>" pair per line.
+static int read_profile(const char *file)
+{
+    char name[1024];
+    long long calls;
+    int ret;
+    FILE *f = fopen(file, "r");
+    if (!f)
+        return 1;
+
+    profile_calls = new hash_map<nofree_string_hash, gcov_type>;
+    while ((ret = fscanf(f, " %1023s %lld", name, &calls)) == 2)
+        profile_calls->put(xstrdup(name), calls);
+
+    fclose(f);
+    return ret != EOF;
+}
+
+// Check whether FN would be signed within SCOPE, before any optimization.  The
+// bounded scope counts as strong, as the functions are not analysed yet.
+static bool scope_selects(function *fn, int scope)
+{
+    if (scope == SIGN_SCOPE_nil)
+        return false;
+    if (fn->calls_alloca)
+        return true;
+    if (scope == SIGN_SCOPE_bounded)
+        scope = SIGN_SCOPE_strong;
+
+    return protected_decls_reason(scope, DECL_INITIAL(fn->decl)) != REASON_none;
+}
+
+struct budget_candidate {
+    gcov_type calls;
+    bool saves;                 // Not signed anymore once restricted
+};
+
+static int cmp_candidates_desc(const void *a, const void *b)
+{
+    return cmp_calls_desc(&((const budget_candidate *) a)->calls,
+                          &((const budget_candidate *) b)->calls);
+}
+
+/*
+ * Derive the hot threshold from the budget: the hottest functions are
+ * restricted until the remaining calls per second to signed functions fit into
+ * the budget.  Only the functions of this unit which their scope selects are
+ * counted, so build with -flto to apply the budget to the whole program.
+ * Functions with an explicit scope are counted but never restricted, and
+ * restricting a function that the char scope still selects saves nothing.
+ */
+static gcov_type budget_threshold(gcov_type budget)
+{
+    auto_vec<budget_candidate> rates;
+    gcov_type total = 0;
+    gcov_type threshold = INTTYPE_MAXIMUM(gcov_type);
+    cgraph_node *node;
+
+    FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+        function *fn = node->get_fun();
+        tree decl = node->decl;
+        int scope = decl_scope(decl);
+        gcov_type *calls = profile_calls->get(IDENTIFIER_POINTER(DECL_ASSEMBLER_NAME(decl)));
+
+        if (!calls)
+            calls = profile_calls->get(IDENTIFIER_POINTER(DECL_NAME(decl)));
+        if (!calls || !fn || !scope_selects(fn, scope))
+            continue;
+
+        total += *calls;
+        if (!explicit_scope(decl) && scope != SIGN_SCOPE_char) {
+            budget_candidate c = { *calls, !scope_selects(fn, SIGN_SCOPE_char) };
+            rates.safe_push(c);
+        }
+    }
+    rates.qsort(cmp_candidates_desc);
+
+    for (unsigned i = 0; i < rates.length() && total > budget; i++) {
+        threshold = rates[i].calls;
+        if (rates[i].saves)
+            total -= rates[i].calls;
+    }
+
+    return threshold;
+}
+
+static void disable_incompatible_opts(void)
+{
+    // Disable incompatible optimizations.  Multiple epilogues cause the code
+    // size to inflate too much, the optimization value is questionable:
+    flag_reorder_blocks_and_partition = 0;
+    flag_reorder_blocks = 0;
+
+    // Note that tail and sibling call optimization inserts additional epilogues
+    // too: flag_optimize_sibling_calls;
+
+    // Temporary registers might get clobbered before prologue in case of
+    // delayed frame setup:
+    flag_shrink_wrap = 0;
+
+    // Do not omit saving of call-clobbered registers across some calls as we
+    // use them in our authentication code:
+    flag_ipa_ra = 0;
+}
+
+// Read scope rules: one "<fn|file|mangled> <pattern> <scope>" triple per line,
+// '#' starts a comment.
+static int read_rules(const char *file)
+{
+    static const char *kinds[] = { "fn", "file", "mangled" };
+    char line[2048];
+    int lineno = 0;
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        err(PLUGIN_NAME ": Unable to read rules %s.\n", file);
+        return 1;
+    }
+
+    for (int k = 0; k < RULE_KINDS; k++)
+        exact_rules[k] = new hash_map<nofree_string_hash, int>;
+    file_rules = new hash_map<nofree_string_hash, int>;
+
+    while (fgets(line, sizeof(line), f)) {
+        char kind[16], pattern[1024], scope[16];
+        struct scope_rule rule;
+        char *comment = strchr(line, '#');
+        int k, n;
+
+        lineno++;
+        if (comment)
+            *comment = 0;
+
+        n = sscanf(line, " %15s %1023s %15s", kind, pattern, scope);
+        if (n <= 0)
+            continue;
+        if (n != 3) {
+            err(PLUGIN_NAME ": %s:%d: Expected kind, pattern and scope.\n", file, lineno);
+            fclose(f);
+            return 1;
+        }
+
+        for (k = 0; k < RULE_KINDS; k++)
+            if (!strcmp(kind, kinds[k]))
+                break;
+        if (k == RULE_KINDS) {
+            err(PLUGIN_NAME ": %s:%d: Unknown kind '%s'.\n", file, lineno, kind);
+            fclose(f);
+            return 1;
+        }
+
+        rule.pattern = xstrdup(pattern);
+        rule.scope = str_scope(scope);
+        if (rule.scope == -1) {
+            err(PLUGIN_NAME ": %s:%d: Invalid scope '%s'.\n", file, lineno, scope);
+            fclose(f);
+            return 1;
+        }
+
+        int idx = scope_rules.length();
+        scope_rules.safe_push(rule);
+
+        if (k != RULE_file && !strpbrk(pattern, "*?[\\")) {
+            if (!exact_rules[k]->get(rule.pattern))
+                exact_rules[k]->put(rule.pattern, idx);
+        } else {
+            glob_rules[k].safe_push(idx);
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+// Read the optional submit/wait halves of the (pro/epi)logue.
+static int read_split_code(const char *dir)
+{
+    const char *names[] = {
+        "prologue_submit", "prologue_wait", "epilogue_submit", "epilogue_wait"
+    };
+    const char **codes[] = {
+        &prologue_submit_s, &prologue_wait_s, &epilogue_submit_s, &epilogue_wait_s
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(names); i++) {
+        char *path;
+        int ret = asprintf(&path, "%s/%s.s", dir, names[i]);
+        assert(ret > 0);
+
+        ret = read_code(path, codes[i]);
+        free(path);
+        if (ret)
+            return 1;
+    }
+
+    return 0;
+}
+
 int plugin_init(struct plugin_name_args *info, struct plugin_gcc_version *ver)
 {
     struct register_pass_info pass_inst = {
@@ -400,6 +1637,24 @@ int plugin_init(struct plugin_name_args *info, struct plugin_gcc_version *ver)
         .ref_pass_instance_number = 1,      // of CFG cleanup pass.
         .pos_op = PASS_POS_INSERT_AFTER,
     };
+    struct register_pass_info pass_opts = {
+        .pass = &opts_pass,
+        .reference_pass_name = "expand",    // Insert right after the RTL
+        .ref_pass_instance_number = 1,      // is generated.
+        .pos_op = PASS_POS_INSERT_AFTER,
+    };
+    struct register_pass_info pass_bounded = {
+        .pass = &bounded_pass,
+        .reference_pass_name = "vrp",       // Insert after the first instance
+        .ref_pass_instance_number = 1,      // of value range propagation.
+        .pos_op = PASS_POS_INSERT_AFTER,
+    };
+    struct register_pass_info pass_ssp = {
+        .pass = &ssp_pass,
+        .reference_pass_name = "optimized", // Insert after the last GIMPLE
+        .ref_pass_instance_number = 1,      // pass, right before expansion.
+        .pos_op = PASS_POS_INSERT_AFTER,
+    };
 
     if (strncmp(PLUGIN_GCC_REQ, ver->basever, sizeof(PLUGIN_GCC_REQ))) {
         err(PLUGIN_NAME ": GCC %s required.\n", PLUGIN_GCC_REQ);
@@ -419,6 +1674,8 @@ int plugin_init(struct plugin_name_args *info, struct plugin_gcc_version *ver)
             }
         } else if (!strcmp(key, "asm")) {
             char *prolp, *epilp;
+
+            asm_dir = value;
             int ret;
             ret = asprintf(&prolp, "%s/prologue.s", value);
             assert(ret > 0);
@@ -439,6 +1696,57 @@ int plugin_init(struct plugin_name_args *info, struct plugin_gcc_version *ver)
         } else if (!strcmp(key, "dump")) {
             if (value[0])
                 inst_stat_file = value;
+        } else if (!strcmp(key, "split")) {
+            if (TOLOWER(value[0]) == 'y')
+                split_request = true;
+            else if (TOLOWER(value[0]) == 'n')
+                split_request = false;
+            else {
+                err(PLUGIN_NAME ": Unknown value for '%s'.\n", key);
+                return 1;
+            }
+        } else if (!strcmp(key, "fuse")) {
+            if (TOLOWER(value[0]) == 'y')
+                fuse_sibcalls = true;
+            else if (TOLOWER(value[0]) == 'n')
+                fuse_sibcalls = false;
+            else {
+                err(PLUGIN_NAME ": Unknown value for '%s'.\n", key);
+                return 1;
+            }
+        } else if (!strcmp(key, "profile")) {
+            if (read_profile(value)) {
+                err(PLUGIN_NAME ": Unable to read profile %s.\n", value);
+                return 1;
+            }
+        } else if (!strcmp(key, "hot") || !strcmp(key, "budget")) {
+            char *end;
+            long long n = strtoll(value, &end, 10);
+            if (end == value || *end || n < 0) {
+                err(PLUGIN_NAME ": Invalid value '%s' for '%s'.\n", value, key);
+                return 1;
+            }
+            if (key[0] == 'h')
+                hot_threshold = n;
+            else
+                profile_budget = n;
+        } else if (!strcmp(key, "report")) {
+            if (value[0])
+                report_dir = value;
+        } else if (!strcmp(key, "rules")) {
+            if (read_rules(value))
+                return 1;
+        } else if (!strcmp(key, "ssp")) {
+            if (!strcmp(value, "both"))
+                ssp_policy = SSP_both;
+            else if (!strcmp(value, "pac"))
+                ssp_policy = SSP_pac;
+            else if (!strcmp(value, "canary"))
+                ssp_policy = SSP_canary;
+            else {
+                err(PLUGIN_NAME ": Unknown value for '%s'.\n", key);
+                return 1;
+            }
         } else if (!strcmp(key, "leaf")) {
             if (TOLOWER(value[0]) == 'y')
                 include_leaf = true;
@@ -459,21 +1767,42 @@ int plugin_init(struct plugin_name_args *info, struct plugin_gcc_version *ver)
         return 1;
     }
 
-    // Disable incompatible optimizations.  Multiple epilogues cause the code
-    // size to inflate too much, the optimization value is questionable:
-    flag_reorder_blocks_and_partition = 0;
-    flag_reorder_blocks = 0;
+    if (profile_budget >= 0 && !profile_calls) {
+        err(PLUGIN_NAME ": 'budget' requires 'profile'.\n");
+        return 1;
+    }
+    if (profile_calls && hot_threshold < 0 && profile_budget < 0) {
+        err(PLUGIN_NAME ": 'profile' requires 'hot' or 'budget'.\n");
+        return 1;
+    }
 
-    // Note that tail and sibling call optimization inserts additional epilogues
-    // too: flag_optimize_sibling_calls;
+    if (split_request) {
+#ifndef GCC_AARCH64_H
+        err(PLUGIN_NAME ": Split requests are only supported on AArch64.\n");
+        return 1;
+#endif
+        if (read_split_code(asm_dir)) {
+            err(PLUGIN_NAME ": Variant in %s does not support split requests.\n",
+                asm_dir);
+            return 1;
+        }
+    }
 
-    // Temporary registers might get clobbered before prologue in case of
-    // delayed frame setup:
-    flag_shrink_wrap = 0;
+    disable_incompatible_opts();
 
-    // Do not omit saving of call-clobbered registers across some calls as we
-    // use them in our authentication code:
-    flag_ipa_ra = 0;
+    if (split_request) {
+        prologue_insns = count_insns(prologue_submit_s) + count_insns(prologue_wait_s);
+        epilogue_insns = count_insns(epilogue_submit_s) + count_insns(epilogue_wait_s);
+    } else {
+        prologue_insns = count_insns(prologue_s);
+        epilogue_insns = count_insns(epilogue_s);
+    }
+
+    if (fuse_sibcalls)
+        signed_entries = new hash_set<tree>;
+    bounded_fns = new hash_set<tree>;
+    if (ssp_policy == SSP_pac)
+        ssp_dropped_fns = new hash_set<tree>;
 
     // Register info about this plugin.
     register_callback(PLUGIN_NAME, PLUGIN_INFO, NULL, &inst_plugin_info);
@@ -482,8 +1811,12 @@ int plugin_init(struct plugin_name_args *info, struct plugin_gcc_version *ver)
     register_callback(PLUGIN_NAME, PLUGIN_ATTRIBUTES, register_attributes, NULL);
     // Add our pass into the pass manager.
     register_callback(PLUGIN_NAME, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_inst);
+    register_callback(PLUGIN_NAME, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_bounded);
+    register_callback(PLUGIN_NAME, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_opts);
+    register_callback(PLUGIN_NAME, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_ssp);
     // Save statistics at the end.
     register_callback(PLUGIN_NAME, PLUGIN_FINISH_UNIT, inst_stat_dump, NULL);
+    register_callback(PLUGIN_NAME, PLUGIN_FINISH_UNIT, inst_report_dump, NULL);
 
     return 0;
 }
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+# Merge the per-unit reports written by the plugin (report=DIR) into a
+# build-wide summary.
+
+import argparse
+import csv
+import glob
+import os
+import sys
+
+from collections import defaultdict
+
+def read_records(dirs):
+    records = []
+    for d in dirs:
+        for path in sorted(glob.glob(os.path.join(d, "*.csv"))):
+            with open(path) as f:
+                for row in csv.DictReader(f):
+                    for k in ("epilogues", "fused", "bytes"):
+                        row[k] = int(row[k])
+                    row.setdefault("dedup", "none")
+                    row["overlap"] = int(row.get("overlap") or 0)
+                    # Older reports only listed functions skipped for a canary
+                    row["signed"] = int(row.get("signed") or row["dedup"] != "pac")
+                    records.append(row)
+    return records
+
+def summary(records, top, out):
+    by_reason = defaultdict(lambda: [0, 0])
+    by_file = defaultdict(lambda: [0, 0])
+
+    skipped = [r for r in records if r["dedup"] == "pac"]
+    dropped = [r for r in records if r["dedup"] == "canary" and r["signed"]]
+    unprotected = [r for r in records if r["dedup"] == "canary" and not r["signed"]]
+    records = [r for r in records if r["signed"]]
+
+    for r in records:
+        by_reason[r["reason"]][0] += 1
+        by_reason[r["reason"]][1] += r["bytes"]
+        by_file[r["file"]][0] += 1
+        by_file[r["file"]][1] += r["bytes"]
+
+    total = sum(r["bytes"] for r in records)
+    out.write(f"instrumented functions: {len(records)}\n")
+    out.write(f"epilogues: {sum(r['epilogues'] for r in records)}\n")
+    out.write(f"fused sibling calls: {sum(r['fused'] for r in records)}\n")
+    out.write(f"estimated bytes added: {total}\n")
+    out.write(f"instructions overlapping split requests: "
+              f"{sum(r['overlap'] for r in records)}\n")
+    out.write(f"canaries dropped: {len(dropped)}\n")
+    out.write(f"signing skipped for canary: {len(skipped)}\n")
+    out.write(f"canaries dropped without signing: {len(unprotected)}\n")
+
+    out.write("\nby reason:\n")
+    for reason, (n, size) in sorted(by_reason.items(), key=lambda x: -x[1][1]):
+        out.write(f"  {reason:<12} {n:>8} {size:>10}\n")
+
+    out.write(f"\ntop {top} files by bytes:\n")
+    for path, (n, size) in sorted(by_file.items(), key=lambda x: -x[1][1])[:top]:
+        out.write(f"  {size:>10} {n:>6} {path}\n")
+
+    out.write(f"\ntop {top} functions by bytes:\n")
+    for r in sorted(records, key=lambda r: -r["bytes"])[:top]:
+        out.write(f"  {r['bytes']:>10} {r['epilogues']:>3} {r['reason']:<12} "
+                  f"{r['function']} ({r['file']})\n")
+
+    if dropped or skipped or unprotected:
+        out.write("\ndeduplicated with stack protector:\n")
+        for r in dropped + skipped + unprotected:
+            kept = "canary" if r["dedup"] == "pac" else "pac" if r["signed"] else "none"
+            out.write(f"  {kept:<8} {r['reason']:<12} {r['function']} ({r['file']})\n")
+
+def main():
+    parser = argparse.ArgumentParser(description="Merge per-unit instrumentation reports.")
+    parser.add_argument("dirs", nargs="+", help="report directories")
+    parser.add_argument("-n", "--top", type=int, default=20,
+                        help="number of hot spots to list")
+    parser.add_argument("-o", "--output", help="write merged records as CSV")
+    args = parser.parse_args()
+
+    records = read_records(args.dirs)
+    if args.output:
+        with open(args.output, "w") as f:
+            fields = ["file", "function", "reason", "epilogues", "fused", "bytes", "dedup",
+                      "overlap", "signed"]
+            w = csv.DictWriter(f, fieldnames=fields, extrasaction="ignore")
+            w.writeheader()
+            w.writerows(records)
+
+    summary(records, args.top, sys.stdout)
+
+if __name__ == "__main__":
+    main()
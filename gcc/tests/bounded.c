@@ -0,0 +1,53 @@
+#include <stdio.h>
+
+/*
+ * Compiled with -O2 and scope=bounded, sum() and lookup() only write their
+ * arrays within bounds and are not instrumented, while fmt() passes its
+ * buffer to a callee and is.
+ */
+int __attribute__ ((noinline)) sum(int n)
+{
+    volatile int arr[16];
+    int s = 0;
+
+    for (int i = 0; i < 16; i++)
+        arr[i] = i * n;
+    for (int i = 0; i < 16; i++)
+        s += arr[i];
+
+    return s;
+}
+
+int __attribute__ ((noinline)) lookup(unsigned x)
+{
+    volatile int arr[4];
+
+    arr[0] = 1;
+    arr[1] = 2;
+    arr[2] = 3;
+    arr[x & 3] = 4;
+
+    return arr[0] + arr[1] + arr[2];
+}
+
+int __attribute__ ((noinline)) fmt(int x)
+{
+    char arr[10];
+    int y;
+
+    snprintf(arr, sizeof(arr), "%d", x);
+    sscanf(arr, "%d", &y);
+
+    return y;
+}
+
+int main()
+{
+    if (sum(2) != 240)
+        return 1;
+    if (lookup(3) != 6)
+        return 1;
+    if (fmt(42) != 42)
+        return 1;
+    return 0;
+}
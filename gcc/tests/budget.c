@@ -0,0 +1,40 @@
+/*
+ * Compiled with scope=array and budget=5000 against the call rates of
+ * budget.conf, hot() alone exceeds the budget and is restricted to the char
+ * scope, so only warm() and cold() are instrumented.
+ */
+int __attribute__ ((noinline)) hot(int x)
+{
+    volatile int arr[8];
+
+    arr[x & 7] = x;
+    return arr[x & 7];
+}
+
+int __attribute__ ((noinline)) warm(int x)
+{
+    volatile int arr[8];
+
+    arr[x & 7] = x + 1;
+    return arr[x & 7];
+}
+
+int __attribute__ ((noinline)) cold(int x)
+{
+    volatile int arr[8];
+
+    arr[x & 7] = x + 2;
+    return arr[x & 7];
+}
+
+int main(void)
+{
+    if (hot(1) != 1)
+        return 1;
+    if (warm(1) != 2)
+        return 2;
+    if (cold(1) != 3)
+        return 3;
+
+    return 0;
+}
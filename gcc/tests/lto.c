@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+/*
+ * Compiled with -O2 -flto, instrumentation happens in LTRANS.  With
+ * scope=bounded, f1() is not instrumented: its buffer is only passed to
+ * sum(), which according to the IPA mod/ref summary never writes through or
+ * retains its argument.
+ */
+int __attribute__ ((noinline)) sum(const int *arr, int n)
+{
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        s += arr[i];
+    return s;
+}
+
+int __attribute__ ((noinline)) f1(int x)
+{
+    int arr[8];
+
+    for (int i = 0; i < 8; i++)
+        arr[i] = x + i;
+
+    return sum(arr, 8);
+}
+
+int __attribute__ ((noinline)) f2(int x)
+{
+    char arr[16];
+    snprintf(arr, sizeof(arr), "%d", x);
+    printf("ret: %p\n", __builtin_return_address(0));
+    return arr[0] - '0';
+}
+
+int main()
+{
+    if (f1(1) != 36)
+        return 1;
+    return !(f2(4) == 4);
+}
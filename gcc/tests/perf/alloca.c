@@ -0,0 +1,35 @@
+/* Variable sized frames from alloca and VLAs */
+#include <alloca.h>
+#include <string.h>
+
+#include "harness.h"
+
+const unsigned long iters = 20000;
+
+NOINLINE int with_alloca(int n)
+{
+    char *buf = alloca(n);
+
+    calls++;
+    memset(buf, n, n);
+    return buf[n / 2];
+}
+
+NOINLINE int with_vla(int n)
+{
+    int vla[n];
+
+    calls++;
+    for (int i = 0; i < n; i++)
+        vla[i] = i * n;
+
+    return vla[n - 1];
+}
+
+void kernel(void)
+{
+    volatile int sink = 0;
+
+    for (int i = 1; i <= 64; i++)
+        sink += with_alloca(i * 4) + with_vla(i);
+}
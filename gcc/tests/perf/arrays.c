@@ -0,0 +1,61 @@
+/* Longer functions working on local arrays, the overhead is amortised */
+#include "harness.h"
+
+#define N 64
+
+const unsigned long iters = 20000;
+
+NOINLINE unsigned checksum(const unsigned *a, int n)
+{
+    unsigned sum = 0;
+
+    calls++;
+    for (int i = 0; i < n; i++)
+        sum = (sum << 5) + sum + a[i];
+
+    return sum;
+}
+
+NOINLINE unsigned sort_small(unsigned seed)
+{
+    unsigned a[N];
+
+    calls++;
+    for (int i = 0; i < N; i++) {
+        seed = seed * 1103515245 + 12345;
+        a[i] = seed >> 16;
+    }
+
+    for (int i = 1; i < N; i++) {
+        unsigned x = a[i];
+        int j = i - 1;
+        while (j >= 0 && a[j] > x) {
+            a[j + 1] = a[j];
+            j--;
+        }
+        a[j + 1] = x;
+    }
+
+    return checksum(a, N);
+}
+
+NOINLINE unsigned histogram(unsigned seed)
+{
+    unsigned hist[16] = { 0 };
+
+    calls++;
+    for (int i = 0; i < 4 * N; i++) {
+        seed = seed * 1103515245 + 12345;
+        hist[(seed >> 16) & 15]++;
+    }
+
+    return checksum(hist, 16);
+}
+
+void kernel(void)
+{
+    volatile unsigned sink = 0;
+
+    for (unsigned i = 0; i < 4; i++)
+        sink += sort_small(i) ^ histogram(i);
+}
@@ -0,0 +1,44 @@
+/* Many calls of small functions: a few with buffers, the rest leaves */
+#include "harness.h"
+
+const unsigned long iters = 20000;
+
+NOINLINE int leaf_add(int a, int b)
+{
+    calls++;
+    return a + b;
+}
+
+NOINLINE int leaf_mix(int a)
+{
+    calls++;
+    return (a * 2654435761u) >> 7;
+}
+
+NOINLINE int small(int a)
+{
+    volatile char tag[8];
+
+    calls++;
+    tag[0] = a;
+    return leaf_add(tag[0], leaf_mix(a));
+}
+
+NOINLINE int middle(int a)
+{
+    int acc = 0;
+
+    calls++;
+    for (int i = 0; i < 4; i++)
+        acc += small(a + i);
+
+    return leaf_add(acc, a);
+}
+
+void kernel(void)
+{
+    volatile int sink = 0;
+
+    for (int i = 0; i < 64; i++)
+        sink += middle(i);
+}
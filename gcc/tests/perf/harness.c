@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "harness.h"
+
+unsigned long calls;
+
+/* Cycles including the kernel, the syscall variant spends them there */
+static int cycles_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 0) : iters;
+    uint64_t count = 0;
+    int fd = cycles_open();
+
+    kernel();
+    calls = 0;
+
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t t0 = now_ns();
+
+    for (unsigned long i = 0; i < n; i++)
+        kernel();
+
+    uint64_t t1 = now_ns();
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = 0;
+        close(fd);
+    }
+
+    if (count)
+        printf("%lu,%llu,cycles\n", calls, (unsigned long long) count);
+    else
+        printf("%lu,%llu,ns\n", calls, (unsigned long long) (t1 - t0));
+
+    return 0;
+}
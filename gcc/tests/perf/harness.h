@@ -0,0 +1,21 @@
+#ifndef PERF_HARNESS_H
+#define PERF_HARNESS_H
+
+/*
+ * Kernels of the overhead suite, see perf.py.  A kernel defines kernel() and
+ * ITERS and counts its calls in calls; harness.c, built without the plugin,
+ * runs it ITERS times (or argv[1]) after one warm-up round and prints
+ *
+ *   calls,count,unit
+ *
+ * with the count of CPU cycles, or of nanoseconds if cycles cannot be read.
+ */
+
+#define NOINLINE __attribute__ ((noinline))
+
+extern unsigned long calls;
+extern const unsigned long iters;
+
+void kernel(void);
+
+#endif /* PERF_HARNESS_H */
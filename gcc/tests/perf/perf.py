@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+
+# PAC overhead regression suite: build the kernels of this directory without
+# the plugin and for every variant x scope x leaf combination, run them and
+# report cycles per call, instrumented functions and .text growth over the
+# baseline.  With --reference, fail if a configuration got slower or bigger
+# than in an earlier run by more than the tolerances.
+
+import argparse
+import csv
+import glob
+import os
+import platform
+import shlex
+import statistics
+import struct
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", ".."))
+from report import read_records
+
+KERNELS = sorted(os.path.splitext(os.path.basename(p))[0]
+                 for p in glob.glob(os.path.join(HERE, "*.c")) if not p.endswith("harness.c"))
+
+FIELDS = ["kernel", "variant", "scope", "leaf", "calls", "per_call", "unit",
+          "overhead", "functions", "text", "text_delta"]
+
+def section_size(path, name):
+    """Size of section name of the ELF64 little endian object path"""
+    with open(path, "rb") as f:
+        data = f.read()
+    shoff, = struct.unpack_from("<Q", data, 0x28)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x3A)
+    strtab_off, = struct.unpack_from("<Q", data, shoff + shstrndx * shentsize + 0x18)
+
+    size = 0
+    for i in range(shnum):
+        sh = shoff + i * shentsize
+        name_off, = struct.unpack_from("<I", data, sh)
+        end = data.index(b"\0", strtab_off + name_off)
+        if data[strtab_off + name_off:end].decode() == name:
+            size += struct.unpack_from("<Q", data, sh + 0x20)[0]
+    return size
+
+class Config:
+    def __init__(self, variant=None, scope=None, leaf=None):
+        self.variant, self.scope, self.leaf = variant, scope, leaf
+
+    @property
+    def baseline(self):
+        return self.variant is None
+
+    @property
+    def name(self):
+        return "baseline" if self.baseline else f"{self.variant}-{self.scope}-{self.leaf}"
+
+    def key(self, kernel):
+        return (kernel, self.variant or "-", self.scope or "-", self.leaf or "-")
+
+    def flags(self, args, report):
+        if self.baseline:
+            return []
+        plugin = "-fplugin-arg-pac_sw_plugin-"
+        return [f"-fplugin={args.plugin}",
+                f"{plugin}asm={os.path.join(args.asm, self.variant, args.arch)}",
+                f"{plugin}scope={self.scope}",
+                f"{plugin}leaf={self.leaf}",
+                f"{plugin}report={report}"]
+
+def run(cmd, **kwargs):
+    return subprocess.run(cmd, check=True, **kwargs)
+
+def build(args, config, harness):
+    out = os.path.join(args.build, config.name)
+    report = os.path.join(out, "report")
+    os.makedirs(report, exist_ok=True)
+    for old in glob.glob(os.path.join(report, "*.csv")):
+        os.remove(old)
+
+    bins = {}
+    for kernel in KERNELS:
+        obj = os.path.join(out, kernel + ".o")
+        exe = os.path.join(out, kernel)
+        run([args.cc, *args.cflags, *config.flags(args, report), "-c", "-o", obj,
+             os.path.join(HERE, kernel + ".c")])
+        run([args.cc, *args.cflags, "-o", exe, obj, harness])
+        bins[kernel] = (exe, obj)
+
+    functions = {}
+    for r in read_records([report]):
+        if r["signed"]:
+            kernel = os.path.splitext(os.path.basename(r["file"]))[0]
+            functions[kernel] = functions.get(kernel, 0) + 1
+
+    return bins, functions
+
+def measure(args, exe):
+    samples, unit = [], None
+    for _ in range(args.runs):
+        out = run([*args.run, exe], capture_output=True, text=True).stdout
+        calls, count, unit = out.strip().split(",")
+        samples.append(int(count) / int(calls))
+    return int(calls), statistics.median(samples), unit
+
+def print_table(rows, out):
+    header = f"{'kernel':<10} {'variant':<10} {'scope':<8} {'leaf':<4} " \
+             f"{'per call':>10} {'unit':<6} {'overhead':>9} {'fns':>4} {'text':>7} {'text+':>7}\n"
+    out.write(header)
+    out.write("-" * (len(header) - 1) + "\n")
+    for r in rows:
+        out.write(f"{r['kernel']:<10} {r['variant']:<10} {r['scope']:<8} {r['leaf']:<4} "
+                  f"{r['per_call']:>10.2f} {r['unit']:<6} {r['overhead']:>8.1%} "
+                  f"{r['functions']:>4} {r['text']:>7} {r['text_delta']:>+7}\n")
+
+def check(rows, reference, args, out):
+    """Regressions of rows against the rows of the CSV reference"""
+    with open(reference) as f:
+        ref = {(r["kernel"], r["variant"], r["scope"], r["leaf"]): r for r in csv.DictReader(f)}
+
+    failed = 0
+    for r in rows:
+        old = ref.get((r["kernel"], r["variant"], r["scope"], r["leaf"]))
+        if not old or r["variant"] == "-":
+            continue
+
+        what = f"{r['kernel']} {r['variant']}-{r['scope']}-{r['leaf']}"
+        if old["unit"] == r["unit"] and \
+           r["overhead"] > float(old["overhead"]) + args.tolerance:
+            out.write(f"FAIL {what}: overhead {r['overhead']:.1%}, was {float(old['overhead']):.1%}\n")
+            failed += 1
+        if r["text_delta"] > int(old["text_delta"]) * (1 + args.text_tolerance):
+            out.write(f"FAIL {what}: .text +{r['text_delta']}, was +{old['text_delta']}\n")
+            failed += 1
+        if int(r["functions"]) > int(old["functions"]):
+            out.write(f"FAIL {what}: {r['functions']} functions instrumented, was {old['functions']}\n")
+            failed += 1
+
+    return failed
+
+def main():
+    parser = argparse.ArgumentParser(description="PAC overhead regression suite.")
+    parser.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+    parser.add_argument("--cflags", type=shlex.split, default=["-O2"])
+    parser.add_argument("--plugin", default=os.path.join(HERE, "..", "..", "pac_sw_plugin.so"))
+    parser.add_argument("--asm", default=os.path.join(HERE, "..", "..", "asm"),
+                        help="directory of the asm variants")
+    parser.add_argument("--arch", default=platform.machine())
+    parser.add_argument("--variants", type=str.split, default=["syscall"])
+    parser.add_argument("--scopes", type=str.split, default=["array", "strong", "all"])
+    parser.add_argument("--leaf", type=str.split, default=["no", "yes"])
+    parser.add_argument("--run", type=shlex.split, default=[],
+                        help="prefix of the kernel runs, e.g. env LD_PRELOAD=...")
+    parser.add_argument("--runs", type=int, default=5, help="runs per kernel, the median counts")
+    parser.add_argument("--build", default=os.path.join(HERE, "build"))
+    parser.add_argument("-o", "--output", help="write the results as CSV")
+    parser.add_argument("--reference", help="CSV of an earlier run to compare against")
+    parser.add_argument("--tolerance", type=float, default=0.05,
+                        help="allowed growth of the overhead over the reference (absolute)")
+    parser.add_argument("--text-tolerance", type=float, default=0.02,
+                        help="allowed relative growth of the .text delta over the reference")
+    args = parser.parse_args()
+
+    args.plugin = os.path.abspath(args.plugin)
+    args.asm = os.path.abspath(args.asm)
+
+    os.makedirs(args.build, exist_ok=True)
+    harness = os.path.join(args.build, "harness.o")
+    run([args.cc, *args.cflags, "-c", "-o", harness, os.path.join(HERE, "harness.c")])
+
+    configs = [Config()] + [Config(v, s, l) for v in args.variants
+                            for s in args.scopes for l in args.leaf]
+
+    rows, base = [], {}
+    for config in configs:
+        bins, functions = build(args, config, harness)
+        for kernel, (exe, obj) in bins.items():
+            calls, per_call, unit = measure(args, exe)
+            text = section_size(obj, ".text")
+            if config.baseline:
+                base[kernel] = (per_call, unit, text)
+
+            base_per_call, base_unit, base_text = base[kernel]
+            row = dict(zip(FIELDS[:4], config.key(kernel)))
+            row.update(calls=calls, per_call=per_call, unit=unit,
+                       overhead=per_call / base_per_call - 1 if unit == base_unit else float("nan"),
+                       functions=functions.get(kernel, 0),
+                       text=text, text_delta=text - base_text)
+            rows.append(row)
+
+    rows.sort(key=lambda r: (r["kernel"], r["variant"] != "-", r["variant"], r["scope"], r["leaf"]))
+    print_table(rows, sys.stdout)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            w = csv.DictWriter(f, fieldnames=FIELDS)
+            w.writeheader()
+            w.writerows(rows)
+
+    if args.reference and check(rows, args.reference, args, sys.stdout):
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,36 @@
+/* Deep recursion, every frame holds a small buffer */
+#include "harness.h"
+
+const unsigned long iters = 200;
+
+NOINLINE int fib(int n)
+{
+    volatile char buf[16];
+
+    calls++;
+    buf[0] = n;
+    if (n < 2)
+        return buf[0];
+
+    return fib(n - 1) + fib(n - 2);
+}
+
+NOINLINE int ackermann(int m, int n)
+{
+    volatile int frame[4];
+
+    calls++;
+    frame[0] = n;
+    if (m == 0)
+        return frame[0] + 1;
+    if (n == 0)
+        return ackermann(m - 1, 1);
+
+    return ackermann(m - 1, ackermann(m, n - 1));
+}
+
+void kernel(void)
+{
+    if (fib(20) != 6765 || ackermann(2, 200) != 403)
+        __builtin_trap();
+}
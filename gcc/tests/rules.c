@@ -0,0 +1,39 @@
+#include <string.h>
+
+/*
+ * Compiled with rules=rules.conf and leaf=y: fast_copy() is exempt by name,
+ * although the file rule would sign its char buffer, slow_path() is always
+ * signed, and other() falls to the char scope of the file and is not.
+ */
+int __attribute__ ((noinline)) fast_copy(int x)
+{
+    char buf[64];
+
+    memset(buf, x, sizeof(buf));
+    return buf[x & 63];
+}
+
+int __attribute__ ((noinline)) slow_path(int x)
+{
+    return x * 3;
+}
+
+int __attribute__ ((noinline)) other(int x)
+{
+    volatile int arr[8];
+
+    arr[x & 7] = x;
+    return arr[x & 7];
+}
+
+int main(void)
+{
+    if (fast_copy(5) != 5)
+        return 1;
+    if (slow_path(2) != 6)
+        return 2;
+    if (other(9) != 9)
+        return 3;
+
+    return 0;
+}
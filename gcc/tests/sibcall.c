@@ -0,0 +1,37 @@
+#include <stdio.h>
+
+/*
+ * Compiled with -O2, f1() and f2() end in sibling calls to instrumented
+ * functions.  With fuse=y they enter the callee past its prologue, and f3()
+ * authenticates the LR f1() signed.  The test runs on the simulated pac-pl
+ * device, which poisons the LR if that fails.
+ */
+int __attribute__ ((noinline)) f3(int x)
+{
+    volatile char arr[16];
+    arr[0] = x;
+    printf("ret: %p\n", __builtin_return_address(0));
+    return arr[0] + 1;
+}
+
+int __attribute__ ((noinline)) f2(int x)
+{
+    volatile char arr[16];
+    arr[0] = x;
+    return f3(arr[0] + 1);
+}
+
+int __attribute__ ((noinline)) f1(int x)
+{
+    volatile char arr[16];
+    arr[0] = x;
+    return f2(arr[0] + 1);
+}
+
+int main()
+{
+    for (int i = 0; i < 16; i++)
+        if (f1(i) != i + 3)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Built with split=y, the kpacd variant's only split sequences.  The wait of
+ * small() moves past its frame setup and re-stores the signed LR; big() has
+ * more than 32760 bytes below the LR slot, which a re-store cannot reach, so
+ * its wait stays before the sub of sp.  Without kpacd the test only builds.
+ */
+int __attribute__ ((noinline)) small(int x)
+{
+    volatile int arr[4] = { 0 };
+
+    arr[x & 3] = x;
+    return arr[x & 3];
+}
+
+int __attribute__ ((noinline)) big(const char *s)
+{
+    char buf[65536];
+
+    strncpy(buf, s, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    return strlen(buf) + small((int) strlen(s));
+}
+
+int main()
+{
+    return !(big("split") == 5 + 5);
+}
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Compiled with -fstack-protector-strong, both functions get a canary.  With
+ * ssp=pac the canary of fmt() is dropped as it is signed instead, leaf() has
+ * no call saving LR and keeps it.  With ssp=canary neither is signed.
+ */
+int __attribute__ ((noinline)) leaf(int x)
+{
+    volatile char arr[16];
+
+    for (int i = 0; i < 16; i++)
+        arr[i] = x + i;
+
+    return arr[x & 15];
+}
+
+int __attribute__ ((noinline)) fmt(int x)
+{
+    char arr[16];
+    int y;
+
+    snprintf(arr, sizeof(arr), "%d", x);
+    sscanf(arr, "%d", &y);
+
+    return y;
+}
+
+int main(void)
+{
+    if (leaf(3) != 6)
+        return 1;
+    if (fmt(1234) != 1234)
+        return 2;
+
+    return 0;
+}
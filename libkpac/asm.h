@@ -7,22 +7,64 @@ typedef uint32_t inst_t;
 
 #define REG_SP 31
 #define REG_LR 30
+#define REG_IP1 17
 
 #define mask_at(val, mask, shift) (((val) & ((mask) << (shift))) >> (shift))
-#define emit_bl(addr, target)                                           \
+/* Branch at pc to target, stored at addr, which is pc or a copy of it */
+#define emit_branch(addr, pc, target, opcode)                           \
     do {                                                                \
         inst_t *p = (inst_t *) addr;                                    \
-        inst_t opcode = 0x25 << 26;                                     \
-        ptrdiff_t ptrdiff = (intptr_t) (target) - (intptr_t) (addr);    \
-        *p = (opcode | ((ptrdiff >> 2) & 0x3FFFFFF));                   \
+        ptrdiff_t ptrdiff = (intptr_t) (target) - (intptr_t) (pc);      \
+        *p = ((opcode) | ((ptrdiff >> 2) & 0x3FFFFFF));                 \
     } while (0)
+#define emit_bl_at(addr, pc, target)    emit_branch(addr, pc, target, 0x25 << 26)
+#define emit_b_at(addr, pc, target)     emit_branch(addr, pc, target, 0x05 << 26)
+#define emit_bl(addr, target)           emit_bl_at(addr, addr, target)
+#define emit_b(addr, target)            emit_b_at(addr, addr, target)
 
 #define INST_PACIASP 0xD503233F
+#define INST_PACIBSP 0xD503237F
+#define INST_PACIA_LR 0xDAC103FE /* PACIA X30, SP */
+#define INST_PACIB_LR 0xDAC107FE /* PACIB X30, SP */
+#define INST_PACIAZ  0xD503231F
+#define INST_PACIBZ  0xD503235F
+#define INST_PACIZA_LR 0xDAC123FE /* PACIZA X30 */
+#define INST_PACIZB_LR 0xDAC127FE /* PACIZB X30 */
 #define INST_SVC_PAC 0xD4013581 /* SVC #0x9AC */
 
 #define INST_AUTIASP 0xD50323BF
+#define INST_AUTIBSP 0xD50323FF
+#define INST_AUTIA_LR 0xDAC113FE /* AUTIA X30, SP */
+#define INST_AUTIB_LR 0xDAC117FE /* AUTIB X30, SP */
+#define INST_AUTIAZ  0xD503239F
+#define INST_AUTIBZ  0xD50323DF
+#define INST_AUTIZA_LR 0xDAC133FE /* AUTIZA X30 */
+#define INST_AUTIZB_LR 0xDAC137FE /* AUTIZB X30 */
 #define INST_SVC_AUT 0xD40135A1 /* SVC #0x9AD */
 
+#define INST_RET     0xD65F03C0
+#define INST_RETAA   0xD65F0BFF
+#define INST_RETAB   0xD65F0FFF
+
+#define INST_PACIA1716 0xD503211F
+#define INST_PACIB1716 0xD503215F
+#define INST_AUTIA1716 0xD503219F
+#define INST_AUTIB1716 0xD50321DF
+
+#define INST_XPACLRI 0xD50320FF
+#define INST_XPACI_LR 0xDAC143FE /* XPACI X30 */
+#define INST_AND_IMM 0x92400000 /* AND Xd, Xn, #imm (N=1, immr=0) */
+
+#define INST_STUR_LR 0xF81F03FE /* STUR X30, [SP, #-16] */
+#define INST_LDUR_LR 0xF85F03FE /* LDUR X30, [SP, #-16] */
+
+static inst_t and_mask(int reg, int bits)
+{
+    /* Clear everything above the lowest bits of reg, which strips the PAC
+     * of a user space address in a single instruction */
+    return INST_AND_IMM | (reg << 5) | reg | ((bits - 1) << 10);
+}
+
 /*
  * Stores
  */
@@ -59,6 +101,19 @@ static bool stp_off(inst_t x, int *rn, int *rt1, int *rt2, int *imm)
     return true;
 }
 
+static bool stp_fp_off(inst_t x, int *rn)
+{
+    /* signed offset store-pair of SIMD&FP registers (s, d or q),
+     * See STP (SIMD&FP) in the reference manual */
+
+    if (mask_at(x, 0xFF, 22) != 0b10110100 || mask_at(x, 0x3, 30) == 0b11)
+        return false;
+
+    *rn = mask_at(x, 0x1F, 5);
+
+    return true;
+}
+
 static bool str_pre(inst_t x, int *rn, int *rt)
 {
     /* pre-indexed store,
@@ -93,7 +148,7 @@ static bool str_off(inst_t x, int *rn, int *rt, int *imm)
  * Loads
  */
 
-static bool ldp_post(inst_t x, int *rn, int *rt1, int *rt2)
+static bool ldp_post(inst_t x, int *rn, int *rt1, int *rt2, int *imm)
 {
     /* post-indexed load-pair,
      * See p. C6-1666 of the reference manual */
@@ -101,6 +156,9 @@ static bool ldp_post(inst_t x, int *rn, int *rt1, int *rt2)
     if (mask_at(x, 0x3FF, 22) != 0b1010100011)
         return false;
 
+    /* imm7 is signed */
+    *imm = ((int32_t) (x << 10) >> 25) * 8;
+
     *rn = mask_at(x, 0x1F, 5);
     *rt1 = mask_at(x, 0x1F, 0);
     *rt2 = mask_at(x, 0x1F, 10);
@@ -125,7 +183,20 @@ static bool ldp_off(inst_t x, int *rn, int *rt1, int *rt2, int *imm)
     return true;
 }
 
-static bool ldr_post(inst_t x, int *rn, int *rt)
+static bool ldp_fp_off(inst_t x, int *rn)
+{
+    /* signed offset load-pair of SIMD&FP registers (s, d or q),
+     * See LDP (SIMD&FP) in the reference manual */
+
+    if (mask_at(x, 0xFF, 22) != 0b10110101 || mask_at(x, 0x3, 30) == 0b11)
+        return false;
+
+    *rn = mask_at(x, 0x1F, 5);
+
+    return true;
+}
+
+static bool ldr_post(inst_t x, int *rn, int *rt, int *imm)
 {
     /* post-indexed load,
      * See p. C6-1673 of the reference manual */
@@ -134,6 +205,9 @@ static bool ldr_post(inst_t x, int *rn, int *rt)
         mask_at(x, 0x003, 10) != 0b01)
         return false;
 
+    /* imm9 is signed */
+    *imm = (int32_t) (x << 11) >> 23;
+
     *rt = mask_at(x, 0x1F, 0);
     *rn = mask_at(x, 0x1F, 5);
 
@@ -174,7 +248,7 @@ static bool sub_imm(inst_t x, int *rn, int *rd)
 }
 
 
-static bool add_imm(inst_t x, int *rn, int *rd)
+static bool add_imm(inst_t x, int *rn, int *rd, int *imm)
 {
     /* immediate add,
      * See p. C6-1257 of the reference manual */
@@ -182,6 +256,8 @@ static bool add_imm(inst_t x, int *rn, int *rd)
     if (mask_at(x, 0x1FF, 23) != 0b100100010)
         return false;
 
+    *imm = mask_at(x, 0xFFF, 10) << (mask_at(x, 0x1, 22) ? 12 : 0);
+
     *rd = mask_at(x, 0x1F, 0);
     *rn = mask_at(x, 0x1F, 5);
 
@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "channel.h"
+#include "interpose.h"
+#include "poke.h"
+
+/* Slot in text_kpac read by the pac-pl trampolines.  It is copied with the
+ * trampolines, so it has to be set before they are. */
+extern long kpac_pl_tls __attribute__ ((weak));
+
+static __thread uintptr_t pl_channel
+    __attribute__ ((tls_model("initial-exec"))) = PAC_PL_BASE;
+
+static size_t nr_channels = 1;
+static size_t next_channel = 1;
+
+struct channel_start {
+    void *(*fn)(void *);
+    void *arg;
+    uintptr_t channel;
+};
+
+static long tls_offset(void)
+{
+    return (char *) &pl_channel - (char *) __builtin_thread_pointer();
+}
+
+int channel_init(uintptr_t end)
+{
+    if (end > PAC_PL_BASE)
+        nr_channels = (end - PAC_PL_BASE) / PAC_PL_CHANNEL_SIZE;
+
+    /* The trampolines skip the thread pointer while the slot is 0 */
+    if (!&kpac_pl_tls || nr_channels <= 1)
+        return nr_channels;
+
+    long off = tls_offset();
+    if (text_write(&kpac_pl_tls, &off, sizeof(off)))
+        return -1;
+
+    return nr_channels;
+}
+
+long channel_tls(void)
+{
+    return nr_channels > 1 ? tls_offset() : -1;
+}
+
+static void *channel_start(void *arg)
+{
+    struct channel_start start = *(struct channel_start *) arg;
+    free(arg);
+
+    pl_channel = start.channel;
+
+    return start.fn(start.arg);
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*fn)(void *), void *arg)
+{
+    if (nr_channels <= 1)
+        return real(pthread_create)(thread, attr, fn, arg);
+
+    struct channel_start *start = malloc(sizeof(*start));
+    if (!start)
+        return EAGAIN;
+
+    size_t channel = __atomic_fetch_add(&next_channel, 1, __ATOMIC_RELAXED) % nr_channels;
+
+    start->fn = fn;
+    start->arg = arg;
+    start->channel = PAC_PL_BASE + channel * PAC_PL_CHANNEL_SIZE;
+
+    int ret = real(pthread_create)(thread, attr, channel_start, start);
+    if (ret)
+        free(start);
+
+    return ret;
+}
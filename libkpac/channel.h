@@ -0,0 +1,33 @@
+#ifndef LIBKPAC_CHANNEL_H
+#define LIBKPAC_CHANNEL_H
+
+/*
+ * Per-thread channels of the pac-pl device.
+ *
+ * pac-pl.so maps the register windows of the device's channels back to back
+ * from PAC_PL_BASE.  The main thread uses the first one, every thread
+ * created later is given the next one round robin when it starts.  The
+ * channel of a thread is kept in its TLS; the trampolines of pac-pl.S find
+ * it through the offset from the thread pointer in kpac_pl_tls, the
+ * templates of the patchable sites through an ldr patched by sites.c.  The
+ * plugin's inline pac-pl sequences are not patched and stay on the first
+ * channel, see gcc/asm/pac-pl/aarch64/common.h.
+ */
+
+#define PAC_PL_BASE		0xA0000000
+#define PAC_PL_CHANNEL_SIZE	4096
+
+#define PAC_PL_PLAIN		0
+#define PAC_PL_TWEAK		8
+#define PAC_PL_CIPHER		16
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+/* end: end of the device mapping, 0 if there is none */
+int channel_init(uintptr_t end);
+/* Offset of the channel from the thread pointer, -1 with a single channel */
+long channel_tls(void);
+#endif
+
+#endif                          /* LIBKPAC_CHANNEL_H */
@@ -0,0 +1,15 @@
+#ifndef LIBKPAC_INTERPOSE_H
+#define LIBKPAC_INTERPOSE_H
+
+#include <dlfcn.h>
+
+/* The definition of name we interpose */
+#define real(name)                                                      \
+    ({                                                                  \
+        static __typeof__(name) *fn;                                    \
+        if (!fn)                                                        \
+            fn = (__typeof__(name) *) dlsym(RTLD_NEXT, #name);          \
+        fn;                                                             \
+    })
+
+#endif                          /* LIBKPAC_INTERPOSE_H */
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "interpose.h"
+#include "jit.h"
+
+static bool jit_enabled = false;
+
+/* Set while we patch, our own mmap/mprotect calls pass through */
+static __thread bool jit_busy;
+
+#define NR_RANGES		256
+
+/* Disjoint page ranges, unordered.  Without room for a range it is not
+ * recorded, which costs a rescan of scanned ones and nothing for shared ones
+ * of which mprotect does not learn anyway. */
+struct jit_ranges {
+    struct {
+        uintptr_t start, end;
+    } r[NR_RANGES];
+    size_t nr;
+};
+
+/* Executable since they were scanned, and not writable in between */
+static struct jit_ranges scanned;
+/* MAP_SHARED file mappings, patching them would write to the file */
+static struct jit_ranges shared;
+static pthread_mutex_t ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void jit_init(void)
+{
+    char *jit_env = getenv("LIBKPAC_JIT");
+
+    jit_enabled = jit_env && strcmp(jit_env, "0");
+}
+
+static void ranges_add(struct jit_ranges *ranges, uintptr_t start, uintptr_t end)
+{
+    /* Merge with overlapping and adjacent ones */
+    for (size_t i = 0; i < ranges->nr; i++) {
+        if (ranges->r[i].start <= end && start <= ranges->r[i].end) {
+            if (ranges->r[i].start < start)
+                start = ranges->r[i].start;
+            if (ranges->r[i].end > end)
+                end = ranges->r[i].end;
+            ranges->r[i--] = ranges->r[--ranges->nr];
+        }
+    }
+
+    if (ranges->nr < NR_RANGES) {
+        ranges->r[ranges->nr].start = start;
+        ranges->r[ranges->nr].end = end;
+        ranges->nr++;
+    }
+}
+
+static void ranges_remove(struct jit_ranges *ranges, uintptr_t start, uintptr_t end)
+{
+    for (size_t i = 0; i < ranges->nr; i++) {
+        uintptr_t r_start = ranges->r[i].start, r_end = ranges->r[i].end;
+
+        if (r_end <= start || end <= r_start)
+            continue;
+
+        if (r_start < start) {
+            ranges->r[i].end = start;
+            /* The part above the hole, dropped if there is no room */
+            if (r_end > end && ranges->nr < NR_RANGES) {
+                ranges->r[ranges->nr].start = end;
+                ranges->r[ranges->nr].end = r_end;
+                ranges->nr++;
+            }
+        } else if (r_end > end) {
+            ranges->r[i].start = end;
+        } else {
+            ranges->r[i--] = ranges->r[--ranges->nr];
+        }
+    }
+}
+
+static bool ranges_covers(struct jit_ranges *ranges, uintptr_t start, uintptr_t end)
+{
+    for (size_t i = 0; i < ranges->nr; i++)
+        if (ranges->r[i].start <= start && end <= ranges->r[i].end)
+            return true;
+
+    return false;
+}
+
+static bool ranges_overlaps(struct jit_ranges *ranges, uintptr_t start, uintptr_t end)
+{
+    for (size_t i = 0; i < ranges->nr; i++)
+        if (ranges->r[i].start < end && start < ranges->r[i].end)
+            return true;
+
+    return false;
+}
+
+static uintptr_t page_end(void *addr, size_t len)
+{
+    uintptr_t page_size = getpagesize();
+
+    return ((uintptr_t) addr + len + page_size - 1) & ~(page_size - 1);
+}
+
+/* New contents or none at all */
+static void jit_forget(void *addr, size_t len)
+{
+    if (!jit_enabled || jit_busy)
+        return;
+
+    pthread_mutex_lock(&ranges_lock);
+    ranges_remove(&scanned, (uintptr_t) addr, page_end(addr, len));
+    ranges_remove(&shared, (uintptr_t) addr, page_end(addr, len));
+    pthread_mutex_unlock(&ranges_lock);
+}
+
+static void jit_region(void *addr, size_t len, int prot)
+{
+    uintptr_t start = (uintptr_t) addr, end = page_end(addr, len);
+
+    if (!jit_enabled || jit_busy)
+        return;
+
+    pthread_mutex_lock(&ranges_lock);
+
+    /* Code may change until it is executable only */
+    if (prot & PROT_WRITE)
+        ranges_remove(&scanned, start, end);
+
+    /* Execute-only ranges cannot be scanned, a flip back to PROT_EXEC
+     * without writes in between needs no rescan */
+    if (!(prot & PROT_EXEC) || !(prot & PROT_READ) ||
+        ranges_covers(&scanned, start, end) || ranges_overlaps(&shared, start, end))
+        goto out;
+
+    jit_busy = true;
+    jit_patch(addr, len, prot);
+    jit_busy = false;
+
+    /* What is written to a writable one later is not seen anyway */
+    if (!(prot & PROT_WRITE))
+        ranges_add(&scanned, start, end);
+
+out:
+    pthread_mutex_unlock(&ranges_lock);
+}
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    void *ret = real(mmap)(addr, len, prot, flags, fd, offset);
+
+    if (ret == MAP_FAILED)
+        return ret;
+
+    jit_forget(ret, len);
+
+    /* Anonymous mappings start out empty, shared ones are left alone */
+    if (flags & MAP_SHARED) {
+        if (jit_enabled && !jit_busy && !(flags & MAP_ANONYMOUS)) {
+            pthread_mutex_lock(&ranges_lock);
+            ranges_add(&shared, (uintptr_t) ret, page_end(ret, len));
+            pthread_mutex_unlock(&ranges_lock);
+        }
+    } else if (!(flags & MAP_ANONYMOUS)) {
+        jit_region(ret, len, prot);
+    }
+
+    return ret;
+}
+
+int munmap(void *addr, size_t len)
+{
+    int ret = real(munmap)(addr, len);
+
+    if (!ret)
+        jit_forget(addr, len);
+
+    return ret;
+}
+
+int mprotect(void *addr, size_t len, int prot)
+{
+    int ret = real(mprotect)(addr, len, prot);
+
+    if (!ret)
+        jit_region(addr, len, prot);
+
+    return ret;
+}
@@ -0,0 +1,29 @@
+#ifndef LIBKPAC_JIT_H
+#define LIBKPAC_JIT_H
+
+#include <stddef.h>
+
+/*
+ * Incremental patching of code made executable after startup, such as the
+ * output of JITs (LIBKPAC_JIT=1).
+ *
+ * mprotect to PROT_EXEC and mmap of executable private file mappings are
+ * interposed, and the range is patched like the text at startup, reusing
+ * the islands in reach.  Ranges without any PAC instructions cost a scan
+ * and nothing else.  A range scanned before is scanned again only once it
+ * was writable or mapped anew in between.
+ *
+ * Not supported:
+ *  - code written into a mapping that stays executable (RWX, or an
+ *    executable alias of a writable mapping), it is not seen
+ *  - MAP_SHARED file mappings, patching them would change the file
+ *  - code a JIT moves after it was patched (mremap, or copies of it), the
+ *    branches to the islands are PC-relative and break
+ */
+
+void jit_init(void);
+
+/* In libkpac.c */
+void jit_patch(void *addr, size_t len, int prot);
+
+#endif                          /* LIBKPAC_JIT_H */
@@ -10,9 +10,18 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unwind.h>
 
 #include "asm.h"
+#include "channel.h"
+#include "jit.h"
+#include "poke.h"
 #include "proc.h"
+#include "sites.h"
+#include "summary.h"
+#include "trace.h"
+#include "unwind.h"
 
 #ifdef DEBUG
 #define log(fmt, ...) fprintf(stderr, "libkpac: " fmt "\n", ##__VA_ARGS__)
@@ -36,6 +45,11 @@
 #define MIBI			(1024*1024)
 #define NR_VMAS			512
 
+#define HUGE_SIZE		(2*MIBI)
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE		25
+#endif
+
 enum {
     MODE_KPAC_SVC,
     MODE_SVC_ONLY,
@@ -44,6 +58,18 @@ enum {
 struct kpac_routine {
     void *pac;
     void *aut;
+    void *pacz;                 /* Zero modifier */
+    void *autz;
+    void *retaa;
+    void *retaa_svc;
+    void *site_pac;             /* Trace variant only */
+    void *site_aut;
+    void *pac1716;
+    void *aut1716;
+    inst_t *stubs;              /* KPAC_NR_STUBS, free ones are zero */
+
+    void *base;                 /* Mapping of the copy */
+    size_t size;
 
     struct kpac_routine *prev; /* last allocated */
 };
@@ -54,7 +80,9 @@ struct kpac_stat {
     } pac;
     struct {
         long total, patched;
+        long fused;             /* with the following ret */
     } aut;
+    long stubs;                 /* pacia1716/autia1716 */
 };
 
 #define INST_PER_TRAMPOLINE 3
@@ -63,11 +91,34 @@ extern char __start_text_kpac;
 extern void kpac_pac_0(void);
 /* kpac_aut_{504..8} */
 extern void kpac_aut_0(void);
+/* kpac_pacz_{504..8} */
+extern void kpac_pacz_0(void);
+/* kpac_autz_{504..8} */
+extern void kpac_autz_0(void);
+/* kpac_retaa_{504..8}, branched to */
+extern void kpac_retaa_0(void);
+extern void kpac_retaa_svc(void);
+/* Called from the plugin's sites while tracing */
+extern void kpac_site_pac(void) __attribute__ ((weak));
+extern void kpac_site_aut(void) __attribute__ ((weak));
+/* Called from the pacia1716/autia1716 stubs */
+extern void kpac_pac1716(void);
+extern void kpac_aut1716(void);
+extern inst_t kpac_stubs[];
 extern char __stop_text_kpac;
 
 static struct kpac_routine routine_own = {
     .pac = kpac_pac_0,
     .aut = kpac_aut_0,
+    .pacz = kpac_pacz_0,
+    .autz = kpac_autz_0,
+    .retaa = kpac_retaa_0,
+    .retaa_svc = kpac_retaa_svc,
+    .site_pac = kpac_site_pac,
+    .site_aut = kpac_site_aut,
+    .pac1716 = kpac_pac1716,
+    .aut1716 = kpac_aut1716,
+    .stubs = kpac_stubs,
     .prev = NULL, /* Dynamically allocated routines start here */
 };
 
@@ -80,6 +131,37 @@ static unsigned mode = MODE_KPAC_SVC;
 static struct proc_vma vmas[NR_VMAS];
 static size_t nr_vmas = 0;
 
+static struct kpac_site *sites = NULL;
+static size_t nr_sites = 0;
+
+/* Fuse autiasp with the following ret, the trace variant does not sample
+ * the fused returns */
+static bool fuse_ret = true;
+
+/* The text being patched is libgcc_s, see unwind.c */
+static bool unwinder_text = false;
+
+/* Width of user space addresses, the PAC lives above */
+static int va_bits = 48;
+
+/* Mappings were made since vmas was read, see find_routine */
+static bool vmas_stale = false;
+
+/* Islands are read-only and executable once startup is done */
+static bool islands_sealed = false;
+
+/* Shadow copy being patched minus the text it stands for, see shadow_open */
+static intptr_t text_bias = 0;
+
+#define text_pc(p)		((void *) ((uintptr_t) (p) - text_bias))
+#define text_bl(p, target)	emit_bl_at(p, text_pc(p), target)
+#define text_b(p, target)	emit_b_at(p, text_pc(p), target)
+
+/* LIBKPAC_HUGE: objects whose text is kept on huge pages, NULL for none */
+static char *huge_objects = NULL;
+
+struct libkpac_summary libkpac_summary;
+
 static inline void timespec_diff(struct timespec *a, struct timespec *b,
                                  struct timespec *result)
 {
@@ -91,34 +173,50 @@ static inline void timespec_diff(struct timespec *a, struct timespec *b,
     }
 }
 
-static void *routine_pac(struct kpac_routine *routine, long offset)
+static bool trampoline_offset(long offset)
+{
+    return offset == 0 || (offset >= 8 && offset <= 504 && offset % 8 == 0);
+}
+
+/* The trampolines for offsets 8..504 precede the one for 0 */
+static void *trampoline(void *zero, long offset)
 {
     if (offset == 0)
-        return routine->pac;
+        return zero;
 
-    if (offset >= 8 && offset <= 504 && offset % 8 == 0) {
+    if (trampoline_offset(offset)) {
         long index = 1 + (offset - 8) / 8;
-        return (inst_t *) routine->pac - index * INST_PER_TRAMPOLINE;
+        return (inst_t *) zero - index * INST_PER_TRAMPOLINE;
     }
 
-    log("no pac trampoline for offset %ld", offset);
-
     return NULL;
 }
 
-static void *routine_aut(struct kpac_routine *routine, long offset)
+static void *routine_pac(struct kpac_routine *routine, long offset, bool zero)
 {
-    if (offset == 0)
-        return routine->aut;
+    void *fn = trampoline(zero ? routine->pacz : routine->pac, offset);
+    if (!fn)
+        log("no pac trampoline for offset %ld", offset);
 
-    if (offset >= 8 && offset <= 504 && offset % 8 == 0) {
-        long index = 1 + (offset - 8) / 8;
-        return (inst_t *) routine->aut - index * INST_PER_TRAMPOLINE;
-    }
+    return fn;
+}
 
-    log("no aut trampoline for offset %ld", offset);
+static void *routine_aut(struct kpac_routine *routine, long offset, bool zero)
+{
+    void *fn = trampoline(zero ? routine->autz : routine->aut, offset);
+    if (!fn)
+        log("no aut trampoline for offset %ld", offset);
 
-    return NULL;
+    return fn;
+}
+
+static void *routine_retaa(struct kpac_routine *routine, long offset)
+{
+    void *fn = trampoline(routine->retaa, offset);
+    if (!fn)
+        log("no retaa trampoline for offset %ld", offset);
+
+    return fn;
 }
 
 static intptr_t vma_find_hole(uintptr_t current, uintptr_t min, uintptr_t max)
@@ -157,25 +255,239 @@ static intptr_t vma_find_hole(uintptr_t current, uintptr_t min, uintptr_t max)
     return -1;
 }
 
-static struct kpac_routine *allocate_routine(void *hole)
+/* Nearest huge page aligned hole of HUGE_SIZE within [min, max] */
+static intptr_t vma_find_huge_hole(uintptr_t current, uintptr_t min, uintptr_t max)
+{
+    intptr_t best = -1;
+    uintptr_t best_dist = UINTPTR_MAX;
+
+    for (size_t i = 0; i + 1 < nr_vmas; i++) {
+        uintptr_t gap_start = vmas[i].vm_end, gap_end = vmas[i+1].vm_start;
+        uintptr_t cand[] = {
+            ALIGN_UP(gap_start, HUGE_SIZE),
+            ALIGN_DOWN(gap_end, HUGE_SIZE) - HUGE_SIZE,
+        };
+
+        for (size_t j = 0; j < 2; j++) {
+            uintptr_t hole = cand[j];
+            if (hole < gap_start || hole + HUGE_SIZE > gap_end ||
+                !IN_RANGE(hole, min, max))
+                continue;
+
+            uintptr_t dist = hole > current ? hole - current : current - hole;
+            if (dist < best_dist) {
+                best = hole;
+                best_dist = dist;
+            }
+        }
+    }
+
+    return best;
+}
+
+/* With poke, islands are mapped read-only from the start */
+static void island_write(void *dst, const void *src, size_t len)
+{
+    if (!poke_enabled())
+        memcpy(dst, src, len);
+    else if (poke(dst, src, len))
+        die("poke: %s", strerror(errno));
+}
+
+static int island_prot(void)
+{
+    return poke_enabled() ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE | PROT_EXEC;
+}
+
+static struct kpac_routine *fill_routine(void *hole, size_t size)
 {
     size_t len = &__stop_text_kpac - &__start_text_kpac;
 
-    hole = mmap(hole, len + sizeof(struct kpac_routine),
-                PROT_READ | PROT_WRITE | PROT_EXEC,
-                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    island_write(hole, &__start_text_kpac, len);
+
+    /* Fill metadata */
+    struct kpac_routine rout = {
+        .base = hole,
+        .size = size,
+        .pac = hole + ((char *) kpac_pac_0  - &__start_text_kpac),
+        .aut = hole + ((char *) kpac_aut_0  - &__start_text_kpac),
+        .pacz = hole + ((char *) kpac_pacz_0 - &__start_text_kpac),
+        .autz = hole + ((char *) kpac_autz_0 - &__start_text_kpac),
+        .retaa = hole + ((char *) kpac_retaa_0 - &__start_text_kpac),
+        .retaa_svc = hole + ((char *) kpac_retaa_svc - &__start_text_kpac),
+        .pac1716 = hole + ((char *) kpac_pac1716 - &__start_text_kpac),
+        .aut1716 = hole + ((char *) kpac_aut1716 - &__start_text_kpac),
+        .stubs = hole + ((char *) kpac_stubs - &__start_text_kpac),
+    };
+    if (kpac_site_pac) {
+        rout.site_pac = hole + ((char *) kpac_site_pac - &__start_text_kpac);
+        rout.site_aut = hole + ((char *) kpac_site_aut - &__start_text_kpac);
+    }
+
+    island_write(hole + len, &rout, sizeof(rout));
+
+    return (void *) ((uintptr_t) hole + len);
+}
+
+static struct kpac_routine *allocate_routine(void *hole)
+{
+    size_t size = &__stop_text_kpac - &__start_text_kpac + sizeof(struct kpac_routine);
+
+    hole = mmap(hole, size, island_prot(), MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
 
     if (hole == MAP_FAILED)
         die("mmap: %s", strerror(errno));
 
-    memcpy(hole, &__start_text_kpac, len);
+    return fill_routine(hole, size);
+}
 
-    /* Fill metadata */
-    struct kpac_routine *rout = (void *) ((uintptr_t) hole + len);
-    rout->pac = hole + ((char *) kpac_pac_0  - &__start_text_kpac);
-    rout->aut = hole + ((char *) kpac_aut_0  - &__start_text_kpac);
+/* An island on a huge page of its own, NULL if there is no room for one */
+static struct kpac_routine *allocate_huge_routine(uintptr_t branch, uintptr_t min, uintptr_t max)
+{
+    intptr_t hole = vma_find_huge_hole(branch, min, max);
+    if (hole == -1)
+        return NULL;
 
-    return rout;
+    /* Islands allocated since the VMAs were read may be in the way */
+    void *addr = mmap((void *) hole, HUGE_SIZE, island_prot(),
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    if (addr != (void *) hole) {
+        munmap(addr, HUGE_SIZE);
+        return NULL;
+    }
+
+    madvise(addr, HUGE_SIZE, MADV_HUGEPAGE);
+    struct kpac_routine *routine = fill_routine(addr, HUGE_SIZE);
+    madvise(addr, HUGE_SIZE, MADV_COLLAPSE);
+
+    return routine;
+}
+
+/* Whether LIBKPAC_HUGE names the object, "all" for every one */
+static bool huge_object(const char *pathname)
+{
+    if (!huge_objects)
+        return false;
+    if (!strcmp(huge_objects, "all"))
+        return true;
+
+    const char *p = huge_objects;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        const char *base = strrchr(pathname, '/');
+        base = base ? base + 1 : pathname;
+
+        if (len && !strncmp(base, p, len) && base[len] == '\0')
+            return true;
+
+        p += len + (p[len] == ',');
+    }
+
+    return false;
+}
+
+struct stack_walk {
+    uintptr_t start, end;
+    bool found;
+};
+
+static _Unwind_Reason_Code stack_frame(struct _Unwind_Context *ctx, void *data)
+{
+    struct stack_walk *walk = data;
+    uintptr_t ip = _Unwind_GetIP(ctx);
+
+    if (IN_RANGE(ip, walk->start, walk->end - 1)) {
+        walk->found = true;
+        return _URC_END_OF_STACK;
+    }
+
+    return _URC_NO_REASON;
+}
+
+/* Whether the text of an object may be remapped under our feet: not the
+ * dynamic loader and libc, which run the remap, and nothing we return to */
+static bool vma_remap_safe(struct proc_vma *vma)
+{
+    const char *base = strrchr(vma->pathname, '/');
+    base = base ? base + 1 : vma->pathname;
+
+    if (!strncmp(base, "ld-", 3) || !strncmp(base, "libc.so", 7) ||
+        !strncmp(base, "libc-", 5) || strstr(base, "libkpac"))
+        return false;
+
+    struct stack_walk walk = { vma->vm_start, vma->vm_end, false };
+    _Unwind_Backtrace(stack_frame, &walk);
+
+    return !walk.found;
+}
+
+/*
+ * Replace the text by a private anonymous copy at the same address, so that
+ * patching it does not break it up into 4K pages.  The copy is placed at the
+ * same offset within a huge page as the text, mremap then moves whole huge
+ * pages over.  Only the part between the first and last huge page boundary
+ * can be backed by huge pages.
+ */
+static bool vma_remap_huge(struct proc_vma *vma)
+{
+    size_t size = vma->vm_end - vma->vm_start;
+    uintptr_t huge_start = ALIGN_UP(vma->vm_start, HUGE_SIZE);
+    uintptr_t huge_end = ALIGN_DOWN(vma->vm_end, HUGE_SIZE);
+
+    /* Execute-only text cannot be copied */
+    if (huge_start >= huge_end || !vma->r)
+        return false;
+
+    if (!vma_remap_safe(vma)) {
+        log("[%s] in use, not remapped", vma->pathname);
+        return false;
+    }
+
+    char *scratch = mmap(NULL, size + HUGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (scratch == MAP_FAILED)
+        return false;
+
+    uintptr_t copy = ALIGN_DOWN((uintptr_t) scratch, HUGE_SIZE) +
+        (vma->vm_start & (HUGE_SIZE - 1));
+    if (copy < (uintptr_t) scratch)
+        copy += HUGE_SIZE;
+
+    madvise((void *) (copy + huge_start - vma->vm_start), huge_end - huge_start,
+            MADV_HUGEPAGE);
+    memcpy((void *) copy, (void *) vma->vm_start, size);
+
+    /* The copy replaces live text, it has to be executable once it is there.
+     * Patching makes it writable again, or pokes it. */
+    if (mprotect((void *) copy, size, PROT_READ | PROT_EXEC))
+        die("mprotect: %s", strerror(errno));
+
+    void *text = mremap((void *) copy, size, size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                        (void *) vma->vm_start);
+    if (text == MAP_FAILED)
+        die("mremap: %s", strerror(errno));
+
+    /* Drop what is left of the scratch area around the copy */
+    if (copy > (uintptr_t) scratch)
+        munmap(scratch, copy - (uintptr_t) scratch);
+    if (copy + size < (uintptr_t) scratch + size + HUGE_SIZE)
+        munmap((void *) (copy + size), (uintptr_t) scratch + HUGE_SIZE - copy);
+
+    /* Without THP enabled for madvise, or if the faults got small pages */
+    madvise((void *) huge_start, huge_end - huge_start, MADV_COLLAPSE);
+
+    return true;
+}
+
+static struct proc_vma *vma_at(uintptr_t addr)
+{
+    for (size_t i = 0; i < nr_vmas; i++)
+        if (IN_RANGE(addr, vmas[i].vm_start, vmas[i].vm_end - 1))
+            return &vmas[i];
+
+    return NULL;
 }
 
 static struct kpac_routine *find_routine(void *branch)
@@ -196,22 +508,50 @@ static struct kpac_routine *find_routine(void *branch)
             return needle;
     }
 
-    /* Find a suitable hole in the address space */
-    intptr_t hole = vma_find_hole((uintptr_t) branch, range_min, range_max);
-    if (hole == -1)
-        return NULL;
+    struct kpac_routine *routine = NULL;
 
-    /* Allocate and copy text into it */
-    struct kpac_routine *routine = allocate_routine((void *) hole);
+    /* JIT regions and their islands are missing from the VMAs of startup */
+    if (vmas_stale) {
+        ssize_t ret = proc_maps(PROC_PID_SELF, vmas, NR_VMAS);
+        if (ret == -1)
+            return NULL;
+        nr_vmas = ret;
+    }
+
+    /* Keep the islands of huge page backed text on huge pages too */
+    struct proc_vma *vma = vma_at((uintptr_t) branch);
+    if (vma && huge_object(vma->pathname))
+        routine = allocate_huge_routine((uintptr_t) branch, range_min, range_max);
+
+    if (!routine) {
+        /* Find a suitable hole in the address space */
+        intptr_t hole = vma_find_hole((uintptr_t) branch, range_min, range_max);
+        if (hole == -1)
+            return NULL;
+
+        /* Allocate and copy text into it */
+        routine = allocate_routine((void *) hole);
+    }
     log("allocated routine at %p", routine);
+    libkpac_summary.islands++;
 
-    routine->prev = routine_own.prev;
+    island_write(&routine->prev, &routine_own.prev, sizeof(routine->prev));
     routine_own.prev = routine;
 
     return routine;
 }
 
-static bool patch_paciasp(inst_t *text, size_t len, size_t i)
+static void *site_call(inst_t *site, unsigned type)
+{
+    struct kpac_routine *routine = find_routine(site);
+    if (!routine)
+        return NULL;
+
+    return type == SITE_PAC ? routine->site_pac : routine->site_aut;
+}
+
+/* zero: sign with a zero modifier (paciaz), otherwise with sp (paciasp) */
+static bool patch_paciasp(inst_t *text, size_t len, size_t i, bool zero)
 {
     int rn = 0, rd = 0;
     int rt1 = 0, rt2 = 0;
@@ -220,17 +560,19 @@ static bool patch_paciasp(inst_t *text, size_t len, size_t i)
     if (mode == MODE_SVC_ONLY || i + 1 >= len)
         goto fallback;
 
-    struct kpac_routine *routine = find_routine(&text[i]);
+    struct kpac_routine *routine = find_routine(text_pc(&text[i]));
+    if (!routine)
+        goto fallback;
 
     /* paciasp
      * stp x29, x30, [sp, #-N]! or str x30, [sp, #-N]! */
     if ((stp_pre(text[i+1], &rn, &rt1, &rt2) || str_pre(text[i+1], &rn, &rt1)) &&
         rn == REG_SP && (rt1 == REG_LR || rt2 == REG_LR)) {
 
-        void *fn = routine_pac(routine, rt1 == REG_LR ? 0 : 8);
+        void *fn = routine_pac(routine, rt1 == REG_LR ? 0 : 8, zero);
 
         text[i] = text[i+1];
-        emit_bl(&text[i+1], fn);
+        text_bl(&text[i+1], fn);
         return true;
     }
 
@@ -248,14 +590,16 @@ static bool patch_paciasp(inst_t *text, size_t len, size_t i)
         for (size_t j = i+2; j < len; j++) {
             if (!((stp_off(text[j], &rn, &rt1, &rt2, &off) ||
                    str_off(text[j], &rn, &rt1, &off)) && rn == REG_SP)) {
-                /* Allow move to register containing stack frame size */
-                if (mov_imm(text[j], &rd) && rd == frame_reg)
+                /* Allow move to register containing stack frame size, and
+                 * callee-saved FP registers (the epilogue allows them too) */
+                if ((mov_imm(text[j], &rd) && rd == frame_reg) ||
+                    (stp_fp_off(text[j], &rn) && rn == REG_SP))
                     continue;
                 break;
             }
 
             if (rt1 == REG_LR || rt2 == REG_LR) {
-                void *fn = routine_pac(routine, rt1 == REG_LR ? off : 8 + off);
+                void *fn = routine_pac(routine, rt1 == REG_LR ? off : 8 + off, zero);
                 if (!fn)
                     goto fallback;
 
@@ -264,7 +608,7 @@ static bool patch_paciasp(inst_t *text, size_t len, size_t i)
                     text[k] = text[k+1];
 
                 /* Emit call to pac after LR is stored on the stack */
-                emit_bl(&text[j], fn);
+                text_bl(&text[j], fn);
                 return true;
             }
         }
@@ -276,26 +620,28 @@ fallback:
     return false;
 }
 
-static bool patch_autiasp(inst_t *text, size_t len, size_t i)
+static bool patch_autiasp(inst_t *text, size_t len, size_t i, bool zero)
 {
     int rn = 0, rd = 0;
     int rt1 = 0, rt2 = 0;
-    int off = 0;
+    int off = 0, imm = 0;
 
     if (mode == MODE_SVC_ONLY || i < 1)
         goto fallback;
 
-    struct kpac_routine *routine = find_routine(&text[i]);
+    struct kpac_routine *routine = find_routine(text_pc(&text[i]));
+    if (!routine)
+        goto fallback;
 
     /* ldp x29, x30, [sp], #N or ldr x30, [sp], #N
      * autiasp */
-    if ((ldp_post(text[i-1], &rn, &rt1, &rt2) || ldr_post(text[i-1], &rn, &rt1)) &&
+    if ((ldp_post(text[i-1], &rn, &rt1, &rt2, &imm) || ldr_post(text[i-1], &rn, &rt1, &imm)) &&
         rn == REG_SP && (rt1 == REG_LR || rt2 == REG_LR)) {
 
-        void *fn = routine_aut(routine, rt1 == REG_LR ? 0 : 8);
+        void *fn = routine_aut(routine, rt1 == REG_LR ? 0 : 8, zero);
 
         text[i] = text[i-1];
-        emit_bl(&text[i-1], fn);
+        text_bl(&text[i-1], fn);
         return true;
     }
 
@@ -304,7 +650,7 @@ static bool patch_autiasp(inst_t *text, size_t len, size_t i)
      * autiasp */
     int frame_reg = -1;
     if (i >= 1 &&
-        (add_imm(text[i-1], &rn, &rd) || add_reg(text[i-1], &rn, &rd, &frame_reg)) &&
+        (add_imm(text[i-1], &rn, &rd, &imm) || add_reg(text[i-1], &rn, &rd, &frame_reg)) &&
         rn == REG_SP && rd == REG_SP) {
 
         /* Search upwards for ldp X, x30, [sp, #M] or ldr x30, [sp, #M],
@@ -313,14 +659,16 @@ static bool patch_autiasp(inst_t *text, size_t len, size_t i)
         for (ssize_t j = i-2; j >= 0; j--) {
             if (!((ldp_off(text[j], &rn, &rt1, &rt2, &off) ||
                    ldr_off(text[j], &rn, &rt1, &off)) && rn == REG_SP)) {
-                /* Allow move to register containing stack frame size */
-                if (mov_imm(text[j], &rd) && rd == frame_reg)
+                /* Allow move to register containing stack frame size, and
+                 * callee-saved FP registers as in the prologue */
+                if ((mov_imm(text[j], &rd) && rd == frame_reg) ||
+                    (ldp_fp_off(text[j], &rn) && rn == REG_SP))
                     continue;
                 break;
             }
 
             if (rt1 == REG_LR || rt2 == REG_LR) {
-                void *fn = routine_aut(routine, rt1 == REG_LR ? off : 8 + off);
+                void *fn = routine_aut(routine, rt1 == REG_LR ? off : 8 + off, zero);
                 if (!fn)
                     goto fallback;
 
@@ -329,7 +677,7 @@ static bool patch_autiasp(inst_t *text, size_t len, size_t i)
                     text[k] = text[k-1];
 
                 /* Emit call to aut before LR is loaded from the stack */
-                emit_bl(&text[j], fn);
+                text_bl(&text[j], fn);
                 return true;
             }
         }
@@ -341,41 +689,403 @@ fallback:
     return false;
 }
 
-static void vma_patch(struct proc_vma *vma, struct kpac_stat *stat)
+/* Offset below sp of the slot the epilogue ending at text[i-1] loaded lr
+ * from, or -1.  lr_off: offset of the slot above sp before the epilogue,
+ * which the prologue passed to the pac trampoline. */
+static long epilogue_slot(inst_t *text, size_t i, long *lr_off)
 {
-    char *filename = vma->pathname;
-    inst_t *text = (inst_t *) vma->vm_start;
-    size_t len = (vma->vm_end - vma->vm_start) / sizeof(inst_t);
+    int rn = 0, rd = 0;
+    int rt1 = 0, rt2 = 0;
+    int off = 0, imm = 0;
 
+    if (i < 1)
+        return -1;
+
+    /* ldp x29, x30, [sp], #N or ldr x30, [sp], #N
+     *
+     * lr was loaded from sp-N (+8 for ldp) */
+    if ((ldp_post(text[i-1], &rn, &rt1, &rt2, &imm) || ldr_post(text[i-1], &rn, &rt1, &imm)) &&
+        rn == REG_SP && (rt1 == REG_LR || rt2 == REG_LR)) {
+        *lr_off = rt1 == REG_LR ? 0 : 8;
+        return imm - *lr_off;
+    }
+
+    /* ldp/ldr x30, [sp, #M]
+     * add sp, sp, #N */
+    if (add_imm(text[i-1], &rn, &rd, &imm) && rn == REG_SP && rd == REG_SP) {
+        for (ssize_t j = i-2; j >= 0; j--) {
+            if (!((ldp_off(text[j], &rn, &rt1, &rt2, &off) ||
+                   ldr_off(text[j], &rn, &rt1, &off)) && rn == REG_SP)) {
+                if (ldp_fp_off(text[j], &rn) && rn == REG_SP)
+                    continue;
+                break;
+            }
+
+            if (rt1 == REG_LR || rt2 == REG_LR) {
+                *lr_off = rt1 == REG_LR ? off : 8 + off;
+                return imm - *lr_off;
+            }
+        }
+    }
+
+    return -1;
+}
+
+static bool patch_retaa(inst_t *text, size_t len, size_t i)
+{
+    void *fn = NULL;
+
+    /* A svc cannot return on its own, so even the fallback needs an island */
+    struct kpac_routine *routine = find_routine(text_pc(&text[i]));
+    if (!routine)
+        return false;
+
+    /* The trampoline authenticates with the slot address as modifier, the
+     * svc with sp.  Which one fits depends on how the prologue was patched:
+     * it took the pac trampoline only for a slot up to 504 above sp. */
+    long lr_off = -1;
+    long slot = epilogue_slot(text, i, &lr_off);
+    if (mode != MODE_SVC_ONLY && slot >= 0 && trampoline_offset(lr_off)) {
+        fn = routine_retaa(routine, slot);
+        if (!fn)
+            log("retaa at %p does not match its prologue", text_pc(&text[i]));
+    }
+
+    if (fn) {
+        /* Authenticates lr and returns in place of us */
+        text_b(&text[i], fn);
+        return true;
+    }
+
+    text_b(&text[i], routine->retaa_svc);
+
+    return false;
+}
+
+/* (epilogue)
+ * autiasp
+ * ret
+ *
+ * Leave the epilogue in place and branch to the retaa trampoline instead
+ * of calling the aut one before it, which saves the store and reload of lr
+ * and a bl/ret pair.  The ret stays behind unreachable.  Only where
+ * patch_autiasp would take the aut trampoline, whose modifier the prologue
+ * matched: otherwise both the prologue and the epilogue use the svc. */
+static bool patch_autiasp_ret(inst_t *text, size_t len, size_t i)
+{
+    if (!fuse_ret || mode == MODE_SVC_ONLY || i + 1 >= len || text[i+1] != INST_RET)
+        return false;
+
+    long lr_off = -1;
+    long slot = epilogue_slot(text, i, &lr_off);
+    if (slot < 0 || !trampoline_offset(lr_off) || !trampoline_offset(slot))
+        return false;
+
+    struct kpac_routine *routine = find_routine(text_pc(&text[i]));
+    if (!routine)
+        return false;
+
+    text_b(&text[i], routine_retaa(routine, slot));
+
+    return true;
+}
+
+/* Writable islands are written directly, our own text and sealed islands
+ * like any other text */
+static void stub_write(struct kpac_routine *routine, inst_t *dst, const inst_t *src, size_t len)
+{
+    if (routine != &routine_own && !islands_sealed)
+        island_write(dst, src, len);
+    else if (text_write(dst, src, len))
+        die("text_write: %s", strerror(errno));
+
+    __builtin___clear_cache((char *) dst, (char *) dst + len);
+}
+
+/* pacia1716/autia1716: x17 <- op(x17, x16)
+ *
+ * libgcc's unwinder demangles the return addresses of signed frames with
+ * autia1716, the CFA as the modifier, and signs the handler address with
+ * pacia1716 (aarch64-unwind.h).  These are not next to a frame store or load
+ * of lr, and a bl in their place would clobber lr, so the site branches to a
+ * stub of its own in the island instead.  The stub saves lr, calls the
+ * routine and branches back. */
+static bool patch_1716(inst_t *text, size_t len, size_t i, bool pac)
+{
+    if (mode == MODE_SVC_ONLY || i + 1 >= len)
+        return false;
+
+    struct kpac_routine *routine = find_routine(text_pc(&text[i]));
+    if (!routine)
+        return false;
+
+    inst_t *stub = NULL;
+    for (size_t k = 0; k < KPAC_NR_STUBS && !stub; k++) {
+        if (!routine->stubs[k * KPAC_STUB_LEN])
+            stub = &routine->stubs[k * KPAC_STUB_LEN];
+    }
+    if (!stub) {
+        log("no stub left for %s1716 at %p", pac ? "pac" : "aut", text_pc(&text[i]));
+        return false;
+    }
+
+    inst_t code[KPAC_STUB_LEN] = { INST_STUR_LR, 0, INST_LDUR_LR, 0 };
+    emit_bl_at(&code[1], &stub[1], pac ? routine->pac1716 : routine->aut1716);
+    emit_b_at(&code[3], &stub[3], text_pc(&text[i+1]));
+    stub_write(routine, stub, code, sizeof(code));
+
+    text_b(&text[i], stub);
+
+    return true;
+}
+
+static bool pac_zero(inst_t x)
+{
+    switch (x) {
+    case INST_PACIAZ:
+    case INST_PACIBZ:
+    case INST_PACIZA_LR:
+    case INST_PACIZB_LR:
+    case INST_AUTIAZ:
+    case INST_AUTIBZ:
+    case INST_AUTIZA_LR:
+    case INST_AUTIZB_LR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Whether text_patch would rewrite x */
+static bool patchable(inst_t x)
+{
+    switch (x) {
+    case INST_PACIASP:
+    case INST_PACIBSP:
+    case INST_PACIA_LR:
+    case INST_PACIB_LR:
+    case INST_PACIAZ:
+    case INST_PACIBZ:
+    case INST_PACIZA_LR:
+    case INST_PACIZB_LR:
+    case INST_AUTIASP:
+    case INST_AUTIBSP:
+    case INST_AUTIA_LR:
+    case INST_AUTIB_LR:
+    case INST_AUTIAZ:
+    case INST_AUTIBZ:
+    case INST_AUTIZA_LR:
+    case INST_AUTIZB_LR:
+    case INST_RETAA:
+    case INST_RETAB:
+    case INST_PACIA1716:
+    case INST_PACIB1716:
+    case INST_AUTIA1716:
+    case INST_AUTIB1716:
+    case INST_XPACLRI:
+    case INST_XPACI_LR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void text_patch(inst_t *text, size_t len, struct kpac_stat *stat)
+{
     for (size_t i = 0; i < len; i++) {
+        /* There is no key input to the backends, the B key forms use the
+         * same one as the A key forms */
         switch (text[i]) {
         case INST_PACIASP:
+        case INST_PACIBSP:
+        case INST_PACIA_LR:
+        case INST_PACIB_LR:
+        case INST_PACIAZ:
+        case INST_PACIBZ:
+        case INST_PACIZA_LR:
+        case INST_PACIZB_LR:
             // log("%s: %p found pac", filename, &text[i]);
             stat->pac.total++;
 
-            if (patch_paciasp(text, len, i)) {
+            if (patch_paciasp(text, len, i, pac_zero(text[i]))) {
                 stat->pac.patched++;
                 // log("%s: %p patched pac", filename, &text[i]);
             }
 
             break;
         case INST_AUTIASP:
+        case INST_AUTIBSP:
+        case INST_AUTIA_LR:
+        case INST_AUTIB_LR:
+        case INST_AUTIAZ:
+        case INST_AUTIBZ:
+        case INST_AUTIZA_LR:
+        case INST_AUTIZB_LR:
             // log("%s: %p found aut", filename, &text[i]);
             stat->aut.total++;
 
-            if (patch_autiasp(text, len, i)) {
+            if (!pac_zero(text[i]) && patch_autiasp_ret(text, len, i)) {
+                stat->aut.patched++;
+                stat->aut.fused++;
+            } else if (patch_autiasp(text, len, i, pac_zero(text[i]))) {
                 stat->aut.patched++;
                 // log("%s: %p patched aut", filename, &text[i]);
             }
 
             break;
+        case INST_RETAA:
+        case INST_RETAB:
+            stat->aut.total++;
+
+            if (patch_retaa(text, len, i))
+                stat->aut.patched++;
+
+            break;
+        case INST_PACIA1716:
+        case INST_PACIB1716:
+            if (patch_1716(text, len, i, true))
+                stat->stubs++;
+            else
+                log("%p: pacia1716 left alone", text_pc(&text[i]));
+            break;
+        case INST_AUTIA1716:
+        case INST_AUTIB1716:
+            if (!unwinder_text && patch_1716(text, len, i, false)) {
+                stat->stubs++;
+            } else {
+                /* Strip only, unwind.c authenticates the whole stack then */
+                text[i] = and_mask(REG_IP1, va_bits);
+                unwind_stripped();
+            }
+            break;
+        case INST_XPACLRI:
+        case INST_XPACI_LR:
+            /* Used by the unwinder on the return address of its own frame,
+             * the first one it looks up */
+            text[i] = and_mask(REG_LR, va_bits);
+            break;
+        }
+    }
+}
+
+/* With poke, text is patched in a copy at shadow and only what changed is
+ * written back, see poke.h.  The patchers see text_bias meanwhile. */
+static void shadow_open(inst_t *text, size_t nr, inst_t *shadow)
+{
+    memcpy(shadow, text, nr * sizeof(inst_t));
+    text_bias = (uintptr_t) shadow - (uintptr_t) text;
+}
+
+/* Returns the number of writes or -1 */
+static long shadow_close(inst_t *text, size_t nr, inst_t *shadow)
+{
+    text_bias = 0;
+
+    long writes = poke_changes(text, shadow, nr * sizeof(inst_t));
+    __builtin___clear_cache((char *) text, (char *) (text + nr));
+
+    return writes;
+}
+
+/* Patch [addr, addr + len), made executable with prot after startup, see
+ * jit.h.  Called with the interposers of jit.c disabled. */
+void jit_patch(void *addr, size_t len, int prot)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    inst_t *text = addr;
+    size_t nr = len / sizeof(inst_t), i;
+
+    /* Most transitions are of code without PAC instructions or of code
+     * patched before, look before taking the lock and making it writable */
+    for (i = 0; i < nr && !patchable(text[i]); i++)
+        ;
+    if (i == nr)
+        return;
+
+    pthread_mutex_lock(&lock);
+
+    struct kpac_routine *last = routine_own.prev;
+    struct kpac_stat stat = { 0 };
+    inst_t *shadow = NULL;
+
+    if (poke_enabled()) {
+        shadow = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (shadow == MAP_FAILED) {
+            log("[jit] %p: mmap: %s", addr, strerror(errno));
+            goto out;
+        }
+        shadow_open(text, nr, shadow);
+    } else if (!(prot & PROT_WRITE) && mprotect(addr, len, prot | PROT_WRITE)) {
+        log("[jit] %p: mprotect: %s", addr, strerror(errno));
+        goto out;
+    }
+
+    /* After the shadow is mapped, new islands have to keep out of it */
+    vmas_stale = true;
+
+    if (shadow) {
+        text_patch(shadow, nr, &stat);
+        long writes = shadow_close(text, nr, shadow);
+        if (writes == -1)
+            die("poke: %s", strerror(errno));
+        munmap(shadow, len);
+        libkpac_summary.text_writes += writes;
+    } else {
+        text_patch(text, nr, &stat);
+        __builtin___clear_cache((char *) addr, (char *) addr + len);
+
+        if (!(prot & PROT_WRITE) && mprotect(addr, len, prot))
+            die("mprotect: %s", strerror(errno));
+
+        /* Islands allocated for this region */
+        for (struct kpac_routine *j = routine_own.prev; j != last; j = j->prev) {
+            if (mprotect(j->base, j->size, PROT_READ | PROT_EXEC))
+                die("mprotect: %s", strerror(errno));
         }
     }
+
+    log("[jit] %p-%p: patched %ld/%ld pac, %ld/%ld aut", addr, (char *) addr + len,
+        stat.pac.patched, stat.pac.total, stat.aut.patched, stat.aut.total);
+    libkpac_summary.jit_regions++;
+
+out:
+    pthread_mutex_unlock(&lock);
+}
+
+static int detect_backend(void)
+{
+    char *backend_env = getenv("LIBKPAC_BACKEND");
+    if (backend_env) {
+        if (!strcmp(backend_env, "syscall"))
+            return BACKEND_SYSCALL;
+        if (!strcmp(backend_env, "kpacd"))
+            return BACKEND_KPACD;
+        if (!strcmp(backend_env, "pac-pl"))
+            return BACKEND_PAC_PL;
+        die("Invalid backend: %s", backend_env);
+    }
+
+    if (mode == MODE_SVC_ONLY)
+        return BACKEND_SYSCALL;
+
+    /* Prefer the PL device if it has been mapped by pac-pl.so */
+    for (size_t i = 0; i < nr_vmas; i++)
+        if (IN_RANGE(PAC_PL_BASE, vmas[i].vm_start, vmas[i].vm_end - 1))
+            return BACKEND_PAC_PL;
+
+    for (size_t i = 0; i < nr_vmas; i++)
+        if (IN_RANGE(KPACD_BASE, vmas[i].vm_start, vmas[i].vm_end - 1))
+            return BACKEND_KPACD;
+
+    return BACKEND_SYSCALL;
 }
 
 __attribute__ ((constructor))
 void libkpac_init()
 {
+    struct timespec init0, init1, init_diff;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &init0);
+
     page_size = sysconf(_SC_PAGESIZE);
     pid = getpid();
 
@@ -397,11 +1107,39 @@ void libkpac_init()
             die("Invalid mode: %s", mode_env);
     }
 
+    /* Comma separated object names or "all" */
+    huge_objects = getenv("LIBKPAC_HUGE");
+
+    /* Before anything is written to text */
+    int poking = poke_init(page_size);
+    if (poking == -1)
+        die("poke_init: %s", strerror(errno));
+    log("text writes %s", poking ? "through /proc/self/mem" : "by mprotect");
+
     ssize_t ret = proc_maps(PROC_PID_SELF, vmas, NR_VMAS);
     if (ret == -1)
         die("proc_maps: %s", strerror(errno));
     nr_vmas = ret;
 
+    /* One shadow for all text, in the VMAs so that no island is put over it */
+    inst_t *shadow = NULL;
+    size_t shadow_size = 0;
+    if (poking) {
+        for (size_t i = 0; i < nr_vmas; i++)
+            if (vmas[i].x && vmas[i].vm_end - vmas[i].vm_start > shadow_size)
+                shadow_size = vmas[i].vm_end - vmas[i].vm_start;
+
+        shadow = mmap(NULL, shadow_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (shadow == MAP_FAILED)
+            die("mmap: %s", strerror(errno));
+
+        ret = proc_maps(PROC_PID_SELF, vmas, NR_VMAS);
+        if (ret == -1)
+            die("proc_maps: %s", strerror(errno));
+        nr_vmas = ret;
+    }
+
     log("Virtual memory areas:");
     for (size_t i = 0; i < nr_vmas; i++) {
         log("%016lx-%016lx (%c%c%c%c) %s",
@@ -411,12 +1149,50 @@ void libkpac_init()
             vmas[i].pathname);
     }
 
+    /* The stack is the highest user space mapping */
+    uintptr_t top = 0;
+    for (size_t i = 0; i < nr_vmas; i++)
+        if (vmas[i].vm_end > top)
+            top = vmas[i].vm_end;
+    va_bits = 64 - __builtin_clzl(top - 1);
+    unwind_init(va_bits);
+    log("%d bit virtual addresses", va_bits);
+
+    /* Instrumentation sites emitted by the plugin's patchable variant */
+    int backend = detect_backend();
+    ret = sites_collect(&sites);
+    if (ret == -1)
+        die("sites_collect: %s", strerror(errno));
+    nr_sites = ret;
+    log("%zu patchable sites, backend %d", nr_sites, backend);
+    libkpac_summary.sites = nr_sites;
+
+    /* pac-pl.so maps one window per channel, before the first trampoline
+     * is copied */
+    uintptr_t pac_pl_end = 0;
+    for (size_t i = 0; i < nr_vmas; i++)
+        if (IN_RANGE(PAC_PL_BASE, vmas[i].vm_start, vmas[i].vm_end - 1))
+            pac_pl_end = vmas[i].vm_end;
+    ret = channel_init(pac_pl_end);
+    if (ret == -1)
+        die("channel_init: %s", strerror(errno));
+    log("%zd pac-pl channels", ret);
+
+    /* Before the first trampoline is copied */
+    int tracing = trace_init();
+    if (tracing == -1)
+        die("trace_init: %s", strerror(errno));
+    log("tracing %s", tracing ? "on" : "off");
+    fuse_ret = !tracing;
+
     for (size_t i = 0; i < (size_t) nr_vmas; i++) {
         struct kpac_stat stat = { 0 };
         struct timespec tp0, tp1, diff;
 
         struct proc_vma *vma = &vmas[i];
         size_t vm_size = vma->vm_end - vma->vm_start;
+        inst_t *text = (inst_t *) vma->vm_start;
+        size_t nr = vm_size / sizeof(inst_t);
 
         clock_gettime(CLOCK_MONOTONIC_RAW, &tp0);
 
@@ -434,20 +1210,55 @@ void libkpac_init()
 
         log("[%s] patching segment %lx-%lx", vma->pathname, vma->vm_start, vma->vm_end);
 
+        if (huge_object(vma->pathname) && vma_remap_huge(vma)) {
+            log("[%s] text on huge pages", vma->pathname);
+            libkpac_summary.huge_vmas++;
+        }
+
+        /* Execute-only text cannot be copied to the shadow */
+        bool shadowed = shadow && vma->r;
+
+        if (shadowed)
+            shadow_open(text, nr, shadow);
         /* Need PROT_EXEC here to be able to execute mprotect in libc later */
-        if (mprotect((void *) vma->vm_start, vm_size, PROT_READ | PROT_EXEC | PROT_WRITE))
+        else if (mprotect((void *) vma->vm_start, vm_size, PROT_READ | PROT_EXEC | PROT_WRITE))
             die("mprotect: %s", strerror(errno));
 
         /* Work on this VMA */
-        vma_patch(vma, &stat);
-
-        /* Restore security */
-        if (mprotect((void *) vma->vm_start, vm_size, PROT_READ | PROT_EXEC))
-            die("mprotect: %s", strerror(errno));
+        size_t nr_patched = sites_patch(sites, nr_sites, vma->vm_start, vma->vm_end, text_bias,
+                                        backend,
+                                        tracing && backend == BACKEND_KPACD ? site_call : NULL);
+        if (nr_patched)
+            log("[%s] patched %zu sites", vma->pathname, nr_patched);
+        unwinder_text = unwind_object(vma->pathname);
+        text_patch(shadowed ? shadow : text, nr, &stat);
+        unwinder_text = false;
+        log("[%s] fused %ld of %ld aut with ret", vma->pathname, stat.aut.fused, stat.aut.total);
+
+        if (shadowed) {
+            /* The text keeps its protection, which is PROT_READ | PROT_EXEC
+             * after vma_remap_huge as well */
+            long writes = shadow_close(text, nr, shadow);
+            if (writes == -1)
+                die("poke: %s", strerror(errno));
+            log("[%s] %ld writes to /proc/self/mem", vma->pathname, writes);
+            libkpac_summary.text_writes += writes;
+        } else {
+            /* Restore security */
+            if (mprotect((void *) vma->vm_start, vm_size, PROT_READ | PROT_EXEC))
+                die("mprotect: %s", strerror(errno));
+        }
 
         clock_gettime(CLOCK_MONOTONIC_RAW, &tp1);
         timespec_diff(&tp1, &tp0, &diff);
 
+        libkpac_summary.vmas++;
+        libkpac_summary.pac_total   += stat.pac.total;
+        libkpac_summary.pac_patched += stat.pac.patched;
+        libkpac_summary.aut_total   += stat.aut.total;
+        libkpac_summary.aut_patched += stat.aut.patched;
+        libkpac_summary.stubs       += stat.stubs;
+
         if (stat_file)
             fprintf(stat_file, "%s,%lld.%09lld,%ld,%ld,%ld,%ld\n",
                     vma->pathname,
@@ -456,11 +1267,24 @@ void libkpac_init()
                     stat.aut.total, stat.aut.patched);
     }
 
-    for (struct kpac_routine *i = routine_own.prev; i != NULL; i = i->prev) {
-        size_t len = &__stop_text_kpac - &__start_text_kpac;
-        uintptr_t page = ALIGN_DOWN((uintptr_t) i, page_size);
+    free(sites);
+    sites = NULL;
 
-        if (mprotect((void *) page, len, PROT_READ | PROT_EXEC))
+    if (shadow)
+        munmap(shadow, shadow_size);
+
+    /* Whole islands, a part would split their huge pages.  With poke they
+     * were never writable. */
+    for (struct kpac_routine *i = routine_own.prev; i != NULL && !poking; i = i->prev) {
+        if (mprotect(i->base, i->size, PROT_READ | PROT_EXEC))
             die("mprotect: %s", strerror(errno));
     }
+    islands_sealed = true;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &init1);
+    timespec_diff(&init1, &init0, &init_diff);
+    libkpac_summary.init_ns = init_diff.tv_sec * 1000000000ULL + init_diff.tv_nsec;
+
+    /* Last, our own mprotect calls above are not JIT code */
+    jit_init();
 }
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "poke.h"
+
+static int mem_fd = -1;
+static long page_size;
+
+/* A write to a read-only page goes through, or poke is off */
+static bool poke_probe(void)
+{
+    uint32_t *page = mmap(NULL, page_size, PROT_READ | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+        return false;
+
+    uint32_t val = 0xD503201F;  /* nop */
+    bool ok = !poke(page, &val, sizeof(val)) && *page == val;
+
+    munmap(page, page_size);
+    return ok;
+}
+
+int poke_init(long size)
+{
+    char *write_env = getenv("LIBKPAC_WRITE");
+
+    page_size = size;
+    if (!write_env || strcmp(write_env, "mem"))
+        return 0;
+
+    mem_fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+    if (mem_fd == -1)
+        return -1;
+
+    if (!poke_probe()) {
+        close(mem_fd);
+        mem_fd = -1;
+        return 0;
+    }
+
+    return 1;
+}
+
+bool poke_enabled(void)
+{
+    return mem_fd != -1;
+}
+
+int poke(void *dst, const void *src, size_t len)
+{
+    while (len) {
+        ssize_t n = pwrite(mem_fd, src, len, (off_t) (uintptr_t) dst);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        dst = (char *) dst + n;
+        src = (const char *) src + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+long poke_changes(void *dst, const void *shadow, size_t len)
+{
+    uint32_t *d = dst;
+    const uint32_t *s = shadow;
+    size_t nr = len / sizeof(*d);
+    long writes = 0;
+
+    for (size_t i = 0; i < nr; ) {
+        if (d[i] == s[i]) {
+            i++;
+            continue;
+        }
+
+        /* The pages of the run are copied anyway, write the unchanged parts
+         * in between along instead of one by one */
+        size_t end = i + 1;
+        for (size_t j = end; j < nr; j++) {
+            if (d[j] == s[j])
+                continue;
+            if ((uintptr_t) &d[j] / page_size > (uintptr_t) &d[end - 1] / page_size + 1)
+                break;
+            end = j + 1;
+        }
+
+        if (poke(&d[i], &s[i], (end - i) * sizeof(*d)))
+            return -1;
+        writes++;
+        i = end;
+    }
+
+    return writes;
+}
+
+int text_write(void *dst, const void *src, size_t len)
+{
+    if (poke_enabled())
+        return poke(dst, src, len);
+
+    uintptr_t start = (uintptr_t) dst & ~(page_size - 1);
+    size_t size = (uintptr_t) dst + len - start;
+
+    if (mprotect((void *) start, size, PROT_READ | PROT_WRITE | PROT_EXEC))
+        return -1;
+
+    memcpy(dst, src, len);
+
+    return mprotect((void *) start, size, PROT_READ | PROT_EXEC);
+}
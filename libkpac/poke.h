@@ -0,0 +1,31 @@
+#ifndef LIBKPAC_POKE_H
+#define LIBKPAC_POKE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Writes to text that leave its protection alone (LIBKPAC_WRITE=mem).
+ *
+ * Making text writable for the patches and read-only again costs a TLB
+ * shootdown on every CPU the process has run on per downgrade, and leaves it
+ * writable and executable meanwhile.  Writes to /proc/self/mem go through a
+ * private copy of the page like those of a debugger, whatever the protection
+ * (FOLL_FORCE).  process_vm_writev is no alternative, it honours the
+ * protection.  Kernels booted with proc_mem.force_override=never refuse such
+ * writes, poke_init tries one and leaves poke off then.
+ */
+
+/* 1 if the writes go through /proc/self/mem, 0 if not, -1 on error */
+int poke_init(long page_size);
+bool poke_enabled(void);
+
+int poke(void *dst, const void *src, size_t len);
+/* Write the parts of [shadow, shadow + len) that differ from dst, runs on
+ * the same or adjacent pages together.  Returns the number of writes. */
+long poke_changes(void *dst, const void *shadow, size_t len);
+
+/* Write to text with poke, or by making its pages writable for the time */
+int text_write(void *dst, const void *src, size_t len);
+
+#endif                          /* LIBKPAC_POKE_H */
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <link.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sites.h"
+
+#define ALIGN_NOTE(x, a)	(((x) + (a) - 1) & ~((uintptr_t) (a) - 1))
+
+#define INST_MOV_X9_LR		0xAA1E03E9 /* MOV X9, X30 */
+#define INST_MOV_LR_X9		0xAA0903FE /* MOV X30, X9 */
+#define INST_MOV_X9_PAC_PL	0xD2B40009 /* MOV X9, #PAC_PL_BASE */
+
+extern const inst_t kpac_tmpl_kpacd_pac[], kpac_tmpl_kpacd_pac_end[];
+extern const inst_t kpac_tmpl_kpacd_aut[], kpac_tmpl_kpacd_aut_end[];
+extern const inst_t kpac_tmpl_pac_pl_pac[], kpac_tmpl_pac_pl_pac_end[];
+extern const inst_t kpac_tmpl_pac_pl_aut[], kpac_tmpl_pac_pl_aut_end[];
+extern const inst_t kpac_tmpl_pac_pl_tls[], kpac_tmpl_pac_pl_tls_end[];
+
+/* ldr x9, [x9] of the pac_pl_tls prefix */
+#define TMPL_PAC_PL_TLS_LDR	1
+
+struct site_table {
+    struct kpac_site *sites;
+    size_t count, size;
+};
+
+static bool site_add(struct site_table *table, inst_t *addr, unsigned type)
+{
+    if (table->count == table->size) {
+        size_t size = table->size ? 2 * table->size : 1024;
+        struct kpac_site *sites = realloc(table->sites, size * sizeof(*sites));
+        if (!sites)
+            return false;
+
+        table->sites = sites;
+        table->size = size;
+    }
+
+    table->sites[table->count].addr = addr;
+    table->sites[table->count].type = type;
+    table->count++;
+
+    return true;
+}
+
+/* Walk the notes of one loaded object and record its sites */
+static int collect_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+    struct site_table *table = data;
+
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE)
+            continue;
+
+        size_t align = phdr->p_align == 8 ? 8 : 4;
+        uintptr_t p = info->dlpi_addr + phdr->p_vaddr;
+        uintptr_t end = p + phdr->p_memsz;
+
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *note = (const ElfW(Nhdr) *) p;
+            const char *name = (const char *) (note + 1);
+            uintptr_t desc = ALIGN_NOTE((uintptr_t) name + note->n_namesz, align);
+
+            if (note->n_type == NT_KPAC_SITE &&
+                note->n_namesz == sizeof(NT_KPAC_NAME) &&
+                !memcmp(name, NT_KPAC_NAME, sizeof(NT_KPAC_NAME))) {
+
+                const int32_t *off = (const int32_t *) desc;
+                const uint32_t *type = (const uint32_t *) (desc + 4);
+
+                if (!site_add(table, (inst_t *) (desc + *off), *type))
+                    return -1;
+            }
+
+            p = ALIGN_NOTE(desc + note->n_descsz, align);
+        }
+    }
+
+    return 0;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+    const struct kpac_site *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* Collect the sites of all loaded objects, sorted by address */
+ssize_t sites_collect(struct kpac_site **sites)
+{
+    struct site_table table = { 0 };
+
+    if (dl_iterate_phdr(collect_object, &table)) {
+        free(table.sites);
+        return -1;
+    }
+
+    qsort(table.sites, table.count, sizeof(*table.sites), site_cmp);
+    *sites = table.sites;
+
+    return table.count;
+}
+
+/* Offset of the thread's pac-pl channel if several channels share the sites
+ * and the ldr of the templates reaches it, otherwise -1 */
+static long pl_tls_offset(void)
+{
+    long off = channel_tls();
+
+    if (off < 0 || off % 8 || off / 8 > 0xFFF)
+        return -1;
+
+    return off;
+}
+
+static void template(int backend, unsigned type, const inst_t **begin, const inst_t **end)
+{
+    *begin = *end = NULL;
+
+    switch (backend) {
+    case BACKEND_KPACD:
+        *begin = type == SITE_PAC ? kpac_tmpl_kpacd_pac : kpac_tmpl_kpacd_aut;
+        *end = type == SITE_PAC ? kpac_tmpl_kpacd_pac_end : kpac_tmpl_kpacd_aut_end;
+        break;
+    case BACKEND_PAC_PL:
+        *begin = type == SITE_PAC ? kpac_tmpl_pac_pl_pac : kpac_tmpl_pac_pl_aut;
+        *end = type == SITE_PAC ? kpac_tmpl_pac_pl_pac_end : kpac_tmpl_pac_pl_aut_end;
+        break;
+    }
+}
+
+/* Copy the template to shadow, returns its length or 0 if it does not fit.
+ * With several pac-pl channels, the mov of PAC_PL_BASE is replaced by the
+ * pac_pl_tls prefix. */
+static size_t template_copy(int backend, unsigned type, inst_t *shadow)
+{
+    const inst_t *tmpl, *tmpl_end;
+    size_t len, prefix = 0;
+
+    template(backend, type, &tmpl, &tmpl_end);
+    if (!tmpl)
+        return 0;
+
+    if (backend == BACKEND_PAC_PL && pl_tls_offset() >= 0 && tmpl[0] == INST_MOV_X9_PAC_PL) {
+        prefix = kpac_tmpl_pac_pl_tls_end - kpac_tmpl_pac_pl_tls;
+        tmpl++;
+    }
+
+    len = prefix + (tmpl_end - tmpl);
+    if (len > SITE_LEN)
+        return 0;
+
+    memcpy(shadow, kpac_tmpl_pac_pl_tls, prefix * sizeof(inst_t));
+    memcpy(shadow + prefix, tmpl, (tmpl_end - tmpl) * sizeof(inst_t));
+    if (prefix)
+        shadow[TMPL_PAC_PL_TLS_LDR] |= (pl_tls_offset() / 8) << 10;
+
+    return len;
+}
+
+/* Call a trampoline of the trace variant instead of the inline sequence,
+ * written to shadow */
+static bool patch_call(inst_t *site, inst_t *shadow, unsigned type, site_call_t call)
+{
+    void *target = call(site, type);
+    if (!target)
+        return false;
+
+    shadow[0] = INST_MOV_X9_LR;
+    emit_bl_at(&shadow[1], &site[1], target);
+    shadow[2] = INST_MOV_LR_X9;
+
+    return true;
+}
+
+/* Rewrite the sites within [start, end) to the backend.  The writes go to
+ * the copy of the range at start + bias, which has to be writable.  With
+ * call, the sites branch to the trampolines it returns.  Returns the number
+ * of sites patched. */
+size_t sites_patch(struct kpac_site *sites, size_t nr_sites,
+                   uintptr_t start, uintptr_t end, intptr_t bias,
+                   int backend, site_call_t call)
+{
+    size_t lo = 0, hi = nr_sites, patched = 0;
+
+    if (backend == BACKEND_SYSCALL)
+        return 0;
+
+    /* First site at or above start */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t) sites[mid].addr < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i < nr_sites && (uintptr_t) sites[i].addr < end; i++) {
+        inst_t *shadow = (inst_t *) ((uintptr_t) sites[i].addr + bias);
+
+        if (call && patch_call(sites[i].addr, shadow, sites[i].type, call)) {
+            __builtin___clear_cache((char *) shadow, (char *) (shadow + SITE_LEN));
+            patched++;
+            continue;
+        }
+
+        if (!template_copy(backend, sites[i].type, shadow))
+            continue;
+        __builtin___clear_cache((char *) shadow, (char *) (shadow + SITE_LEN));
+        patched++;
+    }
+
+    return patched;
+}
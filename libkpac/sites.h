@@ -0,0 +1,41 @@
+#ifndef LIBKPAC_SITES_H
+#define LIBKPAC_SITES_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "asm.h"
+#include "channel.h"
+
+/* Keep in sync with gcc/asm/patchable/common.h */
+#define NT_KPAC_SITE		1
+#define NT_KPAC_NAME		"KPAC"
+
+#define SITE_PAC		1
+#define SITE_AUT		2
+#define SITE_LEN		10
+
+/* Mailbox addresses, used to detect the available backend, PAC_PL_BASE is
+ * in channel.h */
+#define KPACD_BASE		0x9AC00000000UL
+
+enum {
+    BACKEND_SYSCALL,
+    BACKEND_KPACD,
+    BACKEND_PAC_PL,
+};
+
+struct kpac_site {
+    inst_t *addr;
+    unsigned type;
+};
+
+ssize_t sites_collect(struct kpac_site **sites);
+/* Returns the routine a traced site calls, NULL if there is none in range */
+typedef void *(*site_call_t)(inst_t *site, unsigned type);
+
+size_t sites_patch(struct kpac_site *sites, size_t nr_sites,
+                   uintptr_t start, uintptr_t end, intptr_t bias,
+                   int backend, site_call_t call);
+
+#endif                          /* LIBKPAC_SITES_H */
@@ -0,0 +1,21 @@
+#ifndef LIBKPAC_SUMMARY_H
+#define LIBKPAC_SUMMARY_H
+
+#include <stdint.h>
+
+/* Totals of libkpac_init, exported as libkpac_summary for benchmarks which
+ * look it up with dlsym(RTLD_DEFAULT, ...) */
+struct libkpac_summary {
+    uint64_t init_ns;           /* Whole constructor */
+    long vmas;                  /* Executable areas patched */
+    long islands;               /* Trampoline copies allocated */
+    long sites;                 /* Patchable sites of the plugin */
+    long pac_total, pac_patched;
+    long aut_total, aut_patched;
+    long huge_vmas;             /* Text remapped onto huge pages */
+    long jit_regions;           /* Patched after startup, see jit.h */
+    long text_writes;           /* To /proc/self/mem, see poke.h */
+    long stubs;                 /* pacia1716/autia1716 stubs */
+};
+
+#endif                          /* LIBKPAC_SUMMARY_H */
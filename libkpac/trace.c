@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "poke.h"
+#include "trace.h"
+
+#define TRACE_PERIOD_DEFAULT	1024
+
+/* Slot in text_kpac read by the trampolines, only in the trace variant.  It
+ * is copied with the trampolines, so it has to be set before they are. */
+extern struct kpac_trace_hdr *kpac_trace_slot __attribute__ ((weak));
+
+static __thread struct kpac_trace_thread trace_thread
+    __attribute__ ((tls_model("initial-exec")));
+
+static uint64_t cntfrq(void)
+{
+    uint64_t freq = 0;
+#ifdef __aarch64__
+    asm volatile ("mrs %0, cntfrq_el0" : "=r" (freq));
+#endif
+    return freq;
+}
+
+/* Keep a copy of our mappings to resolve the sites later */
+static int copy_maps(const char *path)
+{
+    char *maps_path, buf[4096];
+    ssize_t len;
+    int ret = -1;
+
+    if (asprintf(&maps_path, "%s.maps", path) == -1)
+        return -1;
+
+    int in = open("/proc/self/maps", O_RDONLY);
+    int out = open(maps_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(maps_path);
+    if (in == -1 || out == -1)
+        goto out;
+
+    while ((len = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, len) != len)
+            goto out;
+    ret = len;
+
+out:
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+    return ret;
+}
+
+static struct kpac_trace_hdr *trace_map(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return NULL;
+
+    if (ftruncate(fd, TRACE_SIZE)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct kpac_trace_hdr *hdr = mmap(NULL, TRACE_SIZE, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED)
+        return NULL;
+
+    char *period = getenv("LIBKPAC_TRACE_PERIOD");
+
+    hdr->version = TRACE_VERSION;
+    hdr->ring_entries = TRACE_RING_ENTRIES;
+    hdr->period = period ? strtoull(period, NULL, 0) : TRACE_PERIOD_DEFAULT;
+    hdr->tls = (char *) &trace_thread - (char *) __builtin_thread_pointer();
+    hdr->cntfrq = cntfrq();
+    hdr->pid = getpid();
+
+    /* Valid from here on */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+
+    return hdr;
+}
+
+int trace_init(void)
+{
+    char *path = getenv("LIBKPAC_TRACE");
+    struct kpac_trace_hdr *hdr;
+
+    if (!&kpac_trace_slot) {
+        if (path)
+            fprintf(stderr, "libkpac: LIBKPAC_TRACE needs libkpac-kpacd-trace.so\n");
+        return 0;
+    }
+
+    /* The slot stays NULL and the trampolines skip tracing */
+    if (!path)
+        return 0;
+
+    hdr = trace_map(path);
+    if (!hdr || copy_maps(path) == -1)
+        return -1;
+
+    if (text_write(&kpac_trace_slot, &hdr, sizeof(hdr)))
+        return -1;
+
+    return 1;
+}
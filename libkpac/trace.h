@@ -0,0 +1,83 @@
+#ifndef LIBKPAC_TRACE_H
+#define LIBKPAC_TRACE_H
+
+/*
+ * Sampled PAC latency tracing of libkpac-kpacd-trace.so.
+ *
+ * With LIBKPAC_TRACE=<file>, every LIBKPAC_TRACE_PERIOD-th pac/aut of a thread
+ * is timed with the virtual counter and recorded in a ring of that thread in
+ * the shared file:
+ *
+ *   0                 struct kpac_trace_hdr
+ *   TRACE_HEADS_OFF   TRACE_RINGS ring heads, one cache line each
+ *   TRACE_RINGS_OFF   TRACE_RINGS rings of TRACE_RING_ENTRIES entries
+ *
+ * A thread claims a ring with its first sample and keeps it, threads beyond
+ * TRACE_RINGS are not sampled.  The writer stores the entry, then the head
+ * with release semantics; rings wrap and a slow reader loses old entries.
+ * The period can be changed at run time, 0 stops sampling.  Without
+ * LIBKPAC_TRACE a trampoline pays one PC-relative load; with it but a period
+ * of 0 it also branches out of line to load the period.
+ */
+
+#define TRACE_MAGIC		"KPACTRC"
+#define TRACE_VERSION		1
+
+#define TRACE_RINGS		64
+#define TRACE_HEAD_SHIFT	6
+#define TRACE_ENTRY_SHIFT	4
+#define TRACE_RING_SHIFT	16
+#define TRACE_RING_ENTRIES	(1 << (TRACE_RING_SHIFT - TRACE_ENTRY_SHIFT))
+
+#define TRACE_HEADS_OFF		4096
+#define TRACE_RINGS_OFF		8192
+#define TRACE_SIZE		(TRACE_RINGS_OFF + (TRACE_RINGS << TRACE_RING_SHIFT))
+
+/* Offsets used by kpacd.S */
+#define TRACE_PERIOD		16
+#define TRACE_TLS		24
+#define TRACE_NEXT_RING		32
+
+#define THREAD_COUNTDOWN	0
+#define THREAD_RING		8
+#define THREAD_HEAD		16
+
+#define ENTRY_SITE		0
+#define ENTRY_OP		8
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+struct kpac_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t ring_entries;
+    uint64_t period;            /* Sample every period-th operation */
+    int64_t tls;                /* Thread pointer to struct kpac_trace_thread */
+    uint64_t next_ring;         /* Rings claimed, may exceed TRACE_RINGS */
+    uint64_t cntfrq;            /* Ticks per second */
+    uint64_t pid;
+};
+
+struct kpac_trace_entry {
+    uint64_t site;              /* Branch into the trampoline */
+    uint32_t op;                /* OP_PAC or OP_AUT */
+    uint32_t ticks;
+};
+
+struct kpac_trace_thread {
+    uint64_t countdown;
+    struct kpac_trace_entry *ring;
+    uint64_t *head;
+};
+
+_Static_assert(__builtin_offsetof(struct kpac_trace_hdr, period) == TRACE_PERIOD, "");
+_Static_assert(__builtin_offsetof(struct kpac_trace_hdr, tls) == TRACE_TLS, "");
+_Static_assert(__builtin_offsetof(struct kpac_trace_hdr, next_ring) == TRACE_NEXT_RING, "");
+_Static_assert(sizeof(struct kpac_trace_entry) == 1 << TRACE_ENTRY_SHIFT, "");
+
+/* Set up tracing before any trampoline is copied, 1 if tracing is on */
+int trace_init(void);
+#endif
+
+#endif                          /* LIBKPAC_TRACE_H */
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+
+# Read the trace file of libkpac-kpacd-trace.so (LIBKPAC_TRACE, see trace.h)
+# while the program runs: latency histograms of pac and aut and the slowest
+# sites, resolved with the copy of the program's mappings (<file>.maps).
+
+import argparse
+import bisect
+import mmap
+import os
+import struct
+import sys
+import time
+
+from collections import defaultdict
+
+# Keep in sync with trace.h
+MAGIC = b"KPACTRC\0"
+HDR = struct.Struct("<8sIIQqQQQ")
+ENTRY = struct.Struct("<QII")
+PERIOD_OFF = 16
+RINGS = 64
+HEADS_OFF = 4096
+HEAD_SHIFT = 6
+RINGS_OFF = 8192
+RING_SHIFT = 16
+
+OPS = {1: "pac", 2: "aut"}
+
+class Maps:
+    def __init__(self, path):
+        self.vmas = []
+        try:
+            with open(path) as f:
+                for line in f:
+                    fields = line.split(maxsplit=5)
+                    if len(fields) < 6 or "x" not in fields[1]:
+                        continue
+                    start, end = (int(x, 16) for x in fields[0].split("-"))
+                    self.vmas.append((start, end, int(fields[2], 16), fields[5].strip()))
+        except FileNotFoundError:
+            pass
+        self.vmas.sort()
+        self.starts = [v[0] for v in self.vmas]
+
+    def resolve(self, addr):
+        i = bisect.bisect_right(self.starts, addr) - 1
+        if i >= 0 and addr < self.vmas[i][1]:
+            start, _, offset, path = self.vmas[i]
+            return f"{os.path.basename(path)}+{addr - start + offset:#x}"
+        return f"{addr:#x}"
+
+class Reader:
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.mm = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+
+        magic, version, self.ring_entries, _, _, _, cntfrq, pid = HDR.unpack_from(self.mm)
+        if magic != MAGIC or version != 1:
+            sys.exit(f"{path}: not a trace file")
+
+        self.ns_per_tick = 1e9 / cntfrq if cntfrq else 1.0
+        self.pid = pid
+        self.tails = [0] * RINGS
+        self.lost = 0
+
+    def period(self):
+        return HDR.unpack_from(self.mm)[3]
+
+    @staticmethod
+    def set_period(path, period):
+        with open(path, "r+b") as f:
+            f.seek(PERIOD_OFF)
+            f.write(struct.pack("<Q", period))
+
+    def poll(self):
+        """Yield (site, op, ns) of the entries written since the last poll"""
+        for ring in range(RINGS):
+            head = struct.unpack_from("<Q", self.mm, HEADS_OFF + (ring << HEAD_SHIFT))[0]
+            tail = self.tails[ring]
+            if head - tail > self.ring_entries:
+                self.lost += head - tail - self.ring_entries
+                tail = head - self.ring_entries
+
+            base = RINGS_OFF + (ring << RING_SHIFT)
+            for i in range(tail, head):
+                off = base + (i % self.ring_entries) * ENTRY.size
+                site, op, ticks = ENTRY.unpack_from(self.mm, off)
+                yield site, op, ticks * self.ns_per_tick
+
+            self.tails[ring] = head
+
+class Stats:
+    def __init__(self):
+        self.hist = {op: defaultdict(int) for op in OPS.values()}
+        self.sites = defaultdict(list)
+
+    def add(self, site, op, ns):
+        op = OPS.get(op, str(op))
+        self.hist.setdefault(op, defaultdict(int))[max(int(ns), 1).bit_length()] += 1
+        self.sites[(site, op)].append(ns)
+
+    def print(self, maps, top, out):
+        for op, hist in self.hist.items():
+            total = sum(hist.values())
+            out.write(f"{op}: {total} samples\n")
+            if not total:
+                continue
+            peak = max(hist.values())
+            for b in range(min(hist), max(hist) + 1):
+                n = hist.get(b, 0)
+                bar = "#" * (50 * n // peak)
+                out.write(f"  {1 << (b - 1):>8} ns {n:>10} {bar}\n")
+
+        def p99(samples):
+            return sorted(samples)[int(len(samples) * 0.99)]
+
+        ranked = sorted(self.sites.items(), key=lambda kv: p99(kv[1]), reverse=True)
+        out.write("\nslowest sites (p99):\n")
+        out.write(f"  {'site':<40} {'op':<4} {'samples':>8} {'p50 ns':>10} {'p99 ns':>10} {'max ns':>10}\n")
+        for (site, op), samples in ranked[:top]:
+            s = sorted(samples)
+            out.write(f"  {maps.resolve(site):<40} {op:<4} {len(s):>8} "
+                      f"{s[len(s) // 2]:>10.0f} {p99(s):>10.0f} {s[-1]:>10.0f}\n")
+
+def main():
+    parser = argparse.ArgumentParser(description="Show the PAC latencies traced by libkpac.")
+    parser.add_argument("file", help="LIBKPAC_TRACE of the program")
+    parser.add_argument("-i", "--interval", type=float, default=1.0,
+                        help="seconds between updates, 0 to read once")
+    parser.add_argument("-t", "--top", type=int, default=10)
+    parser.add_argument("-r", "--reset", action="store_true",
+                        help="start over after every update")
+    parser.add_argument("-p", "--period", type=int,
+                        help="change the sampling period of the program, 0 stops sampling")
+    args = parser.parse_args()
+
+    if args.period is not None:
+        Reader.set_period(args.file, args.period)
+
+    reader = Reader(args.file)
+    maps = Maps(args.file + ".maps")
+    stats = Stats()
+
+    while True:
+        for sample in reader.poll():
+            stats.add(*sample)
+
+        if args.interval:
+            sys.stdout.write("\033[H\033[J")
+        sys.stdout.write(f"pid {reader.pid}, period {reader.period()}, lost {reader.lost}\n\n")
+        stats.print(maps, args.top, sys.stdout)
+        sys.stdout.flush()
+
+        if not args.interval:
+            break
+        if args.reset:
+            stats = Stats()
+        try:
+            time.sleep(args.interval)
+        except KeyboardInterrupt:
+            break
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unwind.h>
+
+#include "asm.h"
+#include "interpose.h"
+#include "unwind.h"
+
+/*
+ * Exception unwinding through signed frames.
+ *
+ * The CFI of signed functions carries the RA signing state (negate_ra_state).
+ * libgcc authenticates the return address of such a frame with AUTIA1716 and
+ * the CFA as modifier before looking up the caller, and strips the PAC with
+ * XPACLRI only from its own return address.  Both are NOPs without
+ * FEAT_PAuth and are rewritten by libkpac, AUTIA1716 to a call of the
+ * backend (see patch_1716), a round trip per frame.
+ *
+ * In libgcc_s, whose entry points are interposed below, and where no stub
+ * was left, AUTIA1716 only strips instead, which would accept any forged
+ * return address.  Then the frames are walked once per exception before
+ * libgcc unwinds them, up to the handler once libgcc found it, and their
+ * signed return addresses are authenticated in batches of one request each
+ * (kpac_aut_frames).  Which frames are signed is read from their CFI, so an
+ * unsigned return address put into a signed frame fails as well.
+ *
+ * longjmp needs nothing of this: it restores the SP and the unsigned LR saved
+ * by setjmp, and the skipped frames never return.
+ */
+
+#define NR_FRAMES		256
+
+struct unwind_walk {
+    struct kpac_frame frames[NR_FRAMES];
+    uintptr_t expected[NR_FRAMES];
+    size_t nr_frames;
+
+    uintptr_t callee_cfa;       /* CFA of the previous frame, 0 for the first */
+    uintptr_t callee_pc;        /* Where the previous frame is in its function */
+    uintptr_t handler;          /* Frame to stop at (private_2), 0 for none */
+};
+
+static uintptr_t va_mask = UINTPTR_MAX;
+static bool stripped = false;
+
+/* Exception of this thread whose frames were verified last */
+static __thread struct _Unwind_Exception *verified;
+
+void unwind_init(int va_bits)
+{
+    va_mask = (1UL << va_bits) - 1;
+}
+
+void unwind_stripped(void)
+{
+    stripped = true;
+}
+
+bool unwind_object(const char *pathname)
+{
+    const char *name = strrchr(pathname, '/');
+
+    return !strncmp(name ? name + 1 : pathname, "libgcc_s.so", 11);
+}
+
+/*
+ * RA signing state from the CFI, see the DWARF standard (6.4) and the AArch64
+ * DWARF ABI for DW_CFA_AARCH64_negate_ra_state
+ */
+#define DW_CFA_set_loc				0x01
+#define DW_CFA_advance_loc1			0x02
+#define DW_CFA_advance_loc2			0x03
+#define DW_CFA_advance_loc4			0x04
+#define DW_CFA_remember_state			0x0a
+#define DW_CFA_restore_state			0x0b
+#define DW_CFA_def_cfa_expression		0x0f
+#define DW_CFA_expression			0x10
+#define DW_CFA_val_expression			0x16
+#define DW_CFA_AARCH64_negate_ra_state		0x2d
+#define DW_CFA_GNU_args_size			0x2e
+#define DW_CFA_GNU_negative_offset_extended	0x2f
+
+#define DW_EH_PE_omit				0xff
+
+#define RA_STATES				16
+
+/* _Unwind_Find_FDE of libgcc_s, not declared by unwind.h */
+struct dwarf_eh_bases {
+    void *tbase;
+    void *dbase;
+    void *func;
+};
+
+extern const void *_Unwind_Find_FDE(void *pc, struct dwarf_eh_bases *bases);
+
+struct cie {
+    const uint8_t *insns, *end;
+    uint64_t code_align;
+    uint8_t fde_enc;
+    bool aug_data;              /* 'z' */
+};
+
+static uint64_t read_uleb(const uint8_t **p)
+{
+    uint64_t val = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = *(*p)++;
+        if (shift < 64)
+            val |= (uint64_t) (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return val;
+}
+
+/* Skips what read_uleb reads, the signed form as well */
+static void skip_leb(const uint8_t **p)
+{
+    while (*(*p)++ & 0x80)
+        ;
+}
+
+static uint64_t read_u(const uint8_t **p, size_t size)
+{
+    uint64_t val = 0;
+
+    memcpy(&val, *p, size);
+    *p += size;
+
+    return val;
+}
+
+/* Skip a pointer of DW_EH_PE encoding enc, false if that is not possible */
+static bool skip_encoded(const uint8_t **p, uint8_t enc)
+{
+    if (enc == DW_EH_PE_omit)
+        return true;
+
+    switch (enc & 0x0F) {
+    case 0x00:                  /* absptr */
+    case 0x04:                  /* udata8 */
+    case 0x0C:                  /* sdata8 */
+        *p += 8;
+        return true;
+    case 0x01:                  /* uleb128 */
+    case 0x09:                  /* sleb128 */
+        skip_leb(p);
+        return true;
+    case 0x02:                  /* udata2 */
+    case 0x0A:                  /* sdata2 */
+        *p += 2;
+        return true;
+    case 0x03:                  /* udata4 */
+    case 0x0B:                  /* sdata4 */
+        *p += 4;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool cie_parse(const uint8_t *p, struct cie *cie)
+{
+    uint32_t len = read_u(&p, 4);
+    if (len == 0xFFFFFFFF)
+        return false;
+    cie->end = p + len;
+
+    p += 4;                     /* CIE id */
+    uint8_t version = *p++;
+    const char *aug = (const char *) p;
+    p += strlen(aug) + 1;
+
+    if (version >= 4)
+        p += 2;                 /* address_size, segment_size */
+    cie->code_align = read_uleb(&p);
+    skip_leb(&p);               /* data_alignment_factor */
+    if (version == 1)
+        p++;
+    else
+        skip_leb(&p);           /* return_address_register */
+
+    cie->fde_enc = 0;
+    cie->aug_data = aug[0] == 'z';
+    if (!cie->aug_data) {
+        cie->insns = p;
+        return !aug[0];
+    }
+
+    uint64_t aug_len = read_uleb(&p);
+    cie->insns = p + aug_len;
+
+    for (aug++; *aug; aug++) {
+        switch (*aug) {
+        case 'R':
+            cie->fde_enc = *p++;
+            break;
+        case 'L':
+            p++;
+            break;
+        case 'P':
+            if (!skip_encoded(&p, *p++))
+                return false;
+            break;
+        case 'S':
+        case 'B':
+        case 'G':
+            break;
+        default:
+            /* The rest of the augmentation is not known, but the FDE
+             * encoding is all we need */
+            return true;
+        }
+    }
+
+    return true;
+}
+
+/* Run the CFA instructions from p to end for loc up to pc, toggling *state at
+ * negate_ra_state.  -1 on what it cannot decode, 1 once past pc, else 0. */
+static int ra_state_run(const uint8_t *p, const uint8_t *end, const struct cie *cie,
+                        uintptr_t *loc, uintptr_t pc, bool *state)
+{
+    bool saved[RA_STATES];
+    size_t depth = 0;
+    uint64_t delta;
+
+    while (p < end) {
+        uint8_t op = *p++;
+
+        switch (op >> 6) {
+        case 1:                 /* advance_loc */
+            delta = op & 0x3F;
+            goto advance;
+        case 2:                 /* offset */
+            skip_leb(&p);
+            continue;
+        case 3:                 /* restore */
+            continue;
+        }
+
+        switch (op) {
+        case DW_CFA_set_loc:
+            return -1;
+        case DW_CFA_advance_loc1:
+            delta = read_u(&p, 1);
+            goto advance;
+        case DW_CFA_advance_loc2:
+            delta = read_u(&p, 2);
+            goto advance;
+        case DW_CFA_advance_loc4:
+            delta = read_u(&p, 4);
+            goto advance;
+        case DW_CFA_remember_state:
+            if (depth == RA_STATES)
+                return -1;
+            saved[depth++] = *state;
+            continue;
+        case DW_CFA_restore_state:
+            if (!depth)
+                return -1;
+            *state = saved[--depth];
+            continue;
+        case DW_CFA_AARCH64_negate_ra_state:
+            *state = !*state;
+            continue;
+        case 0x00:              /* nop */
+            continue;
+        case 0x06:              /* restore_extended */
+        case 0x07:              /* undefined */
+        case 0x08:              /* same_value */
+        case 0x0d:              /* def_cfa_register */
+        case 0x0e:              /* def_cfa_offset */
+        case 0x13:              /* def_cfa_offset_sf */
+        case DW_CFA_GNU_args_size:
+            skip_leb(&p);
+            continue;
+        case 0x05:              /* offset_extended */
+        case 0x09:              /* register */
+        case 0x0c:              /* def_cfa */
+        case 0x11:              /* offset_extended_sf */
+        case 0x12:              /* def_cfa_sf */
+        case 0x14:              /* val_offset */
+        case 0x15:              /* val_offset_sf */
+        case DW_CFA_GNU_negative_offset_extended:
+            skip_leb(&p);
+            skip_leb(&p);
+            continue;
+        case DW_CFA_expression:
+        case DW_CFA_val_expression:
+            skip_leb(&p);
+            /* fall through */
+        case DW_CFA_def_cfa_expression:
+            delta = read_uleb(&p);
+            p += delta;
+            continue;
+        default:
+            return -1;
+        }
+
+advance:
+        *loc += delta * cie->code_align;
+        if (*loc > pc)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Whether the CFI says the return address is signed at pc, -1 if there is
+ * none or it cannot be decoded */
+static int ra_signed(uintptr_t pc)
+{
+    struct dwarf_eh_bases bases;
+    struct cie cie;
+    bool state = false;
+
+    const uint8_t *fde = _Unwind_Find_FDE((void *) pc, &bases);
+    if (!fde)
+        return -1;
+
+    const uint8_t *p = fde;
+    uint32_t len = read_u(&p, 4);
+    if (len == 0xFFFFFFFF)
+        return -1;
+    const uint8_t *end = p + len;
+
+    /* The CIE pointer counts back from itself */
+    const uint8_t *id = p;
+    if (!cie_parse(id - read_u(&p, 4), &cie))
+        return -1;
+
+    if (!skip_encoded(&p, cie.fde_enc) || !skip_encoded(&p, cie.fde_enc & 0x0F))
+        return -1;
+    if (cie.aug_data) {
+        uint64_t aug_len = read_uleb(&p);
+        p += aug_len;
+    }
+
+    uintptr_t loc = (uintptr_t) bases.func;
+    int ret = ra_state_run(cie.insns, cie.end, &cie, &loc, pc, &state);
+    if (!ret)
+        ret = ra_state_run(p, end, &cie, &loc, pc, &state);
+
+    return ret == -1 ? -1 : state;
+}
+
+static void walk_flush(struct unwind_walk *walk)
+{
+    kpac_aut_frames(walk->frames, walk->nr_frames);
+
+    for (size_t i = 0; i < walk->nr_frames; i++) {
+        if (walk->frames[i].ptr != walk->expected[i]) {
+            fprintf(stderr, "libkpac: return address %#lx failed authentication "
+                    "during unwinding\n", (unsigned long) walk->expected[i]);
+            abort();
+        }
+    }
+
+    walk->nr_frames = 0;
+}
+
+static _Unwind_Reason_Code walk_frame(struct _Unwind_Context *ctx, void *data)
+{
+    struct unwind_walk *walk = data;
+    int signal;
+    uintptr_t ip = _Unwind_GetIPInfo(ctx, &signal);
+
+    /* LR as restored from the callee's frame, before libgcc stripped it.  The
+     * callee signed it with its SP at entry, that is its CFA.  Where its CFI
+     * cannot tell, a return address with a PAC is taken as signed. */
+    if (walk->callee_cfa) {
+        uintptr_t lr = _Unwind_GetGR(ctx, REG_LR);
+        int sign = ra_signed(walk->callee_pc);
+
+        if (sign == 1 || (sign == -1 && lr != ip && (lr & va_mask) == ip)) {
+            walk->frames[walk->nr_frames].ptr = lr;
+            walk->frames[walk->nr_frames].modifier = walk->callee_cfa;
+            walk->expected[walk->nr_frames] = ip;
+
+            if (++walk->nr_frames == NR_FRAMES)
+                walk_flush(walk);
+        }
+    }
+
+    walk->callee_cfa = _Unwind_GetCFA(ctx);
+    /* The return address is past the call, unless this is a signal frame */
+    walk->callee_pc = ip - (signal == 0);
+
+    /* The handler's own return address is not used to unwind, libgcc
+     * identifies frames as their CFA minus one for signal frames */
+    if (walk->handler && walk->callee_cfa - (signal != 0) == walk->handler)
+        return _URC_END_OF_STACK;
+
+    return _URC_NO_REASON;
+}
+
+/* Once per exception: the phase 1 search of _Unwind_RaiseException walks the
+ * whole stack anyway, the cleanups resumed afterwards only what is left of
+ * it.  handler: private_2 of exc, where libgcc found a handler (0 if not yet) */
+static void unwind_verify(struct _Unwind_Exception *exc, uintptr_t handler)
+{
+    struct unwind_walk walk;
+
+    if (!stripped || exc == verified)
+        return;
+
+    walk.nr_frames = 0;
+    walk.callee_cfa = 0;
+    walk.callee_pc = 0;
+    walk.handler = handler;
+
+    _Unwind_Backtrace(walk_frame, &walk);
+    if (walk.nr_frames)
+        walk_flush(&walk);
+
+    verified = exc;
+}
+
+_Unwind_Reason_Code _Unwind_RaiseException(struct _Unwind_Exception *exc)
+{
+    /* A new search, even if exc was thrown before */
+    verified = NULL;
+    unwind_verify(exc, 0);
+    return real(_Unwind_RaiseException)(exc);
+}
+
+_Unwind_Reason_Code _Unwind_Resume_or_Rethrow(struct _Unwind_Exception *exc)
+{
+    verified = NULL;
+    unwind_verify(exc, 0);
+    return real(_Unwind_Resume_or_Rethrow)(exc);
+}
+
+_Unwind_Reason_Code _Unwind_ForcedUnwind(struct _Unwind_Exception *exc,
+                                         _Unwind_Stop_Fn stop, void *arg)
+{
+    verified = NULL;
+    unwind_verify(exc, 0);
+    return real(_Unwind_ForcedUnwind)(exc, stop, arg);
+}
+
+void _Unwind_Resume(struct _Unwind_Exception *exc)
+{
+    /* private_1 is the stop function of a forced unwind, which has no
+     * handler frame */
+    unwind_verify(exc, exc->private_1 ? 0 : exc->private_2);
+    real(_Unwind_Resume)(exc);
+    __builtin_unreachable();
+}
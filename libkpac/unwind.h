@@ -0,0 +1,33 @@
+#ifndef LIBKPAC_UNWIND_H
+#define LIBKPAC_UNWIND_H
+
+/* pacia1716/autia1716 stubs in text_kpac, see patch_1716 */
+#define KPAC_NR_STUBS		32
+#define KPAC_STUB_LEN		4
+
+#ifndef __ASSEMBLER__
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A signed return address and the modifier (SP at function entry) it was
+ * signed with, replaced in place by the authenticated address */
+struct kpac_frame {
+    uint64_t ptr;
+    uint64_t modifier;
+};
+
+/* Backend specific, see kpacd.S and pac-pl.S */
+void kpac_aut_frames(struct kpac_frame *frames, size_t nr_frames);
+
+/* Whether pathname is the unwinder whose entry points are interposed, where
+ * autia1716 is stripped and the stack verified in batches instead */
+bool unwind_object(const char *pathname);
+
+void unwind_init(int va_bits);
+/* An autia1716 was stripped instead of authenticated, verify the stack
+ * before unwinding from now on */
+void unwind_stripped(void);
+#endif
+
+#endif                          /* LIBKPAC_UNWIND_H */
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <signal.h>
+#include <ucontext.h>
 #include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -9,7 +12,20 @@
 
 #define PAC_PL_ADDR	0xA0000000UL
 #define PAC_PL_TARGET	0x9FFFF000UL /* puts user part to 0xA0000000 */
-#define PAC_PL_LEN	0x2000UL
+#define PAC_PL_PAGE	0x1000UL
+
+/* Windows of the channels, one page each from PAC_PL_ADDR + PAC_PL_PAGE on
+ * the bus and from PAC_PL_TARGET + PAC_PL_PAGE in user space */
+#define PAC_PL_CHANNELS_MAX	64
+
+#define PAC_PL_MAGIC_CTRL	0xDEADBEEFDEADBEEE
+#define PAC_PL_MAGIC_CHAN	0xDEADBEEEDEADBEEF
+
+/* Registers of a channel */
+#define PAC_PL_PLAIN	0
+#define PAC_PL_TWEAK	1
+#define PAC_PL_CIPHER	2
+#define PAC_PL_MAGIC	3
 
 #define die(fmt, ...)                                                   \
     do {                                                                \
@@ -18,24 +34,170 @@
         exit(EXIT_FAILURE);                                             \
     } while (0)
 
-__attribute__ ((constructor))
-void pac_pl_init()
+static unsigned long nr_channels = 1;
+
+static void pac_pl_map(void)
 {
     uintptr_t pac_pl_base = PAC_PL_ADDR;
     uintptr_t pac_pl_target = PAC_PL_TARGET;
+    size_t len = (1 + nr_channels) * PAC_PL_PAGE;
 
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
     if (fd == -1)
         die("open(/dev/mem): %s", strerror(errno));
 
-    void *addr = mmap((void *) pac_pl_target, PAC_PL_LEN, PROT_READ | PROT_WRITE,
+    void *addr = mmap((void *) pac_pl_target, len, PROT_READ | PROT_WRITE,
                       MAP_SHARED | MAP_POPULATE | MAP_FIXED, fd, pac_pl_base);
     if (addr == MAP_FAILED)
         die("mmap(/dev/mem): %s", strerror(errno));
 
     /* Test magic values */
     uint64_t *dev = addr;
-    if (dev[3] != 0xDEADBEEFDEADBEEE ||
-        dev[512+3] != 0xDEADBEEEDEADBEEF)
+    if (dev[3] != PAC_PL_MAGIC_CTRL)
         die("device test failed");
+    for (unsigned long i = 1; i <= nr_channels; i++)
+        if (dev[512*i + 3] != PAC_PL_MAGIC_CHAN)
+            die("device test failed on channel %lu", i - 1);
+}
+
+/*
+ * Simulated device (PAC_PL_SIM=1)
+ *
+ * The channel windows are mapped inaccessible and every access traps into
+ * sim_fault, which emulates the registers: a store pair to PLAIN/TWEAK signs,
+ * one to TWEAK/CIPHER authenticates, and a load from CIPHER returns the
+ * result.  A polled shared page could not do that, a load from it would not
+ * wait for the result.  Like the device, a channel holds the result of the
+ * last request only; a thread whose request was overtaken by another one on
+ * the same channel reads 0 and resubmits.
+ */
+#ifdef __aarch64__
+struct sim_channel {
+    uint64_t regs[4];
+    uint64_t result;
+    const void *owner;
+    char lock;
+} __attribute__ ((aligned(64)));
+
+static struct sim_channel sim_channels[PAC_PL_CHANNELS_MAX];
+static __thread char sim_thread;
+
+/* Not the device's cipher, only something in bits 48-63 that depends on both */
+static uint64_t sim_mac(uint64_t plain, uint64_t tweak)
+{
+    uint64_t x = (plain & 0xFFFFFFFFFFFFUL) ^ (tweak * 0x9E3779B97F4A7C15UL);
+
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9UL;
+    x ^= x >> 32;
+
+    return x << 48;
+}
+
+static uint64_t sim_get(ucontext_t *uc, unsigned r)
+{
+    return r == 31 ? 0 : uc->uc_mcontext.regs[r];
+}
+
+static void sim_set(ucontext_t *uc, unsigned r, uint64_t val)
+{
+    if (r != 31)
+        uc->uc_mcontext.regs[r] = val;
+}
+
+static void sim_fault(int sig, siginfo_t *info, void *ctx)
+{
+    ucontext_t *uc = ctx;
+    uintptr_t addr = (uintptr_t) info->si_addr;
+
+    if (addr < PAC_PL_ADDR || addr >= PAC_PL_ADDR + nr_channels * PAC_PL_PAGE) {
+        /* Not ours, fault again without us */
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    struct sim_channel *chan = &sim_channels[(addr - PAC_PL_ADDR) / PAC_PL_PAGE];
+    unsigned reg = (addr % PAC_PL_PAGE) / 8;
+    uint32_t inst = *(uint32_t *) uc->uc_mcontext.pc;
+    unsigned rt = inst & 0x1F, rt2 = (inst >> 10) & 0x1F;
+    uint64_t plain;
+
+    while (__atomic_test_and_set(&chan->lock, __ATOMIC_ACQUIRE))
+        ;
+
+    switch (inst >> 22) {
+    case 0x2A4:                 /* stp xt, xt2, [xn, #imm] */
+        chan->regs[reg & 3] = sim_get(uc, rt);
+        chan->regs[(reg + 1) & 3] = sim_get(uc, rt2);
+
+        if (reg == PAC_PL_PLAIN) {
+            plain = chan->regs[PAC_PL_PLAIN] & 0xFFFFFFFFFFFFUL;
+            chan->result = plain | sim_mac(plain, chan->regs[PAC_PL_TWEAK]);
+        } else if (reg == PAC_PL_TWEAK) {
+            plain = chan->regs[PAC_PL_CIPHER] & 0xFFFFFFFFFFFFUL;
+            chan->result = plain;
+            if ((chan->regs[PAC_PL_CIPHER] & ~0xFFFFFFFFFFFFUL) !=
+                sim_mac(plain, chan->regs[PAC_PL_TWEAK]))
+                chan->result |= 1UL << 62; /* Poison */
+        }
+        chan->owner = &sim_thread;
+        break;
+    case 0x3E4:                 /* str xt, [xn, #imm] */
+        chan->regs[reg & 3] = sim_get(uc, rt);
+        break;
+    case 0x3E5:                 /* ldr xt, [xn, #imm] */
+        if (reg == PAC_PL_CIPHER)
+            sim_set(uc, rt, chan->owner == &sim_thread ? chan->result : 0);
+        else if (reg == PAC_PL_MAGIC)
+            sim_set(uc, rt, PAC_PL_MAGIC_CHAN);
+        else
+            sim_set(uc, rt, chan->regs[reg & 3]);
+        break;
+    default:
+        __atomic_clear(&chan->lock, __ATOMIC_RELEASE);
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    __atomic_clear(&chan->lock, __ATOMIC_RELEASE);
+    uc->uc_mcontext.pc += 4;
+}
+
+static void pac_pl_sim(void)
+{
+    void *addr = mmap((void *) PAC_PL_ADDR, nr_channels * PAC_PL_PAGE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (addr == MAP_FAILED)
+        die("mmap: %s", strerror(errno));
+
+    struct sigaction sa = {
+        .sa_sigaction = sim_fault,
+        .sa_flags = SA_SIGINFO | SA_NODEFER,
+    };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL))
+        die("sigaction: %s", strerror(errno));
+}
+#else
+static void pac_pl_sim(void)
+{
+    die("PAC_PL_SIM needs aarch64");
+}
+#endif
+
+__attribute__ ((constructor))
+void pac_pl_init()
+{
+    char *channels = getenv("PAC_PL_CHANNELS");
+    if (channels) {
+        nr_channels = strtoul(channels, NULL, 0);
+        if (nr_channels < 1 || nr_channels > PAC_PL_CHANNELS_MAX)
+            die("Invalid number of channels: %s", channels);
+    }
+
+    char *sim = getenv("PAC_PL_SIM");
+    if (sim && strcmp(sim, "0"))
+        pac_pl_sim();
+    else
+        pac_pl_map();
 }